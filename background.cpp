@@ -1,22 +1,59 @@
 #include <iostream>
+#include <sstream>
+#include <algorithm>
 
 #include "background.hpp"
 #include "runtime.hpp"
+#include "conditions.hpp"
+#include "telemetry.hpp"
+#include "outbox.hpp"
+
+
+// Outcomes wait in the outbox until the server collects them
+static void report(const Commands &commands, const Results &results) {
+    Results::const_iterator result = results.begin();
+    for(Commands::const_iterator it = commands.begin();
+        it != commands.end() && result != results.end(); it++, result++) {
+        std::string value = result->value();
+        std::replace(value.begin(), value.end(), '\n', ' ');
+        std::stringstream event;
+        event << "TIME=" << (it->fire >= 0 ? it->fire : time(NULL))
+              << ":KIND=" << SCHEDULE_KIND_NAMES[it->kind]
+              << ":SUCCESS=" << !result->is_error()
+              << ":VALUE=" << value;
+        outbox.push(event.str());
+    }
+}
 
 
 void* background_worker(void *args) {
     NamedSchedule *sched = reinterpret_cast<NamedSchedule*>(args);
 
     while(true) {
+        // Sensors are read before the schedule is locked
+        sensor_sampler.sample();
+        telemetry.sample(time(NULL));
+
         Commands *commands;
         {
             time_t now = time(NULL);
             UnifiedLocker<NamedSchedule> safe(sched);
             commands = safe->get_commands(now);
+            // Switching off for schedules let go, stopped ones included
+            safe->take_releasing(*commands);
+            safe->begin_execution();
         }
 
         Executor exec(commands);
-        delete exec.execute(); // Exception handling should be done within commands
+        Results *results = exec.execute(); // Exception handling should be done within commands
+        report(*commands, *results);
+        delete results;
+        delete commands;
+
+        {
+            UnifiedLocker<NamedSchedule> safe(sched);
+            safe->finish_execution();
+        }
 
         sleep(RUNTIME_WAKE_PAUSE);
     }
@@ -1,5 +1,56 @@
+#include <cstring>
+
 #include "commands.hpp"
 #include "locker.hpp"
+#include "state.hpp"
+
+
+DeviceCommands device_commands;
+
+
+const char *DEVICE_OPERATION_NAMES[DEVICE_OPERATIONS] = {
+    "on", "off", "temperature"
+};
+
+
+// The names differ in length, so the length alone picks the candidate
+int device_operation(const char *name, size_t size) {
+    int candidate;
+    switch(size) {
+    case 2:
+        candidate = DEVICE_OPERATION_ON;
+        break;
+    case 3:
+        candidate = DEVICE_OPERATION_OFF;
+        break;
+    case 11:
+        candidate = DEVICE_OPERATION_TEMPERATURE;
+        break;
+    default:
+        return -1;
+    }
+    if(memcmp(DEVICE_OPERATION_NAMES[candidate], name, size) != 0) {
+        return -1;
+    }
+    return candidate;
+}
+
+
+unsigned int device_capabilities(device_type_t type) {
+    const unsigned int ON = 1u << DEVICE_OPERATION_ON;
+    const unsigned int OFF = 1u << DEVICE_OPERATION_OFF;
+    const unsigned int TEMPERATURE = 1u << DEVICE_OPERATION_TEMPERATURE;
+    switch(type) {
+    case DEVICE_BOILER:
+        return ON | OFF | TEMPERATURE;
+    case DEVICE_SWITCHER:
+        return ON | OFF;
+    case DEVICE_THERMOSWITCHER:
+        return TEMPERATURE;
+    default:
+        return 0;
+    }
+}
 
 
 SwitcherOn::SwitcherOn(device_reference_t *ref) {
@@ -11,15 +62,6 @@ SwitcherOn::SwitcherOn(device_reference_t *ref) {
 }
 
 
-SwitcherOn::~SwitcherOn() throw() {
-    try {
-        Locker<DeviceSwitcher, TargetDeviceDriver> cover(device);
-        cover->turn_off();
-    } catch(...) {
-    }
-}
-
-
 SwitcherOff::SwitcherOff(device_reference_t *ref) {
     device = dynamic_cast<DeviceSwitcher*>(ref->basepointer);
     if(device == NULL) {
@@ -39,57 +81,104 @@ TemperatureGet::TemperatureGet(device_reference_t *ref) {
 }
 
 
-Result *SwitcherOn::execute() throw() {
+Result SwitcherOn::execute() throw() {
     try {
-        Locker<DeviceSwitcher, TargetDeviceDriver> cover(device);
+        PriorityLocker<DeviceSwitcher, TargetDeviceDriver> cover(device);
         cover->turn_on();
-        return new IntResult(1);
+        device_state.relay(device, true);
+        return Result(1);
     } catch(TargetDeviceInternalError error) {
-        return new ErrorResult(RESULT_SERIAL_ERROR,
-                               error.what());
+        return Result(RESULT_SERIAL_ERROR, error.what());
     } catch(TargetDeviceOperationError error) {
-        return new ErrorResult(RESULT_SERIAL_ERROR,
-                               error.what());
+        return Result(RESULT_SERIAL_ERROR, error.what());
     } catch(TargetDeviceValidationError error) {
-        return new ErrorResult(RESULT_SERIAL_ERROR,
-                               error.what());
+        return Result(RESULT_SERIAL_ERROR, error.what());
     }
 }
 
 
 
 
-Result *SwitcherOff::execute() throw() {
+Result SwitcherOff::execute() throw() {
     try {
-        Locker<DeviceSwitcher, TargetDeviceDriver> cover(device);
+        PriorityLocker<DeviceSwitcher, TargetDeviceDriver> cover(device);
         cover->turn_off();
-        return new IntResult(1);
+        device_state.relay(device, false);
+        return Result(1);
     } catch(TargetDeviceInternalError error) {
-        return new ErrorResult(RESULT_SERIAL_ERROR,
-                               error.what());
+        return Result(RESULT_SERIAL_ERROR, error.what());
     } catch(TargetDeviceOperationError error) {
-        return new ErrorResult(RESULT_SERIAL_ERROR,
-                               error.what());
+        return Result(RESULT_SERIAL_ERROR, error.what());
     } catch(TargetDeviceValidationError error) {
-        return new ErrorResult(RESULT_SERIAL_ERROR,
-                               error.what());
+        return Result(RESULT_SERIAL_ERROR, error.what());
     }
 }
 
 
-Result *TemperatureGet::execute() throw() {
+Result TemperatureGet::execute() throw() {
     try {
-        Locker<DeviceTemperature, TargetDeviceDriver> cover(device);
+        PriorityLocker<DeviceTemperature, TargetDeviceDriver> cover(device);
         double res = cover->get_temperature();
-        return new FloatResult(res);
+        device_state.temperature(device, res);
+        return Result(res);
     } catch(TargetDeviceInternalError error) {
-        return new ErrorResult(RESULT_SERIAL_ERROR,
-                               error.what());
+        return Result(RESULT_SERIAL_ERROR, error.what());
     } catch(TargetDeviceOperationError error) {
-        return new ErrorResult(RESULT_SERIAL_ERROR,
-                               error.what());
+        return Result(RESULT_SERIAL_ERROR, error.what());
     } catch(TargetDeviceValidationError error) {
-        return new ErrorResult(RESULT_SERIAL_ERROR,
-                               error.what());
+        return Result(RESULT_SERIAL_ERROR, error.what());
+    }
+}
+
+
+DeviceCommands::~DeviceCommands() throw() {
+    clear();
+}
+
+
+void DeviceCommands::clear() {
+    for(size_t i = 0; i < commands.size(); i++) {
+        delete commands[i];
+    }
+    commands.clear();
+}
+
+
+void DeviceCommands::build(Devices &devices) {
+    clear();
+    commands.resize(devices.size()*DEVICE_OPERATIONS, NULL);
+    for(symbol_t id = 0; (size_t)id < devices.size(); id++) {
+        unsigned int supported = device_capabilities(devices.type(id));
+        for(int op = 0; op < DEVICE_OPERATIONS; op++) {
+            if(!(supported & (1u << op))) {
+                continue;
+            }
+            Command *&slot = commands[id*DEVICE_OPERATIONS + op];
+            try {
+                switch(op) {
+                case DEVICE_OPERATION_ON:
+                    slot = new SwitcherOn(devices.device(id));
+                    break;
+                case DEVICE_OPERATION_OFF:
+                    slot = new SwitcherOff(devices.device(id));
+                    break;
+                case DEVICE_OPERATION_TEMPERATURE:
+                    slot = new TemperatureGet(devices.device(id));
+                    break;
+                }
+            } catch(CommandSetupError e) {
+                ; // Left out, the device is not what its type claims
+            }
+        }
+    }
+}
+
+
+Command *DeviceCommands::get(symbol_t device,
+                             device_operation_t operation) const {
+    size_t slot = (size_t)device*DEVICE_OPERATIONS + operation;
+    if(device < 0 || slot >= commands.size()) {
+        return NULL;
     }
+    return commands[slot];
 }
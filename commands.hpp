@@ -1,12 +1,30 @@
 #ifndef _COMMANDS_HPP_INCLUDED_
 #define _COMMANDS_HPP_INCLUDED_
 
+#include <atomic>
+#include <vector>
+
 #include "targetdevice.hpp"
 #include "confbind.hpp"
 #include "runtime.hpp"
 #include "confbind.hpp"
 
 
+// Operations a device.op command may name, bit positions in a capability mask
+typedef enum {
+    DEVICE_OPERATION_ON,
+    DEVICE_OPERATION_OFF,
+    DEVICE_OPERATION_TEMPERATURE,
+    DEVICE_OPERATIONS
+} device_operation_t;
+
+extern const char *DEVICE_OPERATION_NAMES[DEVICE_OPERATIONS];
+
+// -1 for an unknown operation
+int device_operation(const char *name, size_t size);
+unsigned int device_capabilities(device_type_t type);
+
+
 class CommandSetupError: public std::exception, public std::string {
 public:
     ~CommandSetupError() throw() {};
@@ -22,10 +40,10 @@ class SwitcherOn: public Command {
 private:
     DeviceSwitcher *device;
 public:
-    ~SwitcherOn() throw();
+    ~SwitcherOn() throw() {};
     SwitcherOn(device_reference_t *ref);
 
-    Result *execute() throw();
+    Result execute() throw();
 };
 
 
@@ -36,7 +54,7 @@ public:
     ~SwitcherOff() throw() {};
     SwitcherOff(device_reference_t *ref);
 
-    Result *execute() throw();
+    Result execute() throw();
 };
 
 
@@ -48,7 +66,59 @@ public:
     ~TemperatureGet() throw() {};
     TemperatureGet(device_reference_t *ref);
 
-    Result *execute() throw();
+    Result execute() throw();
+};
+
+
+// Stands in for a shared command in a schedule, which owns and may cancel
+// it without touching the command or its other users. A handle to an "on"
+// command carries the matching "off" one, left to be run when the schedule
+// is dropped, replaced or stopped once the "on" has gone through.
+class CommandHandle: public Command {
+private:
+    Command &command;
+    Command *releasing;
+    std::atomic<bool> engaged;
+
+public:
+    ~CommandHandle() throw() {};
+    CommandHandle(Command &cmd, Command *release_cmd = NULL):
+        command(cmd), releasing(release_cmd), engaged(false) {};
+
+    Result execute() throw() {
+        Result result = command.execute();
+        if(releasing != NULL && !result.is_error()) {
+            engaged = true;
+        }
+        return result;
+    }
+    Command *releaser() throw() {
+        return engaged ? releasing : NULL;
+    }
+    Command &target() const {
+        return command;
+    }
+};
+
+
+// Commands built once per device and operation when the configuration is
+// loaded. They keep nothing between calls, so every request and schedule
+// naming the same device.op shares one of them.
+class DeviceCommands {
+private:
+    std::vector<Command*> commands; // DEVICE_OPERATIONS slots per device
+
+    void clear();
+
+public:
+    DeviceCommands() {};
+    ~DeviceCommands() throw();
+
+    void build(Devices &devices);
+    // NULL unless the device supports the operation
+    Command *get(symbol_t device, device_operation_t operation) const;
 };
 
+extern DeviceCommands device_commands;
+
 #endif
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+#include "conditions.hpp"
+#include "locker.hpp"
+#include "state.hpp"
+
+
+using namespace std;
+
+
+SensorSampler sensor_sampler;
+
+
+// Reads through the driver lane behind interactive requests. A sensor that
+// fails to answer leaves the reading untouched and false is returned.
+static bool read_sensor(DeviceTemperature *device, double &value) {
+    try {
+        PriorityScope scope(PRIORITY_BACKGROUND);
+        PriorityLocker<DeviceTemperature, TargetDeviceDriver> cover(device);
+        value = cover->get_temperature();
+        return true;
+    } catch(...) {
+        return false;
+    }
+}
+
+
+SensorSampler::SensorSampler(double eps): epsilon(eps) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+
+SensorSampler::~SensorSampler() throw() {
+    pthread_mutex_destroy(&mutex);
+}
+
+
+int SensorSampler::subscribe(DeviceTemperature *device,
+                             SensorObserver *observer) {
+    pthread_mutex_lock(&mutex);
+    size_t id = 0;
+    while(id < sensors.size() && sensors[id].device != device) {
+        id++;
+    }
+    if(id == sensors.size()) {
+        sensor_t sensor;
+        sensor.device = device;
+        sensor.value = sensor.notified = 0;
+        sensor.known = false;
+        sensors.push_back(sensor);
+    }
+    sensors[id].observers.push_back(observer);
+    pthread_mutex_unlock(&mutex);
+    return id;
+}
+
+
+void SensorSampler::unsubscribe(int sensor, SensorObserver *observer) {
+    pthread_mutex_lock(&mutex);
+    vector<SensorObserver*> &observers = sensors[sensor].observers;
+    observers.erase(remove(observers.begin(), observers.end(), observer),
+                    observers.end());
+    pthread_mutex_unlock(&mutex);
+}
+
+
+double SensorSampler::value(int sensor) {
+    pthread_mutex_lock(&mutex);
+    bool known = sensors[sensor].known;
+    double res = sensors[sensor].value;
+    DeviceTemperature *device = sensors[sensor].device;
+    pthread_mutex_unlock(&mutex);
+    if(known) {
+        return res;
+    }
+
+    // Nothing sampled yet, a sensor that does not answer compares false
+    if(!read_sensor(device, res)) {
+        return NAN;
+    }
+    pthread_mutex_lock(&mutex);
+    if(!sensors[sensor].known) {
+        sensors[sensor].value = sensors[sensor].notified = res;
+        sensors[sensor].known = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
+
+
+void SensorSampler::sample() {
+    // Sensors are never removed, so the hardware is read without the lock
+    vector<DeviceTemperature*> devices;
+    pthread_mutex_lock(&mutex);
+    for(size_t id = 0; id < sensors.size(); id++) {
+        devices.push_back(sensors[id].observers.empty() ? NULL :
+                          sensors[id].device);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    vector<double> values(devices.size());
+    for(size_t id = 0; id < devices.size(); id++) {
+        if(devices[id] == NULL) {
+            continue;
+        }
+        if(read_sensor(devices[id], values[id])) {
+            device_state.temperature(devices[id], values[id]);
+        } else {
+            devices[id] = NULL; // Keeps its last reading until it answers
+        }
+    }
+
+    pthread_mutex_lock(&mutex);
+    for(size_t id = 0; id < devices.size(); id++) {
+        if(devices[id] == NULL) {
+            continue;
+        }
+        sensor_t &sensor = sensors[id];
+        sensor.value = values[id];
+        if(!sensor.known || fabs(sensor.value - sensor.notified) > epsilon) {
+            sensor.known = true;
+            sensor.notified = sensor.value;
+            for(size_t i = 0; i < sensor.observers.size(); i++) {
+                sensor.observers[i]->notify();
+            }
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+ExpressionCondition::ExpressionCondition(
+    const condition_program_t &prg,
+    const vector<DeviceTemperature*> &snsrs):
+    program(prg), readings(snsrs.size(), 0), fresh(snsrs.size(), false),
+    timed(false) {
+    for(size_t i = 0; i < snsrs.size(); i++) {
+        sensors.push_back(sensor_sampler.subscribe(snsrs[i], this));
+    }
+    for(size_t pc = 0; pc < program.size(); pc++) {
+        timed = timed || program[pc].op == CONDITION_TIME;
+    }
+    stack.reserve(program.size());
+}
+
+
+ExpressionCondition::~ExpressionCondition() throw() {
+    for(size_t i = 0; i < sensors.size(); i++) {
+        sensor_sampler.unsubscribe(sensors[i], this);
+    }
+}
+
+
+double ExpressionCondition::reading(int sensor) {
+    if(!fresh[sensor]) {
+        readings[sensor] = sensor_sampler.value(sensors[sensor]);
+        fresh[sensor] = true;
+    }
+    return readings[sensor];
+}
+
+
+bool ExpressionCondition::evaluate(time_t now) {
+    fresh.assign(sensors.size(), false);
+    stack.clear();
+    int daytime = -1;
+
+    size_t pc = 0;
+    while(pc < program.size()) {
+        const condition_instr_t &instr = program[pc++];
+        switch(instr.op) {
+        case CONDITION_SENSOR:
+            stack.push_back(
+                instr.comparator(reading(instr.left), instr.value));
+            break;
+        case CONDITION_SENSORS:
+            stack.push_back(
+                instr.comparator(reading(instr.left), reading(instr.right)));
+            break;
+        case CONDITION_TIME:
+            if(daytime < 0) {
+                struct tm parts;
+                localtime_r(&now, &parts);
+                daytime = parts.tm_hour*100 + parts.tm_min;
+            }
+            stack.push_back(instr.comparator(daytime, instr.value));
+            break;
+        case CONDITION_NOT:
+            stack.back() = !stack.back();
+            break;
+        case CONDITION_AND:
+            if(!stack.back()) {
+                pc = instr.left;
+            } else {
+                stack.pop_back();
+            }
+            break;
+        case CONDITION_OR:
+            if(stack.back()) {
+                pc = instr.left;
+            } else {
+                stack.pop_back();
+            }
+            break;
+        }
+    }
+    return !stack.empty() && stack.back();
+}
@@ -3,8 +3,13 @@
 
 #include <map>
 #include <string>
+#include <vector>
+#include <atomic>
+
+#include <pthread.h>
 
 #include "confbind.hpp"
+#include "runtime.hpp"
 
 
 template <typename T>
@@ -37,20 +42,148 @@ bool compare_gt(T a, T b) {
 }
 
 
-class TemperatureCondition: public BaseCondition {
+const double SAMPLER_EPSILON = 0.1; // Degrees a reading has to move
+
+
+// Gets notified by the sampler when a sensor it reads has changed
+class SensorObserver {
+private:
+    std::atomic<bool> stale;
+
+public:
+    SensorObserver(): stale(true) {};
+    virtual ~SensorObserver() throw() {};
+
+    void notify() {
+        stale = true;
+    }
+
+    bool consume() {
+        return stale.exchange(false);
+    }
+};
+
+
+// Reads every sensor some condition subscribed to once per tick and
+// notifies the subscribers of the sensors which have moved by more than
+// the epsilon since the last notification. Conditions take readings from
+// here instead of the hardware.
+class SensorSampler {
+private:
+    struct sensor_t {
+        DeviceTemperature *device;
+        double value, notified;
+        bool known;
+        std::vector<SensorObserver*> observers;
+    };
+
+    std::vector<sensor_t> sensors;
+    pthread_mutex_t mutex;
+    double epsilon;
+
+public:
+    SensorSampler(double eps = SAMPLER_EPSILON);
+    ~SensorSampler() throw();
+
+    int subscribe(DeviceTemperature *device, SensorObserver *observer);
+    void unsubscribe(int sensor, SensorObserver *observer);
+    double value(int sensor);
+    void sample();
+};
+
+extern SensorSampler sensor_sampler;
+
+
+class TemperatureCondition: public BaseCondition, public SensorObserver {
 private:
-    DeviceTemperature *device;
-    double bound;
+    int sensor;
+    double bound, release;
     bool (*comparator)(double, double);
 
 public:
     TemperatureCondition(DeviceTemperature *dvc, double bnd,
                          bool (*cmprtr)(double, double)):
-        device(dvc), bound(bnd), comparator(cmprtr) {};
-    ~TemperatureCondition() throw() {};
+        bound(bnd), release(bnd), comparator(cmprtr) {
+        sensor = sensor_sampler.subscribe(dvc, this);
+    };
+    // Engages at bnd and keeps engaged until the reading crosses rls
+    TemperatureCondition(DeviceTemperature *dvc, double bnd, double rls,
+                         bool (*cmprtr)(double, double)):
+        bound(bnd), release(rls), comparator(cmprtr) {
+        sensor = sensor_sampler.subscribe(dvc, this);
+    };
+    ~TemperatureCondition() throw() {
+        sensor_sampler.unsubscribe(sensor, this);
+    };
+
+    bool changed() {
+        return consume();
+    }
+
+    bool indeed() {
+        return comparator(sensor_sampler.value(sensor), bound);
+    }
+
+    bool holds() {
+        double value = sensor_sampler.value(sensor);
+        bool res = comparator(value, release);
+        if(res && !comparator(value, bound)) {
+            scheduler_stats.banded[SCHEDULE_CONDITIONED]++;
+        }
+        return res;
+    }
+};
+
+
+typedef enum {
+    CONDITION_SENSOR,   // sensor against a constant
+    CONDITION_SENSORS,  // sensor against another sensor
+    CONDITION_TIME,     // time of the day as HHMM against a constant
+    CONDITION_NOT,
+    CONDITION_AND,      // jumps over the right operand if false on the top
+    CONDITION_OR        // jumps over the right operand if true on the top
+} condition_op_t;
+
+
+struct condition_instr_t {
+    condition_op_t op;
+    bool (*comparator)(double, double);
+    int left, right;    // Sensor indexes, a jump target for AND and OR
+    double value;
+};
+
+
+typedef std::vector<condition_instr_t> condition_program_t;
+
+
+// Boolean expression over several sensors compiled into a flat program.
+// Every sensor is looked up at most once per evaluation and only when the
+// short-circuited result still depends on it.
+class ExpressionCondition: public BaseCondition, public SensorObserver {
+private:
+    condition_program_t program;
+    std::vector<int> sensors;
+    std::vector<double> readings;
+    std::vector<bool> fresh;
+    std::vector<char> stack;
+    bool timed;
+
+    double reading(int sensor);
+
+public:
+    ExpressionCondition(const condition_program_t &prg,
+                        const std::vector<DeviceTemperature*> &snsrs);
+    ~ExpressionCondition() throw();
+
+    bool evaluate(time_t now);
+
+    // Time of the day moves on its own
+    bool changed() {
+        return consume() || timed;
+    }
 
     bool indeed() {
-        return comparator(device->get_temperature(), bound);
+        return evaluate(time(NULL));
     }
 };
 
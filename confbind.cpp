@@ -1,3 +1,5 @@
+#include <stdexcept>
+
 #include "confbind.hpp"
 
 
@@ -59,10 +61,22 @@ double DeviceTemperature::get_temperature() {
 
 
 Devices::~Devices() throw() {
-    for(map<string, device_reference_t*>::iterator it = this->begin();
-        it != this->end(); it++) {
-        delete it->second;
+    for(size_t id = 0; id < references.size(); id++) {
+        delete references[id];
+    }
+}
+
+
+void Devices::add(const string &name, device_type_t type,
+                  device_reference_t *ref) {
+    symbol_t id = names.intern(name);
+    if((size_t)id >= references.size()) {
+        references.resize(id + 1, NULL);
+        types.resize(id + 1, DEVICE_UNDEFINED);
     }
+    delete references[id];
+    references[id] = ref;
+    types[id] = type;
 }
 
 
@@ -72,20 +86,20 @@ Devices::Devices(Drivers &drivers, const config_devices_t &conf) {
         switch(it->second->id()) {
         case DEVICE_SWITCHER: {
             Switcher *sw = dynamic_cast<Switcher*>(it->second);
-            (*this)[it->first] =
-                new device_reference_t(new DeviceSwitcher(drivers, sw));
+            add(it->first, DEVICE_SWITCHER,
+                new device_reference_t(new DeviceSwitcher(drivers, sw)));
             break;
         }
         case DEVICE_THERMOSWITCHER: {
             Thermoswitcher *trm = dynamic_cast<Thermoswitcher*>(it->second);
-            (*this)[it->first] =
-                new device_reference_t(new DeviceTemperature(drivers, trm));
+            add(it->first, DEVICE_THERMOSWITCHER,
+                new device_reference_t(new DeviceTemperature(drivers, trm)));
             break;
         }
         case DEVICE_BOILER: {
             Boiler *blr = dynamic_cast<Boiler*>(it->second);
-            (*this)[it->first] =
-                new device_reference_t(new DeviceBoiler(drivers, blr));
+            add(it->first, DEVICE_BOILER,
+                new device_reference_t(new DeviceBoiler(drivers, blr)));
             break;
         }
         default:
@@ -95,6 +109,18 @@ Devices::Devices(Drivers &drivers, const config_devices_t &conf) {
 }
 
 
-device_reference_t *Devices::device(string name) {
-    return this->at(name);
+device_reference_t *Devices::device(const string &name) {
+    symbol_t id = names.lookup(name);
+    if(id == NO_SYMBOL) {
+        throw out_of_range(name);
+    }
+    return references[id];
+}
+
+
+device_reference_t *Devices::device(symbol_t id) {
+    if(!names.valid(id)) {
+        throw out_of_range("No such device");
+    }
+    return references[id];
 }
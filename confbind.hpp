@@ -3,6 +3,7 @@
 
 #include "confparser.hpp"
 #include "targetdevice.hpp"
+#include "symbols.hpp"
 
 class Drivers {
 protected:
@@ -79,11 +80,36 @@ public:
 };
 
 
-class Devices: public std::map<std::string, device_reference_t*> {
+class Devices {
+private:
+    SymbolTable names;
+    std::vector<device_reference_t*> references;
+    std::vector<device_type_t> types;
+
+    void add(const std::string &name, device_type_t type,
+             device_reference_t *ref);
+
 public:
     virtual ~Devices() throw();
     Devices(Drivers &drivers, const config_devices_t &conf);
 
-    device_reference_t *device(std::string name);
+    symbol_t lookup(const std::string &name) const {
+        return names.lookup(name);
+    }
+    symbol_t lookup(const char *name, size_t size) const {
+        return names.lookup(name, size);
+    }
+    const std::string &name(symbol_t id) const {
+        return names.name(id);
+    }
+    size_t size() const {
+        return references.size();
+    }
+    device_type_t type(symbol_t id) const {
+        return names.valid(id) ? types[id] : DEVICE_UNDEFINED;
+    }
+
+    device_reference_t *device(const std::string &name);
+    device_reference_t *device(symbol_t id);
 };
 #endif
@@ -10,6 +10,30 @@
 #define FREQUENCY_LOWER_BOUND 0
 #define FREQUENCY_UPPER_BOUND 400
 
+#define SERIAL_RESPONSE_TIMEOUT 2000 // milliseconds
+
+#define CONTROL_HEARTBEAT_INTERVAL 30 // seconds
+#define CONTROL_HEARTBEAT_MAX 600 // seconds
+#define CONTROL_HEARTBEAT_MISSES 3
+#define CONTROL_RECONNECT_MIN 1 // seconds
+#define CONTROL_RECONNECT_MAX 120 // seconds
+#define CONTROL_CONNECT_TIMEOUT 10000 // milliseconds
+#define CONTROL_CONNECT_STAGGER 250 // milliseconds
+#define CONTROL_MAX_FRAME (16*1024*1024) // bytes
+#define LOCAL_CONTROL_SOCKET "/var/run/tdevice.sock"
+#define LOCAL_MAX_EVENTS 32
+#define LOCAL_SOCKET_MODE 0660 // Relays are switched through it
+#define LOCAL_READ_LIMIT 65536 // Bytes taken from one client per wakeup
+#define RESOLVER_TTL 300 // seconds
+#define RESOLVER_TIMEOUT 5000 // milliseconds
+#define TELEMETRY_INTERVAL 60 // seconds
+#define TELEMETRY_CAPACITY 1440 // samples per sensor
+#define TELEMETRY_BATCH 720 // samples per upload
+#define OUTBOX_DIRECTORY "/var/spool/tdevice"
+#define OUTBOX_MAX_SIZE (1024*1024) // bytes
+#define OUTBOX_SEGMENT_SIZE (64*1024) // bytes
+#define OUTBOX_BATCH 200 // events per upload
+
 #define PORT_LOWER_BOUND 1001
 #define PORT_UPPER_BOUND 65535
 
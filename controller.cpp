@@ -1,11 +1,44 @@
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <stdexcept>
 #include <memory>
+#include <iostream>
+
+#include <unistd.h>
 
 #include "controller.hpp"
+#include "constants.hpp"
+#include "locker.hpp"
+#include "outbox.hpp"
 
 
 using namespace std;
 
+
+AdaptiveInterval::AdaptiveInterval(int _lower, int _upper):
+    lower(_lower), upper(_upper), value(_lower) {
+    seed = time(NULL) ^ getpid();
+}
+
+
+int AdaptiveInterval::jittered() {
+    int half = value/2;
+    return value - half + rand_r(&seed) % (half + 1);
+}
+
+
+// Server heartbeats may carry INTERVAL=<seconds> to steer ours
+static int heartbeat_hint(const message_view_t &message) {
+    const char *end = message.data + message.size;
+    const char *pos = search(message.data, end, "INTERVAL=", "INTERVAL=" + 9);
+    if(pos == end) {
+        return 0;
+    }
+    return strtol(string(pos + 9, end).c_str(), NULL, 10);
+}
+
+
 string Controller::greetings() {
     stringstream buf;
     buf << "READY" << "\n";
@@ -14,6 +47,7 @@ string Controller::greetings() {
     buf << "STARTUP=" << Config::startup << "\n";
     buf << "CONFIG=" << Config::conf_change << "\n";
     buf << "CONFDIGEST=" << Config::md5hexdigest << "\n";
+    buf << "EVENTS=" << outbox.pending() << "\n";
 
     return buf.str();
 }
@@ -28,6 +62,17 @@ BaseConnection* Controller::get_connection() {
 }
 
 
+// Scheduler statistics along with those of the control connection
+class ControlStatsModel: public StatsModel {
+public:
+    ~ControlStatsModel() throw() {};
+
+    string execute(model_call_params_t &params) throw(InteruptionHandling) {
+        return StatsModel::execute(params) + handshake_stats.view();
+    }
+};
+
+
 class ModelMap: public map<string, BaseModel*> {
 public:
     ~ModelMap() {
@@ -40,6 +85,10 @@ public:
     ModelMap() {
         (*this)["CONFIG"] = new ConfigInfoModel;
         (*this)["INSTRUCTIONS"] = new InstructionListModel;
+        (*this)["STATS"] = new ControlStatsModel;
+        (*this)["STATE"] = new StateModel;
+        (*this)["TELEMETRY"] = new TelemetryModel;
+        (*this)["EVENTS"] = new EventsModel;
     }
 };
 
@@ -55,34 +104,59 @@ std::string response(bool success, string body) {
 }
 
 
-void Controller::execute() {
-    auto_ptr<BaseConnection> conn(get_connection());
+// Header line is the request type, optionally followed by ":REQUEST=<id>"
+struct request_t {
+    string type, id, data;
 
-    conn->send(greetings());
-
-    string data = conn->receive();
-    size_t pos = data.find('\n');
-    string req_type;
-    string req_data;
-    string result;
+    request_t(const message_view_t &source) {
+        const char *eol = static_cast<const char*>(
+            memchr(source.data, '\n', source.size));
+        string header;
+        if(eol == NULL) {
+            header.assign(source.data, source.size);
+        } else {
+            header.assign(source.data, eol);
+            data.assign(eol + 1, source.data + source.size);
+        }
 
-    if(pos == string::npos) {
-        req_type = data;
-        req_data = "";
-    } else {
-        req_type = data.substr(0, pos);
-        req_data = data.substr(pos + 1, data.length() - pos - 1);
+        const string TAG = ":REQUEST=";
+        size_t pos = header.find(TAG);
+        if(pos == string::npos) {
+            type = header;
+        } else {
+            type = header.substr(0, pos);
+            id = header.substr(pos + TAG.length());
+        }
     }
+};
+
+
+static message_view_t view(const string &data) {
+    message_view_t message = {data.data(), data.size()};
+    return message;
+}
+
+
+string Controller::handle(const string &data) {
+    return handle(view(data));
+}
+
+
+string Controller::handle(const message_view_t &message) {
+    request_t req(message);
+    string result;
 
     try {
-        BaseModel *model = models.at(req_type);
+        BaseModel *model = models.at(req.type);
         model_call_params_t params;
         params.config = config;
         params.devices = devices;
         params.sched = sched;
-        params.request_data = req_data;
+        params.request_data = req.data;
         params.res = resources;
         params.busy = this->busy_resources;
+        // Remote and local clients are served from different threads
+        UnifiedLocker<BusyResources> safe(busy_resources);
         try {
             result = response(true, model->execute(params));
         } catch(InteruptionHandling e) {
@@ -91,8 +165,121 @@ void Controller::execute() {
             result = response(false, e.what());
         }
     } catch(out_of_range e) {
-        result = response(false, req_type + ": operation not supported");
+        result = response(false, req.type + ": operation not supported");
     }
 
-    conn->send(result);
+    if(!req.id.empty()) {
+        result = "REQUEST=" + req.id + "\n" + result;
+    }
+    return result;
+}
+
+
+vector<string> Controller::handle(const vector<string> &batch) {
+    vector<string> result;
+    vector<bool> done(batch.size(), false);
+
+    for(size_t i = 0; i < batch.size(); i++) {
+        request_t req(view(batch[i]));
+        ModelMap::iterator it = models.find(req.type);
+        if(!req.id.empty() && it != models.end() &&
+           it->second->independent(req.data)) {
+            result.push_back(handle(batch[i]));
+            done[i] = true;
+        }
+    }
+    for(size_t i = 0; i < batch.size(); i++) {
+        if(!done[i]) {
+            result.push_back(handle(batch[i]));
+        }
+    }
+    return result;
+}
+
+
+void Controller::execute() {
+    auto_ptr<BaseConnection> conn(get_connection());
+
+    conn->send(greetings());
+    conn->send(handle(conn->receive_view()));
+}
+
+
+void Controller::serve() {
+    session_up = false;
+    auto_ptr<BaseConnection> conn(get_connection());
+
+    // Heartbeats are frequent while requests flow and back off when idle,
+    // each one announces when the next is due
+    AdaptiveInterval heartbeat(CONTROL_HEARTBEAT_INTERVAL,
+                               CONTROL_HEARTBEAT_MAX);
+    stringstream hello;
+    hello << greetings() << "HEARTBEAT=" << heartbeat.current() << "\n";
+    conn->send(hello.str());
+    session_up = true;
+
+    int misses = 0;
+    while(true) {
+        if(!conn->wait(heartbeat.current()*1000)) {
+            if(misses++ >= CONTROL_HEARTBEAT_MISSES) {
+                throw ConnectionError("Server stopped answering heartbeats");
+            }
+            heartbeat.idle();
+            stringstream beat;
+            beat << "HEARTBEAT\nINTERVAL=" << heartbeat.current() << "\n";
+            conn->send(beat.str());
+            continue;
+        }
+
+        // Take everything the server has pipelined so far
+        // Requests are copied out of the receive buffer as they have to
+        // outlive it, heartbeats are looked at in place
+        vector<string> batch;
+        do {
+            message_view_t message = conn->receive_view();
+            if(message.size < 9 || memcmp(message.data, "HEARTBEAT", 9) != 0) {
+                batch.push_back(message.str());
+            } else {
+                int hint = heartbeat_hint(message);
+                if(hint > 0) {
+                    heartbeat.hint(hint);
+                }
+            }
+        } while(conn->wait(0));
+        misses = 0;
+        if(batch.empty()) {
+            continue;
+        }
+        heartbeat.active();
+
+        vector<string> responses = handle(batch);
+        for(size_t i = 0; i < responses.size(); i++) {
+            conn->send(responses[i]);
+        }
+    }
+}
+
+
+void Controller::run() {
+    AdaptiveInterval backoff(CONTROL_RECONNECT_MIN, CONTROL_RECONNECT_MAX);
+    while(true) {
+        try {
+            serve();
+        } catch(ConnectionError &e) {
+            cout << "Control session: " << e.what() << endl;
+            if(session_up) {
+                string error = e.what();
+                replace(error.begin(), error.end(), '\n', ' ');
+                stringstream event;
+                event << "TIME=" << time(NULL) << ":SESSION=LOST:ERROR="
+                      << error;
+                outbox.push(event.str());
+            }
+        }
+        if(session_up) {
+            backoff.active();
+        }
+        sleep(backoff.jittered());
+        backoff.idle();
+    }
 }
@@ -2,11 +2,47 @@
 #define _CONTROLER_HPP_INCLUDED_
 
 
+#include <algorithm>
+
 #include "confparser.hpp"
 #include "confbind.hpp"
 #include "network.hpp"
 #include "model.hpp"
 #include "resourcemanager.hpp"
+#include "locker.hpp"
+
+
+// Interval which shrinks to the minimum on activity and doubles up to the
+// maximum while idle. Jittered values keep routers restarted together from
+// reconnecting in lockstep.
+class AdaptiveInterval {
+private:
+    int lower, upper, value;
+    unsigned int seed;
+
+public:
+    AdaptiveInterval(int _lower, int _upper);
+
+    int current() const {
+        return value;
+    }
+
+    void active() {
+        value = lower;
+    }
+
+    void idle() {
+        value = std::min(value*2, upper);
+    }
+
+    // Adopts a value suggested by the server within the bounds
+    void hint(int suggested) {
+        value = std::max(lower, std::min(suggested, upper));
+    }
+
+    // Uniformly random value from the upper half of the current one
+    int jittered();
+};
 
 
 class Controller {
@@ -15,26 +51,47 @@ private:
     Devices *devices;
     NamedSchedule *sched;
     Resources *resources;
-    std::map<std::string, std::list<std::string> > *busy_resources;
+    BusyResources *busy_resources;
+    ResourcesReclaimer *reclaimer;
+    bool session_up;
 
 public:
     Controller(Config *_conf,
                Devices *_devices,
                NamedSchedule *_sched,
                Resources *_res):
-        config(_conf), devices(_devices), sched(_sched), resources(_res) {
-        busy_resources = new std::map<std::string,
-                                      std::list<std::string> >;
+        config(_conf), devices(_devices), sched(_sched), resources(_res),
+        session_up(false) {
+        busy_resources = new BusyResources;
+        reclaimer = new ResourcesReclaimer(*busy_resources, *resources);
+        UnifiedLocker<NamedSchedule> safe(sched);
+        safe->on_reclaim(reclaimer);
     };
     virtual ~Controller() throw() {
+        {
+            UnifiedLocker<NamedSchedule> safe(sched);
+            safe->on_reclaim(NULL);
+        }
+        delete reclaimer;
         delete busy_resources;
     };
 
     virtual BaseConnection* get_connection();
 
     std::string greetings();
+    std::string handle(const std::string &data);
+    std::string handle(const message_view_t &message);
+    // Answers requests pipelined by the server, those tagged with a
+    // REQUEST id which their model finds independent go first
+    std::vector<std::string> handle(const std::vector<std::string> &batch);
 
+    // Serves a single request on a fresh connection
     void execute();
+    // Serves requests pushed by the server over one long-lived connection,
+    // returns only by throwing ConnectionError once the session is lost
+    void serve();
+    // Keeps a session up forever, reconnecting with a jittered backoff
+    void run();
 };
 
 #endif
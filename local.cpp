@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "local.hpp"
+#include "constants.hpp"
+
+
+using namespace std;
+
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+LocalListener::LocalListener(Controller &ctrl, const string &socket_path):
+    controller(ctrl), path(socket_path), listener(-1), events(-1) {
+    struct sockaddr_un addr;
+    if(path.length() >= sizeof(addr.sun_path)) {
+        throw ConnectionError("Local socket path is too long: " + path);
+    }
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0) {
+        throw ConnectionError("socket: " + get_system_error());
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    // A socket file left by a previous run
+    unlink(path.c_str());
+    // Owner and group only, before anyone may connect
+    if(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+       chmod(path.c_str(), LOCAL_SOCKET_MODE) < 0 ||
+       listen(listener, SOMAXCONN) < 0) {
+        string error = get_system_error();
+        close(listener);
+        throw ConnectionError("Cannot listen on " + path + ": " + error);
+    }
+    set_nonblocking(listener);
+
+    events = epoll_create(LOCAL_MAX_EVENTS);
+    if(events < 0) {
+        string error = get_system_error();
+        close(listener);
+        throw ConnectionError("epoll_create: " + error);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listener;
+    epoll_ctl(events, EPOLL_CTL_ADD, listener, &ev);
+}
+
+
+LocalListener::~LocalListener() throw() {
+    while(!clients.empty()) {
+        drop(clients.begin()->first);
+    }
+    close(events);
+    close(listener);
+    unlink(path.c_str());
+}
+
+
+void LocalListener::accept_clients() {
+    while(true) {
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0) {
+            return;
+        }
+        set_nonblocking(fd);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if(epoll_ctl(events, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            continue;
+        }
+        clients[fd] = new client_t;
+    }
+}
+
+
+void LocalListener::drop(int fd) {
+    map<int, client_t*>::iterator it = clients.find(fd);
+    if(it == clients.end()) {
+        return;
+    }
+    epoll_ctl(events, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    delete it->second;
+    clients.erase(it);
+}
+
+
+// False on garbage or a failed read, a half close only marks the client
+bool LocalListener::receive(int fd, client_t *client) {
+    const size_t READ_SIZE = 4096;
+    bool open = true;
+    // Whatever is left over is read on the next wakeup
+    for(size_t total = 0; total < LOCAL_READ_LIMIT;) {
+        char *dest = client->reader.space(READ_SIZE);
+        ssize_t received = read(fd, dest, min(client->reader.available(),
+                                              LOCAL_READ_LIMIT - total));
+        if(received < 0 && errno == EINTR) {
+            continue;
+        }
+        if(received == 0) {
+            // Requests sent before a half close are still answered
+            client->closing = true;
+            break;
+        }
+        if(received < 0) {
+            open = errno == EAGAIN || errno == EWOULDBLOCK;
+            break;
+        }
+        client->reader.commit(received);
+        total += received;
+    }
+
+    message_view_t message;
+    try {
+        while(client->reader.next(message)) {
+            client->pending += FrameReader::frame(
+                controller.handle(message));
+        }
+    } catch(ConnectionError &e) {
+        return false; // Garbage instead of frames
+    }
+    return open;
+}
+
+
+bool LocalListener::flush(int fd, client_t *client) {
+    while(client->sent < client->pending.length()) {
+        ssize_t written = write(fd, client->pending.data() + client->sent,
+                                client->pending.length() - client->sent);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+        client->sent += written;
+    }
+
+    // Wait for the socket to drain only while something is left, and
+    // for nothing else once the client is closing
+    struct epoll_event ev;
+    ev.data.fd = fd;
+    if(client->sent == client->pending.length()) {
+        client->pending.clear();
+        client->sent = 0;
+        ev.events = client->closing ? 0 : EPOLLIN;
+    } else {
+        ev.events = client->closing ? EPOLLOUT : EPOLLIN | EPOLLOUT;
+    }
+    epoll_ctl(events, EPOLL_CTL_MOD, fd, &ev);
+    return true;
+}
+
+
+void LocalListener::poll(int timeout) {
+    struct epoll_event ready[LOCAL_MAX_EVENTS];
+    int count = epoll_wait(events, ready, LOCAL_MAX_EVENTS, timeout);
+    for(int i = 0; i < count; i++) {
+        int fd = ready[i].data.fd;
+        if(fd == listener) {
+            accept_clients();
+            continue;
+        }
+
+        map<int, client_t*>::iterator it = clients.find(fd);
+        if(it == clients.end()) {
+            continue;
+        }
+        client_t *client = it->second;
+        if(ready[i].events & EPOLLERR) {
+            drop(fd);
+            continue;
+        }
+        bool open = true;
+        if(!client->closing && (ready[i].events & (EPOLLIN | EPOLLHUP))) {
+            open = receive(fd, client);
+        }
+        if(!flush(fd, client) || !open ||
+           (client->closing && client->pending.empty())) {
+            drop(fd);
+        }
+    }
+}
+
+
+void* local_worker(void *args) {
+    LocalListener *listener = reinterpret_cast<LocalListener*>(args);
+    while(true) {
+        listener->poll(-1);
+    }
+    return NULL;
+}
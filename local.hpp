@@ -0,0 +1,54 @@
+#ifndef _LOCAL_HPP_INCLUDED_
+#define _LOCAL_HPP_INCLUDED_
+
+#include <map>
+#include <string>
+
+#include "controller.hpp"
+#include "network.hpp"
+
+
+// Serves the control protocol to on-site clients over a Unix domain
+// socket. Requests and responses are framed as on the remote session and
+// go through the same models; all clients share one epoll loop. Requests
+// are handled on that loop, so a slow one such as a VALUE waiting on the
+// serial line holds up the other clients meanwhile. A client gets at most
+// LOCAL_READ_LIMIT bytes read per wakeup, a flooding one can not keep the
+// rest from their turn.
+class LocalListener {
+private:
+    struct client_t {
+        FrameReader reader;
+        std::string pending;
+        size_t sent;
+        bool closing; // Half closed, dropped once the answers are sent
+
+        client_t(): sent(0), closing(false) {};
+    };
+
+    Controller &controller;
+    std::string path;
+    int listener, events;
+    std::map<int, client_t*> clients;
+
+    void accept_clients();
+    void drop(int fd);
+    bool receive(int fd, client_t *client);
+    bool flush(int fd, client_t *client);
+
+public:
+    LocalListener(Controller &ctrl, const std::string &socket_path);
+    ~LocalListener() throw();
+
+    // Handles whatever is ready within timeout milliseconds
+    void poll(int timeout);
+
+    size_t size() const {
+        return clients.size();
+    }
+};
+
+
+void* local_worker(void *args);
+
+#endif
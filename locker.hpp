@@ -3,6 +3,8 @@
 
 #include <pthread.h>
 
+#include "metrics.hpp"
+
 
 template <class T>
 class LockType {
@@ -46,4 +48,149 @@ public:
     UnifiedLocker(T *obj): Locker<T, T>(obj) {};
 };
 
+typedef enum {
+    PRIORITY_INTERACTIVE,
+    PRIORITY_BACKGROUND,
+    PRIORITY_CLASSES
+} priority_t;
+
+
+// Priority of the work the current thread is doing, background by default.
+class PriorityScope {
+private:
+    priority_t previous;
+    static priority_t &current_ref() {
+        static thread_local priority_t current = PRIORITY_BACKGROUND;
+        return current;
+    }
+
+public:
+    PriorityScope(priority_t priority): previous(current_ref()) {
+        current_ref() = priority;
+    }
+    ~PriorityScope() throw() {
+        current_ref() = previous;
+    }
+
+    static priority_t current() {
+        return current_ref();
+    }
+};
+
+
+// A lock with priority classes: interactive requests are granted ahead of
+// queued background work, but no more than STARVATION_LIMIT times in a row
+// while background work is waiting.
+class PriorityLane {
+public:
+    static const int STARVATION_LIMIT = 4;
+
+private:
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool busy;
+    int waiting[PRIORITY_CLASSES];
+    int interactive_streak;
+    Histogram latencies[PRIORITY_CLASSES];
+
+    bool may_pass(priority_t priority) {
+        if(busy) {
+            return false;
+        }
+        bool starving = waiting[PRIORITY_BACKGROUND] > 0 &&
+            interactive_streak >= STARVATION_LIMIT;
+        if(priority == PRIORITY_INTERACTIVE) {
+            return !starving;
+        }
+        return waiting[PRIORITY_INTERACTIVE] == 0 || starving;
+    }
+
+public:
+    PriorityLane(): busy(false), interactive_streak(0) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+        for(int i = 0; i < PRIORITY_CLASSES; i++) {
+            waiting[i] = 0;
+        }
+    }
+
+    ~PriorityLane() throw() {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void acquire(priority_t priority) {
+        pthread_mutex_lock(&mutex);
+        waiting[priority]++;
+        while(!may_pass(priority)) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        waiting[priority]--;
+        busy = true;
+        if(priority == PRIORITY_INTERACTIVE) {
+            interactive_streak++;
+        } else {
+            interactive_streak = 0;
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void release() {
+        pthread_mutex_lock(&mutex);
+        busy = false;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    int queued(priority_t priority) {
+        pthread_mutex_lock(&mutex);
+        int res = waiting[priority];
+        pthread_mutex_unlock(&mutex);
+        return res;
+    }
+
+    // Time from the lock request to its release, in microseconds
+    Histogram &latency(priority_t priority) {
+        return latencies[priority];
+    }
+};
+
+
+template <class T>
+class LaneType {
+public:
+    static PriorityLane lane;
+};
+template <class T>
+PriorityLane LaneType<T>::lane;
+
+
+template <class T, class L>
+class PriorityLocker {
+private:
+    T *object;
+    priority_t priority;
+    unsigned long long started;
+
+public:
+    PriorityLocker(T *obj) throw():
+        object(obj), priority(PriorityScope::current()),
+        started(monotonic_usec()) {
+        LaneType<L>::lane.acquire(priority);
+    }
+
+    virtual ~PriorityLocker() throw() {
+        LaneType<L>::lane.release();
+        LaneType<L>::lane.latency(priority).record(monotonic_usec() - started);
+    }
+
+    T& operator*() const throw() {
+        return *object;
+    }
+
+    T* operator->() const throw() {
+        return object;
+    }
+};
+
 #endif
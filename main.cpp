@@ -4,6 +4,7 @@
 #include <iomanip>
 
 #include <unistd.h>
+#include <signal.h>
 #include <sys/syslog.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -26,6 +27,9 @@
 #include "runtime.hpp"
 #include "background.hpp"
 #include "controller.hpp"
+#include "local.hpp"
+#include "telemetry.hpp"
+#include "outbox.hpp"
 #include "resourcemanager.hpp"
 
 
@@ -95,6 +99,7 @@ public:
 
         drivers = new Drivers(conf->drivers());
         devices = new Devices(*drivers, conf->devices());
+        device_commands.build(*devices);
         sched = new NamedSchedule;
 
         auto device_view = conf->devices().view();
@@ -111,13 +116,10 @@ public:
         Config::md5hexdigest = md5hd.str();
 
         // Switching off devices
-        for(Devices::iterator it = devices->begin();
-            it != devices->end(); it++) {
-            try {
-                SwitcherOff command(it->second);
-                command.execute();
-            } catch(CommandSetupError e) {
-                ; // Do nothing, we are just setting them all off wherever possible
+        for(symbol_t id = 0; (size_t)id < devices->size(); id++) {
+            Command *command = device_commands.get(id, DEVICE_OPERATION_OFF);
+            if(command != NULL) {
+                command->execute();
             }
         }
 
@@ -231,9 +233,11 @@ int main(int argc, char **argv) {
 
     bool daemonize = false;
     string config_file_name = CONFIG_FILE_NAME;
+    string local_socket_name = LOCAL_CONTROL_SOCKET;
+    string outbox_directory = OUTBOX_DIRECTORY;
     int opt;
 
-    while((opt = getopt(argc, argv, "hdc:")) != -1) {
+    while((opt = getopt(argc, argv, "hdc:s:q:")) != -1) {
         switch(opt) {
         case 'h': {
             cout << "Usage:" << endl;
@@ -244,6 +248,14 @@ int main(int argc, char **argv) {
                 string("-c <arg> (=") +
                 string(CONFIG_FILE_NAME) +
                 ")", "configuration file path");
+            formatter.add_raw(
+                string("-s <arg> (=") +
+                string(LOCAL_CONTROL_SOCKET) +
+                ")", "local control socket path");
+            formatter.add_raw(
+                string("-q <arg> (=") +
+                string(OUTBOX_DIRECTORY) +
+                ")", "directory events are kept in while offline");
             cout << formatter << endl;
             return 0;
         }
@@ -253,8 +265,14 @@ int main(int argc, char **argv) {
         case 'c':
             config_file_name = optarg;
             break;
+        case 's':
+            local_socket_name = optarg;
+            break;
+        case 'q':
+            outbox_directory = optarg;
+            break;
         case '?':
-            if(optopt == 'c') {
+            if(optopt == 'c' || optopt == 's' || optopt == 'q') {
                 ;
             } else if(isprint(optopt)) {
                 ;
@@ -319,20 +337,43 @@ int main(int argc, char **argv) {
         }
     }
 
+    try {
+        outbox.open(outbox_directory);
+    } catch(OutboxError &e) {
+        syslog(LOG_ERR, "Events will not be kept while offline: %s",
+               e.what());
+    }
+
+    // Every sensor is recorded for upload whether or not it is conditioned
+    for(symbol_t id = 0; (size_t)id < init.devices->size(); id++) {
+        DeviceTemperature *sensor = dynamic_cast<DeviceTemperature*>(
+            init.devices->device(id)->basepointer);
+        if(sensor != NULL) {
+            telemetry.track(init.devices->name(id), sensor);
+        }
+    }
+
     // Do work
     pthread_t thread;
     pthread_create(&thread, NULL, background_worker, init.sched);
 
+    // A lost session must surface as a failed write, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
     Controller controller(init.conf, init.devices, init.sched,
                           init.resources);
-    while(true) {
-        try {
-            controller.execute();
-        } catch(ConnectionError &e) {
-            cout << "Cannot connect: " << e.what() << endl;
-        }
-        sleep(120);
+
+    // Local clients share the controller but not the remote session
+    unique_ptr<LocalListener> listener;
+    try {
+        listener.reset(new LocalListener(controller, local_socket_name));
+        pthread_t local_thread;
+        pthread_create(&local_thread, NULL, local_worker, listener.get());
+    } catch(ConnectionError &e) {
+        syslog(LOG_ERR, "Local control socket is unavailable: %s", e.what());
     }
 
+    controller.run();
+
     return 0;
 }
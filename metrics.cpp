@@ -0,0 +1,102 @@
+#include <ctime>
+#include <sstream>
+
+#include "metrics.hpp"
+
+
+using namespace std;
+
+
+unsigned long long monotonic_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+
+unsigned long long wallclock_msec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec*1000ULL + ts.tv_nsec/1000000;
+}
+
+
+unsigned long long histogram_snapshot_t::percentile(double fraction) const {
+    if(count == 0) {
+        return 0;
+    }
+    unsigned long long rank = (unsigned long long)(fraction*count);
+    if(rank >= count) {
+        rank = count - 1;
+    }
+    unsigned long long seen = 0;
+    for(size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if(seen > rank) {
+            unsigned long long bound = (1ULL << (i + 1)) - 1;
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+
+string histogram_snapshot_t::view() const {
+    stringstream buf;
+    buf << "COUNT=" << count << ":SUM=" << sum << ":MAX=" << max <<
+        ":P50=" << percentile(0.5) <<
+        ":P90=" << percentile(0.9) <<
+        ":P99=" << percentile(0.99);
+    return buf.str();
+}
+
+
+Histogram::Histogram() {
+    pthread_mutex_init(&mutex, NULL);
+    reset();
+}
+
+
+Histogram::~Histogram() throw() {
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void Histogram::record(unsigned long long value) {
+    int bucket = 0;
+    while(bucket < BUCKETS - 1 && value + 1 >= (1ULL << (bucket + 1))) {
+        bucket++;
+    }
+    pthread_mutex_lock(&mutex);
+    buckets[bucket]++;
+    count++;
+    sum += value;
+    if(value > max) {
+        max = value;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void Histogram::reset() {
+    pthread_mutex_lock(&mutex);
+    for(int i = 0; i < BUCKETS; i++) {
+        buckets[i] = 0;
+    }
+    count = 0;
+    sum = 0;
+    max = 0;
+    pthread_mutex_unlock(&mutex);
+}
+
+
+histogram_snapshot_t Histogram::snapshot() const {
+    histogram_snapshot_t res;
+    pthread_mutex_lock(&mutex);
+    res.count = count;
+    res.sum = sum;
+    res.max = max;
+    res.buckets.assign(buckets, buckets + BUCKETS);
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
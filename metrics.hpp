@@ -0,0 +1,54 @@
+#ifndef _METRICS_HPP_INCLUDED_
+#define _METRICS_HPP_INCLUDED_
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+
+// Monotonic clock in microseconds
+unsigned long long monotonic_usec();
+
+// Wall clock in milliseconds since the epoch
+unsigned long long wallclock_msec();
+
+
+struct histogram_snapshot_t {
+    unsigned long count;
+    unsigned long long sum;
+    unsigned long long max;
+    std::vector<unsigned long> buckets;
+
+    unsigned long long percentile(double fraction) const;
+    std::string view() const;
+};
+
+
+// Thread safe histogram with power of two buckets: bucket i holds values
+// in [2^i - 1, 2^(i+1) - 1).
+class Histogram {
+public:
+    static const int BUCKETS = 40;
+
+private:
+    mutable pthread_mutex_t mutex;
+    unsigned long buckets[BUCKETS];
+    unsigned long count;
+    unsigned long long sum;
+    unsigned long long max;
+
+public:
+    Histogram();
+    ~Histogram() throw();
+
+    void record(unsigned long long value);
+    void reset();
+    histogram_snapshot_t snapshot() const;
+
+    unsigned long long percentile(double fraction) const {
+        return snapshot().percentile(fraction);
+    }
+};
+
+#endif
@@ -1,10 +1,13 @@
 #include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
 #include <functional>
 #include <cctype>
 #include <locale>
 #include <memory>
-#include <vector>
 #include <set>
+#include <vector>
 #include <stdexcept>
 
 #include "model.hpp"
@@ -15,18 +18,30 @@
 
 using namespace std;
 
-const char
-*ID = "ID",
-    *COMMAND = "COMMAND",
-    *NAME = "NAME",
-    *COUPLE = "COUPLE",
-    *START = "START",
-    *STOP = "STOP",
-    *COUPLING_INTERVAL = "COUPLING-INTERVAL",
-    *RESTART = "RESTART",
-    *CONDITION = "CONDITION",
-    *TYPE = "TYPE",
-    *OK = "OK";
+const char *FIELD_NAMES[FIELDS] = {
+    "ID", "TYPE", "COMMAND", "NAME", "COUPLE", "START", "STOP",
+    "COUPLING-INTERVAL", "RESTART", "CATCHUP", "CONDITION", "STEPS",
+    "SINCE", "EPOCH", "ACK"
+};
+
+const field_key_t
+    ID = FIELD_ID,
+    COMMAND = FIELD_COMMAND,
+    NAME = FIELD_NAME,
+    COUPLE = FIELD_COUPLE,
+    START = FIELD_START,
+    STOP = FIELD_STOP,
+    COUPLING_INTERVAL = FIELD_COUPLING_INTERVAL,
+    RESTART = FIELD_RESTART,
+    CATCHUP = FIELD_CATCHUP,
+    CONDITION = FIELD_CONDITION,
+    STEPS = FIELD_STEPS,
+    SINCE = FIELD_SINCE,
+    EPOCH = FIELD_EPOCH,
+    ACK = FIELD_ACK,
+    TYPE = FIELD_TYPE;
+
+const char *OK = "OK";
 
 
 string rtrim(string s) {
@@ -55,6 +70,25 @@ string ConfigInfoModel::execute(model_call_params_t &params)
 }
 
 
+string StatsModel::execute(model_call_params_t &params)
+    throw(InteruptionHandling) {
+    if(params.request_data != "GET") {
+        stringstream buf;
+        buf << "Unknown method " << params.request_data << " requested";
+        throw InteruptionHandling(buf.str());
+    }
+
+    stringstream buf;
+    buf << scheduler_stats.view();
+    PriorityLane &lane = LaneType<TargetDeviceDriver>::lane;
+    buf << "STAT=LATENCY.INTERACTIVE:" <<
+        lane.latency(PRIORITY_INTERACTIVE).snapshot().view() << "\n";
+    buf << "STAT=LATENCY.BACKGROUND:" <<
+        lane.latency(PRIORITY_BACKGROUND).snapshot().view() << "\n";
+    return buf.str();
+}
+
+
 typedef pair<string, string> spair;
 
 
@@ -70,33 +104,119 @@ int pair_split(string &source, const char delim, spair &dest) {
 }
 
 
-void BaseInstructionLine::deconstruct(string source, s_map &dest) {
-    stringstream buf(source);
-    string item;
-    while(getline(buf, item, ':')) {
-        spair data;
-        if(pair_split(item, '=', data) < 0) {
+int InstructionFields::key(const char *name, size_t size) {
+    static size_t lengths[FIELDS];
+    if(lengths[0] == 0) {
+        for(int field = 0; field < FIELDS; field++) {
+            lengths[field] = strlen(FIELD_NAMES[field]);
+        }
+    }
+    for(int field = 0; field < FIELDS; field++) {
+        if(lengths[field] == size &&
+           memcmp(FIELD_NAMES[field], name, size) == 0) {
+            return field;
+        }
+    }
+    return -1;
+}
+
+
+void InstructionFields::tokenize(const char *data, size_t size) {
+    present = 0;
+    const char *end = data + size;
+    for(const char *item = data; item < end;) {
+        const char *stop = static_cast<const char*>(
+            memchr(item, ':', end - item));
+        if(stop == NULL) {
+            stop = end;
+        }
+        const char *eq = static_cast<const char*>(
+            memchr(item, '=', stop - item));
+        if(eq == NULL) {
             stringstream buf;
-            buf << "Wrong fragment \"" << item << "\" in an instruction \"" <<
-                source << '"';
+            buf << "Wrong fragment \"" << string(item, stop - item) <<
+                "\" in an instruction \"" << string(data, size) << '"';
             throw InteruptionHandling(buf.str());
         }
-        dest[data.first] = data.second;
+        int field = key(item, eq - item);
+        if(field >= 0) {
+            values[field].data = eq + 1;
+            values[field].size = stop - eq - 1;
+            present |= 1u << field;
+        }
+        item = stop + 1;
+    }
+}
+
+
+void InstructionFields::assign(const string &line) {
+    owned = line;
+    tokenize(owned.data(), owned.size());
+}
+
+
+string InstructionFields::operator[](field_key_t field) const {
+    if(!has(field)) {
+        return string();
+    }
+    return string(values[field].data, values[field].size);
+}
+
+
+bool InstructionFields::equals(field_key_t field, const char *value) const {
+    return has(field) && strlen(value) == values[field].size &&
+        memcmp(values[field].data, value, values[field].size) == 0;
+}
+
+
+int InstructionFields::number(field_key_t field) const {
+    if(!has(field)) {
+        stringstream buf;
+        buf << "Key " << FIELD_NAMES[field] << " required";
+        throw InteruptionHandling(buf.str());
+    }
+    const char *it = values[field].data;
+    const char *end = it + values[field].size;
+    bool negative = it < end && *it == '-';
+    if(it < end && (*it == '-' || *it == '+')) {
+        it++;
+    }
+    long res = 0;
+    bool overflow = false;
+    const char *digits = it;
+    for(; it < end && *it >= '0' && *it <= '9'; it++) {
+        if(!overflow) {
+            res = res*10 + (*it - '0');
+            overflow = res > INT_MAX;
+        }
+    }
+    if(it != end || it == digits || overflow) {
+        string value = (*this)[field];
+        stringstream buf;
+        buf << value << (overflow ? " is out of range" : " is not a number")
+            << " in " << FIELD_NAMES[field] << "=" << value;
+        throw InteruptionHandling(buf.str());
     }
+    return negative ? -res : res;
 }
 
 
-void key_required(s_map &src, string key) {
-    s_map::iterator it = src.find(key);
-    if(it == src.end()) {
+void BaseInstructionLine::deconstruct(const string &source,
+                                      InstructionFields &dest) {
+    dest.assign(source);
+}
+
+
+void key_required(const InstructionFields &src, field_key_t key) {
+    if(!src.has(key)) {
         stringstream buf;
-        buf << "Key " << key << " required";
+        buf << "Key " << FIELD_NAMES[key] << " required";
         throw InteruptionHandling(buf.str());
     }
 }
 
 
-ValueInstructionLine::ValueInstructionLine(s_map &ref) {
+ValueInstructionLine::ValueInstructionLine(const InstructionFields &ref) {
     key_required(ref, ID);
     key_required(ref, COMMAND);
 
@@ -105,16 +225,19 @@ ValueInstructionLine::ValueInstructionLine(s_map &ref) {
 }
 
 
-int need_int(string value, string key, const char *custom = NULL) {
+int need_int(const string &value, field_key_t key,
+             const char *custom = NULL) {
     char *p;
     const char *start = value.c_str();
-    int res = strtol(start, &p, 10);
-    if(*p || p == start) {
+    errno = 0;
+    long res = strtol(start, &p, 10);
+    if(*p || p == start || errno == ERANGE || res > INT_MAX || res < -INT_MAX) {
         stringstream buf;
         if(custom != (const char*)NULL) {
             buf << custom;
         } else {
-            buf << value << " is not a number in " << key << "=" << value;
+            buf << value << " is not a number in " << FIELD_NAMES[key] << "="
+                << value;
         }
         throw InteruptionHandling(buf.str());
     }
@@ -122,42 +245,72 @@ int need_int(string value, string key, const char *custom = NULL) {
 }
 
 
-SingleInstructionLine::SingleInstructionLine(s_map &ref) {
+SingleInstructionLine::SingleInstructionLine(const InstructionFields &ref) {
     key_required(ref, ID);
     key_required(ref, COMMAND);
     key_required(ref, NAME);
     key_required(ref, START);
 
-    s_map::iterator finder;
-
-    finder = ref.find(STOP);
-    if(finder != ref.end()) {
-        stop = need_int(ref[STOP], STOP);
+    if(ref.has(STOP)) {
+        stop = ref.number(STOP);
     } else {
         stop = -1;
     }
 
-    finder = ref.find(RESTART);
-    if(finder != ref.end()) {
-        restart = need_int(ref[RESTART], STOP);
+    if(ref.has(RESTART)) {
+        restart = ref.number(RESTART);
     } else {
         restart = -1;
     }
 
+    catchup = CATCHUP_ONCE;
+    if(ref.has(CATCHUP)) {
+        if(ref.equals(CATCHUP, "SKIP")) {
+            catchup = CATCHUP_SKIP;
+        } else if(ref.equals(CATCHUP, "ONCE")) {
+            catchup = CATCHUP_ONCE;
+        } else if(ref.equals(CATCHUP, "ALL")) {
+            catchup = CATCHUP_ALL;
+        } else {
+            stringstream buf;
+            buf << "Wrong catch up policy " << ref[CATCHUP] <<
+                ", must be one of SKIP, ONCE or ALL";
+            throw InteruptionHandling(buf.str());
+        }
+    }
+
     id = ref[ID];
     command = ref[COMMAND];
     name = ref[NAME];
-    start = need_int(ref[START], START);
+    start = ref.number(START);
 }
 
 
-CoupledInstructionLine::CoupledInstructionLine(s_map &ref):
+CoupledInstructionLine::CoupledInstructionLine(const InstructionFields &ref):
     SingleInstructionLine(ref) {
     key_required(ref, COUPLE);
     key_required(ref, COUPLING_INTERVAL);
 
     couple = ref[COUPLE];
-    coupling_interval = need_int(ref[COUPLING_INTERVAL], COUPLING_INTERVAL);
+    coupling_interval = ref.number(COUPLING_INTERVAL);
+}
+
+
+operation_t parse_operation(const string &source) {
+    map<string, operation_t> chooser;
+    chooser["LT"] = COMPARISON_LT;
+    chooser["LE"] = COMPARISON_LE;
+    chooser["EQ"] = COMPARISON_EQ;
+    chooser["GE"] = COMPARISON_GE;
+    chooser["GT"] = COMPARISON_GT;
+
+    map<string, operation_t>::iterator lookup = chooser.find(source);
+    if(lookup == chooser.end()) {
+        stringstream buf;
+        buf << "Wrong operation: " << source;
+        throw InteruptionHandling(buf.str());
+    }
+    return lookup->second;
 }
 
 
@@ -194,31 +347,256 @@ comparison_t parse_comparison(string source) throw(InteruptionHandling) {
             tmp << " instead";
         throw InteruptionHandling(buf.str());
     }
-    comp.value = need_int(data.second, CONDITION,
-                          (data.second + ": not a number").c_str());
-
-
-    map<string, operation_t> chooser;
-    chooser["LT"] = COMPARISON_LT;
-    chooser["LE"] = COMPARISON_LE;
-    chooser["EQ"] = COMPARISON_EQ;
-    chooser["GE"] = COMPARISON_GE;
-    chooser["GT"] = COMPARISON_GT;
+    // <VALUE>[_OFF_<VALUE>][_DWELL_<SECONDS>]
+    stringstream options(data.second);
+    string value;
+    getline(options, value, '_');
+    comp.value = need_int(value, CONDITION,
+                          (value + ": not a number").c_str());
+    comp.release = comp.value;
+    comp.dwell = 0;
+
+    string option;
+    while(getline(options, option, '_')) {
+        if(!getline(options, value, '_')) {
+            stringstream buf;
+            buf << "Option " << option << " requires a value in " << source;
+            throw InteruptionHandling(buf.str());
+        }
+        if(option == "OFF") {
+            comp.release = need_int(value, CONDITION,
+                                    (value + ": not a number").c_str());
+        } else if(option == "DWELL") {
+            comp.dwell = need_int(value, CONDITION,
+                                  (value + ": not a number").c_str());
+            if(comp.dwell < 0) {
+                throw InteruptionHandling("Dwell time can not be negative");
+            }
+        } else {
+            stringstream buf;
+            buf << "Unknown condition option " << option << " in " << source;
+            throw InteruptionHandling(buf.str());
+        }
+    }
 
-    map<string, operation_t>::iterator lookup = chooser.find(data.first);
-    if(lookup == chooser.end()) {
+    comp.operation = parse_operation(data.first);
+
+    // The release threshold has to lie on the far side of the deadband
+    bool banded;
+    switch(comp.operation) {
+    case COMPARISON_LT:
+    case COMPARISON_LE:
+        banded = comp.release >= comp.value;
+        break;
+    case COMPARISON_GE:
+    case COMPARISON_GT:
+        banded = comp.release <= comp.value;
+        break;
+    default:
+        banded = comp.release == comp.value;
+    }
+    if(!banded) {
         stringstream buf;
-        buf << "Wrong operation: " << data.first;
+        buf << "OFF threshold " << comp.release <<
+            " does not make a deadband for " << source;
         throw InteruptionHandling(buf.str());
-    } else {
-        comp.operation = lookup->second;
     }
 
     return comp;
 }
 
 
-ConditionInstructionLine::ConditionInstructionLine(s_map &ref) {
+bool (*comparator_for(operation_t operation))(double, double) {
+    switch(operation) {
+    case COMPARISON_LT:
+        return compare_lt<double>;
+    case COMPARISON_LE:
+        return compare_le<double>;
+    case COMPARISON_EQ:
+        return compare_eq<double>;
+    case COMPARISON_GE:
+        return compare_ge<double>;
+    case COMPARISON_GT:
+        return compare_gt<double>;
+    default:
+        return compare_lt<double>;
+    }
+}
+
+
+bool is_compound_condition(const string &source) {
+    size_t split = source.find('_');
+    return source.find_first_of(" ()") != string::npos ||
+        source.compare(0, 5, "TIME.") == 0 ||
+        (split != string::npos && source.find('.', split) != string::npos);
+}
+
+
+class ConditionCompiler {
+private:
+    vector<string> tokens;
+    size_t pos;
+    condition_expression_t &result;
+
+    void fail(string message) {
+        throw InteruptionHandling(message);
+    }
+
+    bool accept(const char *token) {
+        if(pos < tokens.size() && tokens[pos] == token) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    void emit(condition_op_t op, bool (*comparator)(double, double) = NULL,
+              int left = 0, int right = 0, double value = 0) {
+        condition_instr_t instr;
+        instr.op = op;
+        instr.comparator = comparator;
+        instr.left = left;
+        instr.right = right;
+        instr.value = value;
+        result.program.push_back(instr);
+    }
+
+    int sensor(const string &name) {
+        vector<string> &sensors = result.sensors;
+        vector<string>::iterator it = find(sensors.begin(), sensors.end(),
+                                           name);
+        if(it != sensors.end()) {
+            return it - sensors.begin();
+        }
+        sensors.push_back(name);
+        return sensors.size() - 1;
+    }
+
+    void junction(const char *keyword, condition_op_t op,
+                  void (ConditionCompiler::*operand)()) {
+        (this->*operand)();
+        while(accept(keyword)) {
+            size_t jump = result.program.size();
+            emit(op);
+            (this->*operand)();
+            result.program[jump].left = result.program.size();
+        }
+    }
+
+    void disjunction() {
+        junction("OR", CONDITION_OR, &ConditionCompiler::conjunction);
+    }
+
+    void conjunction() {
+        junction("AND", CONDITION_AND, &ConditionCompiler::negation);
+    }
+
+    void negation() {
+        if(accept("NOT")) {
+            negation();
+            emit(CONDITION_NOT);
+        } else if(accept("(")) {
+            disjunction();
+            if(!accept(")")) {
+                fail("Unbalanced parentheses in a condition");
+            }
+        } else if(pos < tokens.size()) {
+            comparison(tokens[pos++]);
+        } else {
+            fail("Condition ends unexpectedly");
+        }
+    }
+
+    // TIME.<OP>_<HHMM>, <device>.temperature.<OP>_<VALUE> or
+    // <device>.temperature.<OP>_<device>.temperature
+    void comparison(const string &source) {
+        spair data;
+        string tmp = source;
+        if(tmp.compare(0, 5, "TIME.") == 0) {
+            tmp = tmp.substr(5);
+            if(pair_split(tmp, '_', data) < 0) {
+                fail("Wrong time condition format: " + source);
+            }
+            int daytime = need_int(data.second, CONDITION,
+                                   (source + ": not a time").c_str());
+            if(daytime < 0 || daytime/100 > 23 || daytime%100 > 59) {
+                fail(source + ": not a time");
+            }
+            emit(CONDITION_TIME, comparator_for(parse_operation(data.first)),
+                 0, 0, daytime);
+            return;
+        }
+
+        size_t split = source.find('_');
+        if(split == string::npos ||
+           source.find('.', split) == string::npos) {
+            comparison_t comp = parse_comparison(source);
+            if(comp.release != comp.value || comp.dwell != 0) {
+                fail("OFF and DWELL are not supported in compound "
+                     "conditions: " + source);
+            }
+            emit(CONDITION_SENSOR, comparator_for(comp.operation),
+                 sensor(comp.source), 0, comp.value);
+            return;
+        }
+
+        // The right hand side is another sensor
+        string left, right;
+        vector<string> parts;
+        stringstream buf(source.substr(0, split));
+        while(getline(buf, tmp, '.')) {
+            parts.push_back(tmp);
+        }
+        tmp = source.substr(split + 1);
+        if(parts.size() != 3 || parts[1] != "temperature" ||
+           pair_split(tmp, '.', data) < 0 || data.second != "temperature") {
+            fail("Wrong sensor comparison format: " + source);
+        }
+        emit(CONDITION_SENSORS, comparator_for(parse_operation(parts[2])),
+             sensor(parts[0]), sensor(data.first));
+    }
+
+public:
+    ConditionCompiler(const string &source, condition_expression_t &res):
+        pos(0), result(res) {
+        string token;
+        for(size_t i = 0; i < source.length(); i++) {
+            char c = source[i];
+            if(c == ' ' || c == '(' || c == ')') {
+                if(!token.empty()) {
+                    tokens.push_back(token);
+                    token.clear();
+                }
+                if(c != ' ') {
+                    tokens.push_back(string(1, c));
+                }
+            } else {
+                token += c;
+            }
+        }
+        if(!token.empty()) {
+            tokens.push_back(token);
+        }
+    }
+
+    void compile() {
+        disjunction();
+        if(pos != tokens.size()) {
+            fail("Unexpected " + tokens[pos] + " in a condition");
+        }
+    }
+};
+
+
+condition_expression_t parse_condition(string source)
+    throw(InteruptionHandling) {
+    condition_expression_t res;
+    ConditionCompiler(source, res).compile();
+    return res;
+}
+
+
+ConditionInstructionLine::ConditionInstructionLine(const InstructionFields &ref) {
     key_required(ref, ID);
     key_required(ref, NAME);
     key_required(ref, COMMAND);
@@ -226,11 +604,8 @@ ConditionInstructionLine::ConditionInstructionLine(s_map &ref) {
     key_required(ref, CONDITION);
     key_required(ref, START);
 
-    s_map::iterator finder;
-
-    finder = ref.find(STOP);
-    if(finder != ref.end()) {
-        stop = need_int(ref[STOP], STOP);
+    if(ref.has(STOP)) {
+        stop = ref.number(STOP);
     } else {
         stop = -1;
     }
@@ -239,129 +614,135 @@ ConditionInstructionLine::ConditionInstructionLine(s_map &ref) {
     name = ref[NAME];
     command = ref[COMMAND];
     couple = ref[COUPLE];
-    start = need_int(ref[START], START);
+    start = ref.number(START);
 
-    comparison = parse_comparison(ref[CONDITION]);
+    compound = is_compound_condition(ref[CONDITION]);
+    if(compound) {
+        expression = parse_condition(ref[CONDITION]);
+    } else {
+        comparison = parse_comparison(ref[CONDITION]);
+    }
 }
 
 
-class StringSet: public set<string> {
-public:
-    StringSet& operator<<(string operation) {
-        insert(operation);
-        return *this;
-    }
+SequenceInstructionLine::SequenceInstructionLine(const InstructionFields &ref) {
+    key_required(ref, ID);
+    key_required(ref, NAME);
+    key_required(ref, START);
+    key_required(ref, STEPS);
 
-    bool has(string operation) {
-        StringSet::iterator it = find(operation);
-        return it != end();
+    if(ref.has(STOP)) {
+        stop = ref.number(STOP);
+    } else {
+        stop = -1;
     }
-};
 
-
-class SupportedCommands: public map<device_type_t, StringSet> {
-public:
-    bool is_supported(device_type_t device_type, string operation) {
-        SupportedCommands::iterator it = find(device_type);
-        if(it == end()) {
-            return false;
+    id = ref[ID];
+    name = ref[NAME];
+    start = ref.number(START);
+
+    stringstream buf(ref[STEPS]);
+    string source;
+    while(getline(buf, source, ';')) {
+        sequence_step_line_t step;
+        step.delay = 0;
+        step.compound = false;
+        if(source.compare(0, 5, "WAIT_") == 0) {
+            step.op = STEP_WAIT;
+            step.delay = need_int(source.substr(5), STEPS);
+            if(step.delay <= 0) {
+                throw InteruptionHandling("Sequence delay must be greater "
+                                          "than 0");
+            }
+        } else if(source.compare(0, 6, "UNTIL_") == 0) {
+            step.op = STEP_UNTIL;
+            string condition = source.substr(6);
+            step.compound = is_compound_condition(condition);
+            if(step.compound) {
+                step.expression = parse_condition(condition);
+            } else {
+                step.comparison = parse_comparison(condition);
+                // A sequence waits for the condition once, nothing to
+                // release or to dwell on
+                if(step.comparison.release != step.comparison.value ||
+                   step.comparison.dwell != 0) {
+                    throw InteruptionHandling("OFF and DWELL are not "
+                                              "supported in sequence "
+                                              "conditions: " + condition);
+                }
+            }
+        } else if(!source.empty()) {
+            step.op = STEP_RUN;
+            step.command = source;
+        } else {
+            throw InteruptionHandling("Empty step in a sequence");
         }
-        return it->second.has(operation);
+        steps.push_back(step);
     }
-
-    SupportedCommands() {
-        (*this)[DEVICE_BOILER] << "on" << "off" << "temperature";
-        (*this)[DEVICE_SWITCHER] << "on" << "off";
-        (*this)[DEVICE_THERMOSWITCHER] << "temperature";
-    };
-
-};
-
-SupportedCommands supported_commands;
+}
 
 
-Command *command_from_string(model_call_params_t &params, string cmd) {
-    spair couple;
-    if(pair_split(cmd, '.', couple) < 0) {
+static Command &device_command(model_call_params_t &params,
+                               const string &cmd,
+                               symbol_t &device, int &operation) {
+    size_t dot = cmd.find('.');
+    if(dot == string::npos) {
         throw InteruptionHandling(string("Wrong command: ") + cmd);
     }
 
-    config_devices_t::const_iterator it =
-        params.config->devices().find(couple.first);
-    if(it == params.config->devices().end()) {
+    device = params.devices->lookup(cmd.data(), dot);
+    if(device == NO_SYMBOL) {
         stringstream buf;
-        buf << "No such device: " << couple.first;
+        buf << "No such device: " << cmd.substr(0, dot);
         throw InteruptionHandling(buf.str());
     }
 
-    if(!supported_commands.is_supported(it->second->id(), couple.second)) {
+    operation = device_operation(cmd.data() + dot + 1, cmd.size() - dot - 1);
+    if(operation < 0 || !(device_capabilities(params.devices->type(device)) &
+                          (1u << operation))) {
         stringstream buf;
-        buf << "Device \"" << couple.first << "\" does not support operation \"" <<
-            couple.second << '"';
+        buf << "Device \"" << cmd.substr(0, dot) <<
+            "\" does not support operation \"" << cmd.substr(dot + 1) << '"';
         throw InteruptionHandling(buf.str());
     }
 
-    if(couple.second == "on") {
-        try {
-            return new SwitcherOn(params.devices->device(couple.first));
-        } catch(CommandSetupError e) {
-            stringstream buf;
-            buf << "Device " << couple.first << " is not a switcher";
-            throw InteruptionHandling(buf.str());
-        }
-    } else if(couple.second == "off") {
-        try {
-            return new SwitcherOff(params.devices->device(couple.first));
-        } catch(CommandSetupError e) {
-            stringstream buf;
-            buf << "Device " << couple.first << " is not a switcher";
-            throw InteruptionHandling(buf.str());
-        }
-    } else if(couple.second == "temperature") {
-        try {
-            return new TemperatureGet(params.devices->device(couple.first));
-        } catch(CommandSetupError e) {
-            stringstream buf;
-            buf << "Device " << couple.first << " cannot take a temperature";
-            throw InteruptionHandling(buf.str());
-        }
-    } else {
-        throw InteruptionHandling("That should not happen");
+    Command *res = device_commands.get(device, (device_operation_t)operation);
+    if(res == NULL) {
+        stringstream buf;
+        buf << "Device " << cmd.substr(0, dot) <<
+            (operation == DEVICE_OPERATION_TEMPERATURE ?
+             " cannot take a temperature" : " is not a switcher");
+        throw InteruptionHandling(buf.str());
     }
+    return *res;
 }
 
 
-template <class T>
-class safe_vector: public vector<T*> {
-public:
-    ~safe_vector() throw() {
-        while(!this->empty()) {
-            delete this->back();
-            this->pop_back();
-        }
-    }
-};
+Command &device_command(model_call_params_t &params, const string &cmd) {
+    symbol_t device;
+    int operation;
+    return device_command(params, cmd, device, operation);
+}
 
 
-template <typename K, typename T>
-class safe_map: public map<K, T*> {
-public:
-    ~safe_map() throw() {
-        for(typename safe_map<K, T>::iterator it = this->begin();
-            it != this->end(); it++) {
-            if(it->second != NULL) {
-                delete it->second;
-            }
-        }
+Command *command_from_string(model_call_params_t &params, const string &cmd) {
+    symbol_t device;
+    int operation;
+    Command &target = device_command(params, cmd, device, operation);
+    // A schedule let go switches off what it may have switched on
+    Command *off = NULL;
+    if(operation == DEVICE_OPERATION_ON) {
+        off = device_commands.get(device, DEVICE_OPERATION_OFF);
     }
-};
+    return new CommandHandle(target, off);
+}
 
 
 BaseSchedule *get_single(model_call_params_t &params,
                          SingleInstructionLine *item) {
     unique_ptr<Command> cmd(command_from_string(params, item->command));
     BaseSchedule *res =  new SingleCommandSchedule(
-        cmd.get(), item->start, item->stop, item->restart);
+        cmd.get(), item->start, item->stop, item->restart, item->catchup);
     cmd.release();
     return res;
 }
@@ -374,65 +755,91 @@ BaseSchedule *get_coupled(model_call_params_t &params,
     BaseSchedule *res = new CoupledCommandSchedule(
         cmd.get(), item->start, item->stop,
         couple.get(), item->coupling_interval,
-        item->restart);
+        item->restart, item->catchup);
     cmd.release();
     couple.release();
     return res;
 }
 
 
-BaseSchedule* get_conditioned(model_call_params_t &params,
-                              ConditionInstructionLine *item) {
-    unique_ptr<BaseCondition> cond;
+DeviceTemperature *temperature_sensor(model_call_params_t &params,
+                                      const string &name) {
     try {
-        device_reference_t *devref = params.devices->device(
-            item->comparison.source);
+        device_reference_t *devref = params.devices->device(name);
         DeviceTemperature *dvc = dynamic_cast<DeviceTemperature*>(
             devref->basepointer);
         if(dvc == (DeviceTemperature*)NULL) {
             stringstream buf;
-            buf << item->comparison.source << " has no temperature port";
+            buf << name << " has no temperature port";
             throw InteruptionHandling(buf.str());
         }
-
-        bool (*comparator)(double, double);
-        switch(item->comparison.operation) {
-        case COMPARISON_LT:
-            comparator = compare_lt<double>;
-            break;
-        case COMPARISON_LE:
-            comparator = compare_le<double>;
-            break;
-        case COMPARISON_EQ:
-            comparator = compare_eq<double>;
-            break;
-        case COMPARISON_GE:
-            comparator = compare_ge<double>;
-            break;
-        case COMPARISON_GT:
-            comparator = compare_gt<double>;
-            break;
-        default:
-            comparator = compare_lt<double>;
-        }
-        cond = unique_ptr<BaseCondition>(
-            new TemperatureCondition(dvc, item->comparison.value, comparator));
+        return dvc;
     } catch(out_of_range e) {
         stringstream buf;
-        buf << item->comparison.source << ": no such device";
+        buf << name << ": no such device";
         throw InteruptionHandling(buf.str());
     }
+}
+
+
+BaseCondition *get_condition(model_call_params_t &params, bool compound,
+                             const comparison_t &comparison,
+                             const condition_expression_t &expression) {
+    if(compound) {
+        vector<DeviceTemperature*> sensors;
+        for(vector<string>::const_iterator it = expression.sensors.begin();
+            it != expression.sensors.end(); it++) {
+            sensors.push_back(temperature_sensor(params, *it));
+        }
+        return new ExpressionCondition(expression.program, sensors);
+    }
+    DeviceTemperature *dvc = temperature_sensor(params, comparison.source);
+    return new TemperatureCondition(dvc, comparison.value, comparison.release,
+                                    comparator_for(comparison.operation));
+}
+
+
+BaseSchedule* get_conditioned(model_call_params_t &params,
+                              ConditionInstructionLine *item) {
+    unique_ptr<BaseCondition> cond(
+        get_condition(params, item->compound, item->comparison,
+                      item->expression));
+    int dwell = item->compound ? 0 : item->comparison.dwell;
 
     unique_ptr<Command> cmd(command_from_string(params, item->command));
     unique_ptr<Command> couple(command_from_string(params, item->couple));
 
     BaseSchedule *res = new ConditionedSchedule(
         cmd.release(), couple.release(), cond.release(),
-        item->start, item->stop);
+        item->start, item->stop, dwell);
     return res;
 }
 
 
+BaseSchedule* get_sequence(model_call_params_t &params,
+                           SequenceInstructionLine *item) {
+    unique_ptr<SequenceSchedule> res(
+        new SequenceSchedule(item->start, item->stop));
+    for(vector<sequence_step_line_t>::iterator it = item->steps.begin();
+        it != item->steps.end(); it++) {
+        if(it->op == STEP_RUN) {
+            unique_ptr<Command> cmd(command_from_string(params, it->command));
+            res->run(cmd.get());
+            cmd.release();
+        } else if(it->op == STEP_WAIT) {
+            res->wait(it->delay);
+        } else {
+            unique_ptr<BaseCondition> cond(
+                get_condition(params, it->compound, it->comparison,
+                              it->expression));
+            res->until(cond.get());
+            cond.release();
+        }
+    }
+    return res.release();
+}
+
+
 std::string resp_item(string id, bool status, string body) {
     stringstream buf;
     buf << "ID=" << id << ":SUCCESS=" << status;
@@ -445,154 +852,303 @@ std::string resp_item(string id, bool status, string body) {
 }
 
 
-string InstructionListModel::execute(model_call_params_t &params)
+string StateModel::execute(model_call_params_t &params)
     throw(InteruptionHandling) {
-    stringstream buf(params.request_data);
-    string line;
-
-    safe_vector<ValueInstructionLine> values;
-    safe_vector<SingleInstructionLine> singles;
-    safe_vector<CoupledInstructionLine> couples;
-    safe_vector<ConditionInstructionLine> conditionals;
-    auto resources = params.res;
-
-    stringstream results, error_results, drop_results;
-    while(getline(buf, line, '\n')) {
-        s_map ref;
-        BaseInstructionLine::deconstruct(line, ref);
-        try {
-            key_required(ref, TYPE);
-            key_required(ref, ID);
-            string type = ref[TYPE];
-            auto &&it = params.sched->find(ref[NAME]);
-            if(it != params.sched->end() && type != "DROP") {
-                stringstream buf;
-                buf << "Task name=" << ref[NAME] <<
-                    " has taken up already, may be drop it?";
-                throw InteruptionHandling(buf.str());
-            }
-            if(type == "VALUE") {
-                unique_ptr<ResourcesTaker> taker(resources->taker());
-                key_required(ref, COMMAND);
-                taker->take(ref[COMMAND]);
-                values.push_back(new ValueInstructionLine(ref));
-                taker->approve();
-            } else if(type == "SINGLE") {
-                unique_ptr<ResourcesTaker> taker(resources->taker());
-                taker->take(ref[COMMAND]);
-                (*params.busy)[ref[NAME]] = taker->captured();
-                singles.push_back(new SingleInstructionLine(ref));
-                taker->approve();
-            } else if(type == "COUPLED") {
-                unique_ptr<ResourcesTaker> taker(resources->taker());
-                key_required(ref, COMMAND);
-                key_required(ref, COUPLE);
-                taker->take(ref[COMMAND]);
-                taker->take(ref[COUPLE]);
-                (*params.busy)[ref[NAME]] = taker->captured();
-                couples.push_back(new CoupledInstructionLine(ref));
-                taker->approve();
-            } else if(type == "CONDITIONED") {
-                unique_ptr<ResourcesTaker> taker(resources->taker());
-                key_required(ref, COMMAND);
-                key_required(ref, COUPLE);
-                taker->take(ref[COMMAND]);
-                taker->take(ref[COUPLE]);
-                (*params.busy)[ref[NAME]] = taker->captured();
-                conditionals.push_back(new ConditionInstructionLine(ref));
-                taker->approve();
-            } else if(type == "DROP") {
-                if(it != params.sched->end()) {
-                    UnifiedLocker<NamedSchedule> safe(params.sched);
-                    safe->drop_schedule(ref[NAME]);
-                    for(auto &it: params.busy->at(ref[NAME])) {
-                        resources->release(it);
-                    }
-                }
-                drop_results << resp_item(std::string("DROP.") + ref[ID],
-                                              true, "dropped") << "\n";
-            }
-        } catch(InteruptionHandling e) {
-            string id;
-            try {
-                id = ref.at("ID");
-            } catch(out_of_range e) {
-                id = "VOID";
-            }
-            error_results << resp_item(id, false, e) << endl;
-        } catch(ResourceIsBusy e) {
-            stringstream buf;
-            buf << "Unable to take resource " << e.what() << "\n";
-            error_results << resp_item(ref[ID], false, buf.str());
+    unsigned long version = 0;
+    if(params.request_data != "GET") {
+        InstructionFields request;
+        request.tokenize(params.request_data.data(),
+                         params.request_data.size());
+        key_required(request, SINCE);
+        key_required(request, EPOCH);
+        // Versions handed out before a restart mean nothing now
+        if(request.number(EPOCH) == device_state.epoch()) {
+            version = request.number(SINCE);
         }
     }
 
-    // Now create schedules
-    safe_map<string, BaseSchedule> res;
+    state_changes_t changes;
+    unsigned long current = device_state.since(version, changes);
+
+    map<BaseDescrDevice*, symbol_t> owners;
+    for(symbol_t id = 0; !changes.empty() &&
+            (size_t)id < params.devices->size(); id++) {
+        owners[params.devices->device(id)->basepointer] = id;
+    }
 
-    for(safe_vector<SingleInstructionLine>::iterator it = singles.begin();
-        it != singles.end(); it++) {
-        SingleInstructionLine *item = *it;
-        try {
-            res[item->name] = get_single(params, item);
-            results << resp_item(item->id, true, OK) << endl;
-        } catch(ScheduleSetupError er) {
-            error_results << resp_item(item->id, false, er.what()) << endl;
+    stringstream buf;
+    buf << "EPOCH=" << device_state.epoch() << ":VERSION=" << current
+        << "\n";
+    for(size_t i = 0; i < changes.size(); i++) {
+        map<BaseDescrDevice*, symbol_t>::iterator it = owners.find(
+            changes[i].device);
+        if(it == owners.end()) {
+            continue;
         }
+        buf << params.devices->name(it->second) << "."
+            << STATE_ASPECT_NAMES[changes[i].aspect] << ":"
+            << changes[i].value << "\n";
     }
+    return buf.str();
+}
+
+
+string TelemetryModel::execute(model_call_params_t &params)
+    throw(InteruptionHandling) {
+    if(params.request_data != "GET") {
+        InstructionFields request;
+        request.tokenize(params.request_data.data(),
+                         params.request_data.size());
+        key_required(request, ACK);
+        telemetry.acknowledge(request.number(ACK));
+    }
+    return telemetry.batch(TELEMETRY_BATCH);
+}
+
+
+string EventsModel::execute(model_call_params_t &params)
+    throw(InteruptionHandling) {
+    if(params.request_data != "GET") {
+        InstructionFields request;
+        request.tokenize(params.request_data.data(),
+                         params.request_data.size());
+        key_required(request, ACK);
+        outbox.acknowledge(request.number(ACK));
+    }
+    return outbox.batch(OUTBOX_BATCH);
+}
+
 
-    for(safe_vector<CoupledInstructionLine>::iterator it = couples.begin();
-        it != couples.end(); it++) {
-        CoupledInstructionLine *item = *it;
-        try {
-            res[item->name] = get_coupled(params, item);
-            results << resp_item(item->id, true, OK) << endl;
-        } catch(ScheduleSetupError er) {
-            error_results << resp_item(item->id, false, er.what()) << endl;
+InstructionBatch::InstructionBatch(model_call_params_t &prms,
+                                   ostream &output):
+    params(prms), out(output) {}
+
+
+InstructionBatch::~InstructionBatch() throw() {
+    // Left over when the batch was never published
+    for(vector<change_t>::iterator it = changes.begin();
+        it != changes.end(); it++) {
+        delete it->second;
+    }
+}
+
+
+void InstructionBatch::feed(const char *data, size_t size) {
+    const char *end = data + size;
+    while(data < end) {
+        const char *eol = static_cast<const char*>(
+            memchr(data, '\n', end - data));
+        if(eol == NULL) {
+            partial.append(data, end - data);
+            return;
+        }
+        if(partial.empty()) {
+            validate(data, eol - data);
+        } else {
+            partial.append(data, eol - data);
+            validate(partial.data(), partial.size());
+            partial.clear();
+        }
+        data = eol + 1;
+    }
+}
+
+
+// Checks a line on its own, nothing shared is looked at or changed yet
+void InstructionBatch::validate(const char *data, size_t size) {
+    if(size == 0) {
+        return;
+    }
+
+    line_t line;
+    InstructionFields ref;
+    try {
+        ref.tokenize(data, size);
+        key_required(ref, TYPE);
+        key_required(ref, ID);
+        line.type = ref[TYPE];
+        line.id = ref[ID];
+        line.name = ref[NAME];
+        if(line.type == "VALUE") {
+            line.item.reset(new ValueInstructionLine(ref));
+        } else if(line.type == "SINGLE") {
+            line.item.reset(new SingleInstructionLine(ref));
+        } else if(line.type == "COUPLED") {
+            line.item.reset(new CoupledInstructionLine(ref));
+        } else if(line.type == "CONDITIONED") {
+            line.item.reset(new ConditionInstructionLine(ref));
+        } else if(line.type == "SEQUENCE") {
+            line.item.reset(new SequenceInstructionLine(ref));
         }
+    } catch(InteruptionHandling e) {
+        line.response = resp_item(ref.has(ID) ? ref[ID] : string("VOID"),
+                                  false, e);
+    }
+    lines.push_back(std::move(line));
+}
+
+
+bool InstructionBatch::taken(NamedSchedule &sched,
+                             const string &name) const {
+    map<string, bool>::const_iterator it = staged.find(name);
+    if(it != staged.end()) {
+        return it->second;
     }
+    return sched.has(name);
+}
+
+
+void InstructionBatch::install(const string &name, BaseSchedule *schedule) {
+    changes.push_back(change_t(name, schedule));
+    staged[name] = schedule != NULL;
+}
+
 
-    for(safe_vector<ConditionInstructionLine>::iterator it = conditionals.begin();
-        it != conditionals.end(); it++) {
-        ConditionInstructionLine *item = *it;
+// Takes the resources of a line and stages its schedule, a VALUE line
+// leaves the command to run once the batch is published. Resources are
+// claimed line by line in input order, so a DROP frees them for the lines
+// after it. A line that fails gives back what it took itself, lines
+// before it keep theirs.
+string InstructionBatch::stage(NamedSchedule &sched, line_t &line,
+                               Command *&value) {
+    if(!line.response.empty()) {
+        return line.response;
+    }
 
-        try {
-            res[item->name] = get_conditioned(params, item);
-            results << resp_item(item->id, true, OK) << endl;
-        } catch(ScheduleSetupError er) {
-            error_results << resp_item(item->id, false, er.what()) << endl;
+    Resources *resources = params.res;
+    try {
+        bool busy = taken(sched, line.name);
+        if(busy && line.type != "DROP") {
+            stringstream buf;
+            buf << "Task name=" << line.name <<
+                " has taken up already, may be drop it?";
+            throw InteruptionHandling(buf.str());
+        }
+
+        if(line.type == "DROP") {
+            if(busy) {
+                install(line.name, NULL);
+                params.busy->release(line.name, *resources);
+            }
+            return resp_item(std::string("DROP.") + line.id, true, "dropped");
+        }
+        if(!line.item) {
+            return string(); // Unknown types are passed over
         }
+
+        unique_ptr<ResourcesTaker> taker(resources->taker());
+        unique_ptr<BaseSchedule> schedule;
+        if(line.type == "VALUE") {
+            ValueInstructionLine *item =
+                static_cast<ValueInstructionLine*>(line.item.get());
+            taker->take(item->command);
+            value = &device_command(params, item->command);
+            taker->approve();
+            return string();
+        } else if(line.type == "SINGLE") {
+            SingleInstructionLine *item =
+                static_cast<SingleInstructionLine*>(line.item.get());
+            taker->take(item->command);
+            schedule.reset(get_single(params, item));
+        } else if(line.type == "COUPLED") {
+            CoupledInstructionLine *item =
+                static_cast<CoupledInstructionLine*>(line.item.get());
+            taker->take(item->command);
+            taker->take(item->couple);
+            schedule.reset(get_coupled(params, item));
+        } else if(line.type == "CONDITIONED") {
+            ConditionInstructionLine *item =
+                static_cast<ConditionInstructionLine*>(line.item.get());
+            taker->take(item->command);
+            taker->take(item->couple);
+            schedule.reset(get_conditioned(params, item));
+        } else {
+            SequenceInstructionLine *item =
+                static_cast<SequenceInstructionLine*>(line.item.get());
+            // A command run by several steps is taken once
+            set<string> commands;
+            for(vector<sequence_step_line_t>::iterator it =
+                    item->steps.begin(); it != item->steps.end(); it++) {
+                if(it->op == STEP_RUN) {
+                    commands.insert(it->command);
+                }
+            }
+            for(set<string>::iterator it = commands.begin();
+                it != commands.end(); it++) {
+                taker->take(*it);
+            }
+            schedule.reset(get_sequence(params, item));
+        }
+        params.busy->hold(line.name, taker->captured());
+        taker->approve();
+        install(line.name, schedule.release());
+        return resp_item(line.id, true, OK);
+    } catch(InteruptionHandling e) {
+        return resp_item(line.id, false, e);
+    } catch(ResourceIsBusy e) {
+        return resp_item(line.id, false,
+                         string("Unable to take resource ") + e.what());
+    } catch(ScheduleSetupError er) {
+        return resp_item(line.id, false, er.what());
     }
+}
 
+
+void InstructionBatch::finish() {
+    if(!partial.empty()) {
+        validate(partial.data(), partial.size());
+        partial.clear();
+    }
+
+    vector<string> responses(lines.size());
+    vector<Command*> values(lines.size(), NULL);
+    Commands releasing;
     {
         UnifiedLocker<NamedSchedule> safe(params.sched);
-        for(safe_map<string, BaseSchedule>::iterator it = res.begin();
-            it != res.end(); it++) {
-            safe->set_schedule(it->first, it->second);
-            it->second = NULL;
+
+        for(size_t i = 0; i < lines.size(); i++) {
+            responses[i] = stage(*safe, lines[i], values[i]);
         }
-    }
 
-    for(safe_vector<ValueInstructionLine>::iterator it = values.begin();
-        it != values.end(); it++) {
-        ValueInstructionLine *item = *it;
-        try {
-            unique_ptr<Command> cmd(command_from_string(params, item->command));
-            unique_ptr<Result> value(cmd->execute());
-            if(dynamic_cast<ErrorResult*>(value.get())) {
-                results << resp_item(item->id, false, value->value());
+        for(vector<change_t>::iterator it = changes.begin();
+            it != changes.end(); it++) {
+            if(it->second != NULL) {
+                safe->set_schedule(it->first, it->second);
             } else {
-                results << resp_item(item->id, true, value->value());
+                safe->drop_schedule(it->first);
             }
-        } catch(InteruptionHandling er) {
-            results << resp_item(item->id, false, er);
         }
-        results << endl;
+        changes.clear();
+        safe->take_releasing(releasing);
     }
 
-    stringstream result_buf;
-    result_buf << drop_results.str();
-    result_buf << results.str();
-    result_buf << error_results.str();
-    return result_buf.str();
+    // Devices are switched outside of the lock, the runtime need not wait.
+    // What the dropped schedules switched on goes off before VALUE lines.
+    PriorityScope scope(PRIORITY_INTERACTIVE);
+    for(Commands::iterator it = releasing.begin();
+        it != releasing.end(); it++) {
+        it->command->execute();
+    }
+    for(size_t i = 0; i < lines.size(); i++) {
+        if(values[i] != NULL) {
+            Result value = values[i]->execute();
+            responses[i] = resp_item(lines[i].id, !value.is_error(),
+                                     value.value());
+        }
+        if(!responses[i].empty()) {
+            out << responses[i] << endl;
+        }
+    }
+    lines.clear();
+    staged.clear();
+}
+
+
+string InstructionListModel::execute(model_call_params_t &params)
+    throw(InteruptionHandling) {
+    stringstream results;
+    InstructionBatch batch(params, results);
+    batch.feed(params.request_data.data(), params.request_data.size());
+    batch.finish();
+    return results.str();
 }
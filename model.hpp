@@ -1,10 +1,18 @@
 #ifndef _MODEL_HPP_DEFINED_
 #define _MODEL_HPP_DEFINED_
 
+#include <map>
+#include <memory>
+#include <vector>
+
 #include "confbind.hpp"
 #include "commands.hpp"
 #include "runtime.hpp"
 #include "resourcemanager.hpp"
+#include "conditions.hpp"
+#include "state.hpp"
+#include "telemetry.hpp"
+#include "outbox.hpp"
 
 
 class InteruptionHandling: public std::string {
@@ -18,17 +26,41 @@ struct model_call_params_t {
     Devices *devices;
     NamedSchedule *sched;
     Resources *res;
-    std::map<std::string, std::list<std::string> > *busy;
+    BusyResources *busy;
     std::string request_data;
 };
 
 
+// Gives back the resources of a schedule as soon as the runtime reclaims
+// it, all of them are otherwise taken and released under the schedule lock
+class ResourcesReclaimer: public ReclaimHandler {
+private:
+    BusyResources &busy;
+    Resources &res;
+
+public:
+    ~ResourcesReclaimer() throw() {};
+    ResourcesReclaimer(BusyResources &_busy, Resources &_res):
+        busy(_busy), res(_res) {};
+
+    void reclaimed(const std::string &name) {
+        busy.release(name, res);
+    }
+};
+
+
 class BaseModel {
 public:
     virtual ~BaseModel() throw() {}
 
     virtual std::string execute(model_call_params_t &params)
         throw(InteruptionHandling) = 0;
+
+    // Requests which only read may be answered ahead of requests received
+    // earlier, each model tells them by their data
+    virtual bool independent(const std::string &request_data) const {
+        return false;
+    }
 };
 
 
@@ -38,10 +70,128 @@ public:
 
     std::string execute(model_call_params_t &params)
         throw(InteruptionHandling);
+
+    bool independent(const std::string &request_data) const {
+        return true;
+    }
+};
+
+
+class StatsModel: public BaseModel {
+public:
+    ~StatsModel() throw() {};
+
+    std::string execute(model_call_params_t &params)
+        throw(InteruptionHandling);
+
+    bool independent(const std::string &request_data) const {
+        return true;
+    }
+};
+
+
+// Relay positions and sensor readings changed after the version given as
+// SINCE=<version>:EPOCH=<epoch>, GET takes everything
+class StateModel: public BaseModel {
+public:
+    ~StateModel() throw() {};
+
+    std::string execute(model_call_params_t &params)
+        throw(InteruptionHandling);
+
+    bool independent(const std::string &request_data) const {
+        return true;
+    }
+};
+
+
+// Next batch of buffered sensor samples, ACK=<seq> drops those the server
+// has stored before the batch is taken
+class TelemetryModel: public BaseModel {
+public:
+    ~TelemetryModel() throw() {};
+
+    std::string execute(model_call_params_t &params)
+        throw(InteruptionHandling);
+
+    bool independent(const std::string &request_data) const {
+        return request_data == "GET";
+    }
+};
+
+
+// Next batch of events stored while nobody was listening, ACK=<seq>
+// drops those the server has stored before the batch is taken
+class EventsModel: public BaseModel {
+public:
+    ~EventsModel() throw() {};
+
+    std::string execute(model_call_params_t &params)
+        throw(InteruptionHandling);
+
+    bool independent(const std::string &request_data) const {
+        return request_data == "GET";
+    }
 };
 
 
-typedef std::map<std::string, std::string> s_map;
+// Keys an instruction line may carry, anything else is ignored
+typedef enum {
+    FIELD_ID,
+    FIELD_TYPE,
+    FIELD_COMMAND,
+    FIELD_NAME,
+    FIELD_COUPLE,
+    FIELD_START,
+    FIELD_STOP,
+    FIELD_COUPLING_INTERVAL,
+    FIELD_RESTART,
+    FIELD_CATCHUP,
+    FIELD_CONDITION,
+    FIELD_STEPS,
+    FIELD_SINCE,
+    FIELD_EPOCH,
+    FIELD_ACK,
+    FIELDS
+} field_key_t;
+
+extern const char *FIELD_NAMES[FIELDS];
+
+
+// Values of a KEY=value:KEY=value line split in a single pass. Values
+// point into the tokenized text, which has to outlive them unless it was
+// handed over with assign().
+class InstructionFields {
+private:
+    struct view_t {
+        const char *data;
+        size_t size;
+    };
+
+    view_t values[FIELDS];
+    unsigned int present;
+    std::string owned;
+
+public:
+    InstructionFields(): present(0) {};
+
+    static int key(const char *name, size_t size);
+
+    void tokenize(const char *data, size_t size);
+    void assign(const std::string &line);
+    void clear() {
+        present = 0;
+    }
+
+    bool has(field_key_t field) const {
+        return present & (1u << field);
+    }
+    // Empty for a missing key
+    std::string operator[](field_key_t field) const;
+    bool equals(field_key_t field, const char *value) const;
+    // Parsed in place, throws InteruptionHandling unless a whole number
+    int number(field_key_t field) const;
+};
 
 class BaseInstructionLine {
 public:
@@ -49,13 +199,15 @@ public:
         INSTRUCTION_VALUE,
         INSTRUCTION_SINGLE,
         INSTRUCTION_COUPLED,
-        INSTRUCTION_CONDITIONAL
+        INSTRUCTION_CONDITIONAL,
+        INSTRUCTION_SEQUENCE
     } type;
 
     virtual ~BaseInstructionLine() throw() {};
     virtual void build(std::string) {};
 
-    static void deconstruct(std::string, s_map&);
+    // Copies the line, fields are then safe to keep after it is gone
+    static void deconstruct(const std::string&, InstructionFields&);
 };
 
 
@@ -64,7 +216,7 @@ public:
     std::string id, command;
 
     virtual ~ValueInstructionLine() throw() {};
-    ValueInstructionLine(s_map&);
+    ValueInstructionLine(const InstructionFields&);
 };
 
 
@@ -73,9 +225,10 @@ public:
     std::string id, command, name;
     time_t start, stop;
     int restart;
+    catchup_policy_t catchup;
 
     ~SingleInstructionLine() throw() {};
-    SingleInstructionLine(s_map&);
+    SingleInstructionLine(const InstructionFields&);
 };
 
 
@@ -85,7 +238,7 @@ public:
     int coupling_interval;
 
     ~CoupledInstructionLine() throw() {};
-    CoupledInstructionLine(s_map&);
+    CoupledInstructionLine(const InstructionFields&);
 };
 
 
@@ -108,20 +261,104 @@ struct comparison_t {
     source_endpoint_t source_endpoint;
     operation_t operation;
     double value;
+    // Threshold at which an engaged condition releases, equals value
+    // unless a deadband is given
+    double release;
+    // Minimal number of seconds between two switches
+    int dwell;
 };
 
 
 comparison_t parse_comparison(std::string source) throw(InteruptionHandling);
 
 
+// Compound condition such as
+// "boiler.temperature.LT_50 AND (TIME.GE_0600 OR NOT room.temperature.GT_18)"
+// with sensors referred by index into a list of device names
+struct condition_expression_t {
+    condition_program_t program;
+    std::vector<std::string> sensors;
+};
+
+
+bool is_compound_condition(const std::string &source);
+condition_expression_t parse_condition(std::string source)
+    throw(InteruptionHandling);
+
+
 class ConditionInstructionLine: public BaseInstructionLine {
 public:
     std::string id, command, name, couple;
     time_t start, stop;
+    bool compound;
     comparison_t comparison;
+    condition_expression_t expression;
 
     ~ConditionInstructionLine() throw() {};
-    ConditionInstructionLine(s_map&);
+    ConditionInstructionLine(const InstructionFields&);
+};
+
+
+struct sequence_step_line_t {
+    step_op_t op;
+    std::string command;
+    int delay;
+    bool compound;
+    comparison_t comparison;
+    condition_expression_t expression;
+};
+
+
+// STEPS=boiler.on;WAIT_600;UNTIL_boiler.temperature.GT_60;boiler.off
+class SequenceInstructionLine: public BaseInstructionLine {
+public:
+    std::string id, name;
+    time_t start, stop;
+    std::vector<sequence_step_line_t> steps;
+
+    ~SequenceInstructionLine() throw() {};
+    SequenceInstructionLine(const InstructionFields&);
+};
+
+
+// Lines of one INSTRUCTIONS request, whatever the chunks they are fed in.
+// Each line is validated on its own as soon as it is complete. finish()
+// then takes resources, builds schedules and publishes them all under a
+// single schedule lock, so the runtime never sees a batch half applied.
+// A line that fails gets its error response without holding up the rest,
+// responses keep the order of the input.
+class InstructionBatch {
+private:
+    struct line_t {
+        std::string type, id, name;
+        std::string response; // Already known for a line failing validation
+        std::unique_ptr<BaseInstructionLine> item;
+    };
+
+    // A change to the schedule set, a NULL schedule drops the name
+    typedef std::pair<std::string, BaseSchedule*> change_t;
+
+    model_call_params_t &params;
+    std::ostream &out;
+    std::string partial;
+    std::vector<line_t> lines;
+    std::vector<change_t> changes;
+    // Whether a name is in use once the changes staged so far are made
+    std::map<std::string, bool> staged;
+
+    void validate(const char *data, size_t size);
+    bool taken(NamedSchedule &sched, const std::string &name) const;
+    void install(const std::string &name, BaseSchedule *schedule);
+    std::string stage(NamedSchedule &sched, line_t &line,
+                      Command *&value);
+
+public:
+    InstructionBatch(model_call_params_t &prms, std::ostream &output);
+    ~InstructionBatch() throw();
+
+    void feed(const char *data, size_t size);
+    // Takes a last line left without a line feed and applies the batch
+    void finish();
 };
 
 
@@ -134,7 +371,11 @@ public:
 };
 
 
-Command *command_from_string(model_call_params_t &params, std::string cmd);
+// The shared command a device.op names, validated against the device
+Command &device_command(model_call_params_t &params, const std::string &cmd);
+// A handle to it for a schedule to own
+Command *command_from_string(model_call_params_t &params,
+                             const std::string &cmd);
 
 
 BaseSchedule *get_single(model_call_params_t &params,
@@ -143,6 +384,8 @@ BaseSchedule *get_coupled(model_call_params_t &params,
                           CoupledInstructionLine *item);
 BaseSchedule* get_conditioned(model_call_params_t &params,
                               ConditionInstructionLine *item);
+BaseSchedule* get_sequence(model_call_params_t &params,
+                           SequenceInstructionLine *item);
 
 
 #endif
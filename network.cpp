@@ -1,12 +1,12 @@
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <netinet/in.h>
-#include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sstream>
+#include <algorithm>
 
 #include <openssl/rand.h>
 #include <openssl/ssl.h>
@@ -14,6 +14,8 @@
 
 
 #include "network.hpp"
+#include "constants.hpp"
+#include "resolver.hpp"
 
 
 std::string get_ssl_error() {
@@ -27,16 +29,107 @@ std::string get_system_error() {
 }
 
 
-Connection::~Connection() throw() {
-    if(socket) {
-        close(socket);
+HandshakeStats handshake_stats;
+
+
+std::string HandshakeStats::view() const {
+    std::stringstream buf;
+    buf << "STAT=HANDSHAKE.FULL:" << full.snapshot().view() << "\n";
+    buf << "STAT=HANDSHAKE.RESUMED:" << resumed.snapshot().view() << "\n";
+    return buf.str();
+}
+
+
+TlsContext tls_context;
+
+
+TlsContext::TlsContext(): context(NULL) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+
+TlsContext::~TlsContext() throw() {
+    for(std::map<std::string, SSL_SESSION*>::iterator it = sessions.begin();
+        it != sessions.end(); it++) {
+        SSL_SESSION_free(it->second);
+    }
+    if(context) {
+        SSL_CTX_free(context);
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+
+SSL_CTX *TlsContext::get() {
+    pthread_mutex_lock(&mutex);
+    if(context == NULL) {
+        context = SSL_CTX_new(SSLv23_client_method());
+        if(context != NULL) {
+            // Sessions are kept here per server, TLS 1.3 tickets arrive
+            // after the handshake so they are caught by the callback
+            SSL_CTX_set_session_cache_mode(
+                context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL);
+            SSL_CTX_sess_set_new_cb(context, TlsContext::on_session);
+        }
+    }
+    SSL_CTX *res = context;
+    pthread_mutex_unlock(&mutex);
+    if(res == NULL) {
+        throw ConnectionError(get_ssl_error());
+    }
+    return res;
+}
+
+
+int TlsContext::on_session(SSL *ssl, SSL_SESSION *session) {
+    const std::string *server =
+        reinterpret_cast<const std::string*>(SSL_get_app_data(ssl));
+    if(server == NULL) {
+        return 0;
     }
+    TlsContext &self = tls_context;
+    pthread_mutex_lock(&self.mutex);
+    SSL_SESSION *&slot = self.sessions[*server];
+    if(slot != NULL) {
+        SSL_SESSION_free(slot);
+    }
+    slot = session;
+    pthread_mutex_unlock(&self.mutex);
+    return 1; // The reference is kept
+}
+
+
+SSL_SESSION *TlsContext::session(const std::string &server) {
+    pthread_mutex_lock(&mutex);
+    SSL_SESSION *res = NULL;
+    std::map<std::string, SSL_SESSION*>::iterator it = sessions.find(server);
+    if(it != sessions.end()) {
+        res = it->second;
+        SSL_SESSION_up_ref(res);
+    }
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
+
+
+void TlsContext::forget(const std::string &server) {
+    pthread_mutex_lock(&mutex);
+    std::map<std::string, SSL_SESSION*>::iterator it = sessions.find(server);
+    if(it != sessions.end()) {
+        SSL_SESSION_free(it->second);
+        sessions.erase(it);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+Connection::~Connection() throw() {
     if(ssl_handle) {
         SSL_shutdown(ssl_handle);
         SSL_free(ssl_handle);
     }
-    if(ssl_context) {
-        SSL_CTX_free(ssl_context);
+    if(socket) {
+        close(socket);
     }
 }
 
@@ -51,37 +144,33 @@ bool Connection::connected() {
 
 
 int tcp_connect(const char *host_addr, int port) {
-    int error, handle;
-    struct hostent *host;
-    struct sockaddr_in server;
-
-    host = gethostbyname(host_addr);
-    handle = socket(AF_INET, SOCK_STREAM, 0);
-    if(handle < 0) {
+    endpoints_t endpoints = resolver.resolve(host_addr, port);
+    int handle;
+    try {
+        handle = race_connect(endpoints);
+    } catch(ConnectionError &e) {
+        // The server might have moved, look it up afresh next time
+        resolver.forget(host_addr, port);
         std::stringstream buf;
-        buf << "socket: " << get_system_error();
+        buf << "Cannot connect to " << host_addr << ":" << port << ": "
+            << e.what();
         throw ConnectionError(buf.str());
-    } else {
-        server.sin_family = AF_INET;
-        server.sin_port = htons(port);
-        server.sin_addr = *((struct in_addr *)host->h_addr);
-        bzero(&(server.sin_zero), 8);
-
-        error = connect(handle,(struct sockaddr *)&server,
-                        sizeof(struct sockaddr));
-        if(error == -1) {
-            std::stringstream buf;
-            buf << "Cannot connect to " << host_addr << ":" << port;
-            throw ConnectionError(buf.str());
-        }
     }
 
+    // Sessions are long-lived, let the kernel notice dead peers too
+    int enable = 1;
+    setsockopt(handle, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
     return handle;
 }
 
 
 
 void Connection::set_connection(std::string host, int port) {
+    std::stringstream key;
+    key << host << ":" << port;
+    server = key.str();
+
+    SSL_CTX *ssl_context = tls_context.get();
 
     socket = tcp_connect(host.c_str(), port);
     if(socket == 0) {
@@ -90,70 +179,173 @@ void Connection::set_connection(std::string host, int port) {
         throw ConnectionError(buf.str());
     }
 
-    ssl_handle = NULL;
-    ssl_context = NULL;
-
-    ssl_context = SSL_CTX_new(SSLv23_client_method());
-    if(ssl_context == NULL) {
-        close(socket);
-        throw ConnectionError(get_ssl_error());
-    }
-
     ssl_handle = SSL_new(ssl_context);
     if(ssl_handle == NULL) {
         close(socket);
-        SSL_CTX_free(ssl_context);
+        socket = 0;
         throw ConnectionError(get_ssl_error());
     }
+    SSL_set_app_data(ssl_handle, &server);
 
     if(!SSL_set_fd(ssl_handle, socket)) {
-        close(socket);
-        SSL_CTX_free(ssl_context);
-        SSL_shutdown(ssl_handle);
-        SSL_free(ssl_handle);
         throw ConnectionError(get_ssl_error());
     }
 
+    SSL_SESSION *cached = tls_context.session(server);
+    if(cached != NULL) {
+        SSL_set_session(ssl_handle, cached);
+        SSL_SESSION_free(cached);
+    }
+
+    unsigned long long started = monotonic_usec();
     if(SSL_connect(ssl_handle) != 1) {
-        close(socket);
-        SSL_CTX_free(ssl_context);
-        SSL_shutdown(ssl_handle);
-        SSL_free(ssl_handle);
+        // The cached session might be what the server refuses
+        tls_context.forget(server);
         throw ConnectionError(get_ssl_error());
     }
+    unsigned long long spent = monotonic_usec() - started;
+    if(SSL_session_reused(ssl_handle)) {
+        handshake_stats.resumed.record(spent);
+    } else {
+        handshake_stats.full.record(spent);
+    }
 }
 
 
-std::string Connection::receive() {
-    const int READ_SIZE = 1024;
-    char tmp[READ_SIZE];
-    std::stringstream buf;
+char *FrameReader::space(size_t size) {
+    if(begin == end) {
+        begin = end = 0;
+    }
+    if(buffer.size() - end < size && begin > 0) {
+        std::copy(buffer.begin() + begin, buffer.begin() + end,
+                  buffer.begin());
+        end -= begin;
+        begin = 0;
+    }
+    if(buffer.size() - end < size) {
+        buffer.resize(end + size);
+    }
+    return buffer.data() + end;
+}
+
 
-    while(true) {
-        int received = SSL_read(ssl_handle, tmp, READ_SIZE);
-        if(received < READ_SIZE) {
-            if(tmp[received - 1] != '\0') {
-                tmp[received] = '\0';
+// Parses the header at the front, returns the payload length or -1 if the
+// header is not complete yet
+static long long frame_header(const char *data, size_t size,
+                              size_t &header) {
+    long long length = 0;
+    for(size_t i = 0; i < size; i++) {
+        if(data[i] == '\n') {
+            if(i == 0) {
+                throw ConnectionError("Empty frame header");
             }
-            buf << tmp;
-        } else {
-            buf << std::string(tmp, READ_SIZE);
+            header = i + 1;
+            return length;
         }
-
-        if(received < READ_SIZE) {
-            break;
+        if(data[i] < '0' || data[i] > '9') {
+            throw ConnectionError("Malformed frame header");
+        }
+        length = length*10 + (data[i] - '0');
+        if(length > CONTROL_MAX_FRAME) {
+            throw ConnectionError("Frame is too large");
         }
     }
+    return -1;
+}
+
+
+bool FrameReader::ready() const {
+    size_t header;
+    long long length = frame_header(buffer.data() + begin, end - begin,
+                                    header);
+    return length >= 0 && end - begin >= header + length;
+}
+
+
+bool FrameReader::next(message_view_t &message) {
+    size_t header;
+    long long length = frame_header(buffer.data() + begin, end - begin,
+                                    header);
+    if(length < 0) {
+        return false;
+    }
+    if(end - begin < header + length) {
+        // Make sure the whole frame fits, reads append in place then
+        space(header + length - (end - begin));
+        return false;
+    }
+    message.data = buffer.data() + begin + header;
+    message.size = length;
+    begin += header + length;
+    return true;
+}
 
+
+std::string FrameReader::frame(const std::string &payload) {
+    std::stringstream buf;
+    buf << payload.length() << "\n" << payload;
     return buf.str();
 }
 
 
-void Connection::send(std::string data) {
-    if(data.length() % 2 == 0) {
-        data += '\0';
+message_view_t BaseConnection::receive_view() {
+    received = receive();
+    message_view_t message = {received.data(), received.size()};
+    return message;
+}
+
+
+message_view_t Connection::receive_view() {
+    const size_t READ_SIZE = 4096;
+    message_view_t message;
+
+    while(!reader.next(message)) {
+        char *dest = reader.space(READ_SIZE);
+        int received = SSL_read(ssl_handle, dest, reader.available());
+        if(received <= 0) {
+            throw ConnectionError("Connection closed by the server");
+        }
+        reader.commit(received);
     }
-    if(SSL_write(ssl_handle, data.c_str(), data.length()) != (int)data.length()) {
+    return message;
+}
+
+
+std::string Connection::receive() {
+    return receive_view().str();
+}
+
+
+void Connection::send(std::string data) {
+    std::string framed = FrameReader::frame(data);
+    if(SSL_write(ssl_handle, framed.c_str(), framed.length()) !=
+       (int)framed.length()) {
         throw ConnectionError("Failed to send");
     }
 }
+
+
+bool Connection::wait(int timeout) {
+    if(reader.ready() || SSL_pending(ssl_handle) > 0) {
+        return true;
+    }
+
+    struct pollfd fd;
+    fd.fd = socket;
+    fd.events = POLLIN;
+    fd.revents = 0;
+    int status = poll(&fd, 1, timeout);
+    if(status < 0) {
+        if(errno == EINTR) {
+            return false;
+        }
+        std::stringstream buf;
+        buf << "poll: " << get_system_error();
+        throw ConnectionError(buf.str());
+    }
+    if(fd.revents & (POLLERR | POLLNVAL)) {
+        throw ConnectionError("Connection lost");
+    }
+    // A hang up is reported as readable, the read then fails
+    return status > 0;
+}
@@ -1,17 +1,45 @@
 #ifndef _NETWORK_HPP_INCLUDED_
 #define _NETWORK_HPP_INCLUDED_
 
+#include <map>
 #include <string>
+#include <vector>
 
+#include <pthread.h>
 #include <openssl/ssl.h>
 
+#include "metrics.hpp"
+
+
+// Message payload pointing into a receive buffer, valid until the next
+// message is taken from it
+struct message_view_t {
+    const char *data;
+    size_t size;
+
+    std::string str() const {
+        return std::string(data, size);
+    }
+};
+
 
 class BaseConnection {
+private:
+    std::string received;
+
 public:
     virtual ~BaseConnection() throw() {};
     virtual bool connected() = 0;
     virtual void send(std::string) = 0;
     virtual std::string receive() = 0;
+    // Connections with a buffer of their own hand out views into it, the
+    // others keep a copy of the last message received
+    virtual message_view_t receive_view();
+
+    // Waits up to timeout milliseconds for incoming data
+    virtual bool wait(int timeout) {
+        return true;
+    }
 };
 
 
@@ -30,20 +58,83 @@ public:
 };
 
 
+// Handshake wall time in microseconds, full and abbreviated ones apart
+class HandshakeStats {
+public:
+    Histogram full, resumed;
+
+    std::string view() const;
+};
+
+extern HandshakeStats handshake_stats;
+
+
+// One client context for the whole process, with the last TLS session
+// every server handed out so that reconnects resume it
+class TlsContext {
+private:
+    SSL_CTX *context;
+    std::map<std::string, SSL_SESSION*> sessions;
+    pthread_mutex_t mutex;
+
+    static int on_session(SSL *ssl, SSL_SESSION *session);
+
+public:
+    TlsContext();
+    ~TlsContext() throw();
+
+    SSL_CTX *get();
+    // Returns a referenced session, the caller frees it
+    SSL_SESSION *session(const std::string &server);
+    void forget(const std::string &server);
+};
+
+extern TlsContext tls_context;
+
+
+// Splits a byte stream into messages framed as "<length>\n<payload>". The
+// buffer grows to the largest message seen and is reused between them.
+class FrameReader {
+private:
+    std::vector<char> buffer;
+    size_t begin, end;
+
+public:
+    FrameReader(): buffer(4096), begin(0), end(0) {};
+
+    // Room for at least size more bytes to be read into
+    char *space(size_t size);
+    size_t available() const {
+        return buffer.size() - end;
+    }
+    void commit(size_t size) {
+        end += size;
+    }
+
+    bool next(message_view_t &message);
+    bool ready() const;
+
+    static std::string frame(const std::string &payload);
+};
+
+
 class Connection: public BaseConnection {
 private:
     int socket;
     SSL *ssl_handle;
-    SSL_CTX *ssl_context;
+    std::string server;
+    FrameReader reader;
 
 public:
-    Connection(): socket(0), ssl_handle(NULL), ssl_context(NULL) {};
+    Connection(): socket(0), ssl_handle(NULL) {};
     virtual ~Connection() throw();
 
     void set_connection(std::string host, int port);
     virtual bool connected();
     void send(std::string);
     std::string receive();
+    message_view_t receive_view();
+    bool wait(int timeout);
 };
 
 
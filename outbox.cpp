@@ -0,0 +1,308 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "outbox.hpp"
+
+
+using namespace std;
+
+
+Outbox outbox;
+
+
+static unsigned long crc32(const char *data, size_t size) {
+    static unsigned long table[256];
+    static bool ready = false;
+    if(!ready) {
+        for(unsigned long i = 0; i < 256; i++) {
+            unsigned long value = i;
+            for(int bit = 0; bit < 8; bit++) {
+                value = value & 1 ? 0xEDB88320ul ^ (value >> 1) : value >> 1;
+            }
+            table[i] = value;
+        }
+        ready = true;
+    }
+    unsigned long res = 0xFFFFFFFFul;
+    for(size_t i = 0; i < size; i++) {
+        res = table[(res ^ (unsigned char)data[i]) & 0xFF] ^ (res >> 8);
+    }
+    return res ^ 0xFFFFFFFFul;
+}
+
+
+static string outbox_error(const string &what) {
+    return what + ": " + strerror(errno);
+}
+
+
+Outbox::Outbox():
+    tail(-1), next_seq(1), acked(0), dropped(0), total_limit(0),
+    segment_limit(0), total(0) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+
+Outbox::~Outbox() throw() {
+    if(tail >= 0) {
+        close(tail);
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+
+string Outbox::segment_path(unsigned long first) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%020lu.seg", first);
+    return directory + "/" + name;
+}
+
+
+// Records are "<seq> <length> <crc32>\n<payload>\n"
+void Outbox::read_segment(segment_t &segment, vector<record_t> &records,
+                          bool repair) {
+    ifstream file(segment.path.c_str(), ios::binary);
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+    size_t offset = 0;
+    segment.last = segment.first - 1;
+    while(offset < data.size()) {
+        size_t eol = data.find('\n', offset);
+        unsigned long seq, length, crc;
+        if(eol == string::npos ||
+           sscanf(data.c_str() + offset, "%lu %lu %lx", &seq, &length,
+                  &crc) != 3 ||
+           eol + 1 + length + 1 > data.size() ||
+           data[eol + 1 + length] != '\n' ||
+           crc32(data.data() + eol + 1, length) != crc ||
+           seq <= segment.last) {
+            break;
+        }
+        record_t record;
+        record.seq = seq;
+        record.payload = data.substr(eol + 1, length);
+        records.push_back(record);
+        segment.last = seq;
+        offset = eol + 1 + length + 1;
+    }
+
+    segment.size = offset;
+    if(repair && offset < data.size()) {
+        // A record torn by a crash and whatever follows it
+        if(truncate(segment.path.c_str(), offset) < 0) {
+            throw OutboxError(outbox_error("truncate " + segment.path));
+        }
+    }
+}
+
+
+void Outbox::open(const string &path, size_t max_size, size_t segment_size) {
+    pthread_mutex_lock(&mutex);
+    directory = path;
+    total_limit = max_size;
+    segment_limit = segment_size;
+
+    if(mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+        directory.clear();
+        pthread_mutex_unlock(&mutex);
+        throw OutboxError(outbox_error("mkdir " + path));
+    }
+
+    ifstream saved((path + "/ack").c_str());
+    saved >> acked;
+
+    vector<unsigned long> firsts;
+    DIR *dir = opendir(path.c_str());
+    if(dir == NULL) {
+        directory.clear();
+        pthread_mutex_unlock(&mutex);
+        throw OutboxError(outbox_error("opendir " + path));
+    }
+    for(struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+        char *end;
+        unsigned long first = strtoul(entry->d_name, &end, 10);
+        if(end != entry->d_name && strcmp(end, ".seg") == 0) {
+            firsts.push_back(first);
+        }
+    }
+    closedir(dir);
+    sort(firsts.begin(), firsts.end());
+
+    next_seq = acked + 1;
+    for(size_t i = 0; i < firsts.size(); i++) {
+        segment_t segment;
+        segment.first = firsts[i];
+        segment.path = segment_path(firsts[i]);
+        vector<record_t> records;
+        try {
+            read_segment(segment, records, true);
+        } catch(OutboxError &e) {
+            directory.clear();
+            pthread_mutex_unlock(&mutex);
+            throw;
+        }
+        if(records.empty() || segment.last <= acked) {
+            unlink(segment.path.c_str());
+            continue;
+        }
+        segments.push_back(segment);
+        total += segment.size;
+        next_seq = max(next_seq, segment.last + 1);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void Outbox::start_segment() {
+    if(tail >= 0) {
+        close(tail);
+    }
+    segment_t segment;
+    segment.first = next_seq;
+    segment.last = next_seq - 1;
+    segment.size = 0;
+    segment.path = segment_path(next_seq);
+    tail = ::open(segment.path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(tail < 0) {
+        throw OutboxError(outbox_error("open " + segment.path));
+    }
+    segments.push_back(segment);
+}
+
+
+void Outbox::drop_oldest() {
+    segment_t &oldest = segments.front();
+    if(oldest.last > acked) {
+        dropped += oldest.last - max(oldest.first - 1, acked);
+        acked = oldest.last;
+    }
+    unlink(oldest.path.c_str());
+    total -= oldest.size;
+    segments.pop_front();
+    if(segments.empty() && tail >= 0) {
+        close(tail);
+        tail = -1;
+    }
+}
+
+
+void Outbox::save_acked() {
+    string saved = directory + "/ack";
+    string temporary = saved + ".tmp";
+    {
+        ofstream file(temporary.c_str(), ios::trunc);
+        file << acked << "\n";
+    }
+    // The old value stays whole until the new one is in place
+    rename(temporary.c_str(), saved.c_str());
+}
+
+
+void Outbox::push(const string &event) {
+    pthread_mutex_lock(&mutex);
+    if(!opened()) {
+        dropped++;
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+
+    char header[64];
+    int length = snprintf(header, sizeof(header), "%lu %lu %lx\n",
+                          next_seq, (unsigned long)event.size(),
+                          crc32(event.data(), event.size()));
+    string record = string(header, length) + event + "\n";
+
+    try {
+        if(tail < 0 || segments.back().size >= segment_limit) {
+            start_segment();
+        }
+        segment_t &segment = segments.back();
+        size_t written = 0;
+        while(written < record.size()) {
+            ssize_t status = write(tail, record.data() + written,
+                                   record.size() - written);
+            if(status < 0 && errno == EINTR) {
+                continue;
+            }
+            if(status <= 0) {
+                // Leave no partial record behind
+                if(ftruncate(tail, segment.size) < 0) {
+                    ;
+                }
+                throw OutboxError(outbox_error("write " + segment.path));
+            }
+            written += status;
+        }
+        segment.last = next_seq++;
+        segment.size += record.size();
+        total += record.size();
+        if(total > total_limit && segments.size() > 1) {
+            while(total > total_limit && segments.size() > 1) {
+                drop_oldest();
+            }
+            save_acked();
+        }
+    } catch(OutboxError &e) {
+        dropped++;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void Outbox::acknowledge(unsigned long seq) {
+    pthread_mutex_lock(&mutex);
+    seq = min(seq, next_seq - 1);
+    if(opened() && seq > acked) {
+        acked = seq;
+        while(!segments.empty() && segments.front().last <= acked) {
+            drop_oldest();
+        }
+        save_acked();
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+string Outbox::batch(size_t limit) {
+    pthread_mutex_lock(&mutex);
+    stringstream body;
+    unsigned long upper = acked;
+    size_t taken = 0;
+    for(size_t i = 0; i < segments.size() && taken < limit; i++) {
+        segment_t segment = segments[i];
+        vector<record_t> records;
+        read_segment(segment, records, false);
+        for(size_t j = 0; j < records.size() && taken < limit; j++) {
+            if(records[j].seq <= acked) {
+                continue;
+            }
+            body << records[j].payload << "\n";
+            upper = records[j].seq;
+            taken++;
+        }
+    }
+
+    stringstream buf;
+    buf << "SEQ=" << upper << ":PENDING=" << next_seq - 1 - upper
+        << ":DROPPED=" << dropped << "\n";
+    pthread_mutex_unlock(&mutex);
+    return buf.str() + body.str();
+}
+
+
+unsigned long Outbox::pending() {
+    pthread_mutex_lock(&mutex);
+    unsigned long res = next_seq - 1 - acked;
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
@@ -0,0 +1,78 @@
+#ifndef _OUTBOX_HPP_INCLUDED_
+#define _OUTBOX_HPP_INCLUDED_
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "constants.hpp"
+
+
+class OutboxError: public std::exception, public std::string {
+public:
+    ~OutboxError() throw() {};
+    OutboxError(std::string message): std::string(message) {};
+
+    const char *what() const throw() {
+        return this->c_str();
+    }
+};
+
+
+// Events kept on disk until the server acknowledges them. Records are
+// appended to segment files named after their first sequence number, each
+// one checksummed so a record torn by a crash is cut off on the next
+// start. Segments are removed once acknowledged; when the size cap is
+// reached the oldest segment goes whether acknowledged or not.
+class Outbox {
+private:
+    struct segment_t {
+        std::string path;
+        unsigned long first, last;
+        size_t size;
+    };
+
+    struct record_t {
+        unsigned long seq;
+        std::string payload;
+    };
+
+    std::string directory;
+    std::deque<segment_t> segments;
+    int tail;
+    unsigned long next_seq, acked, dropped;
+    size_t total_limit, segment_limit, total;
+    pthread_mutex_t mutex;
+
+    std::string segment_path(unsigned long first) const;
+    void read_segment(segment_t &segment, std::vector<record_t> &records,
+                      bool repair);
+    void start_segment();
+    void drop_oldest();
+    void save_acked();
+
+public:
+    Outbox();
+    ~Outbox() throw();
+
+    // Recovers what a previous run left in the directory
+    void open(const std::string &path, size_t max_size=OUTBOX_MAX_SIZE,
+              size_t segment_size=OUTBOX_SEGMENT_SIZE);
+    bool opened() const {
+        return !directory.empty();
+    }
+
+    // Events are single lines, pushes to an outbox not opened are lost
+    void push(const std::string &event);
+    void acknowledge(unsigned long seq);
+    // SEQ=<seq>:PENDING=<events left>:DROPPED=<events lost>, then at most
+    // limit events after the acknowledged ones, one per line
+    std::string batch(size_t limit);
+    unsigned long pending();
+};
+
+extern Outbox outbox;
+
+#endif
@@ -0,0 +1,317 @@
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <sstream>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+
+#include "resolver.hpp"
+#include "network.hpp"
+#include "metrics.hpp"
+
+
+using namespace std;
+
+
+Resolver resolver;
+
+
+// Shared by the caller and the lookup thread, whoever leaves last frees it
+struct lookup_t {
+    Resolver *owner;
+    string key, host, service;
+    pthread_mutex_t mutex;
+    pthread_cond_t finished;
+    bool done;
+    int refs;
+    int status;
+    endpoints_t endpoints;
+
+    lookup_t(): done(false), refs(2), status(0) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&finished, NULL);
+    }
+
+    ~lookup_t() throw() {
+        pthread_cond_destroy(&finished);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void release() {
+        pthread_mutex_lock(&mutex);
+        bool last = --refs == 0;
+        pthread_mutex_unlock(&mutex);
+        if(last) {
+            delete this;
+        }
+    }
+};
+
+
+static string endpoint_key(const string &host, int port) {
+    stringstream buf;
+    buf << host << ":" << port;
+    return buf.str();
+}
+
+
+// Alternates address families starting from the one listed first
+static endpoints_t interleave(const endpoints_t &sorted) {
+    endpoints_t first, second;
+    for(size_t i = 0; i < sorted.size(); i++) {
+        if(sorted[i].family() == sorted[0].family()) {
+            first.push_back(sorted[i]);
+        } else {
+            second.push_back(sorted[i]);
+        }
+    }
+    endpoints_t res;
+    for(size_t i = 0; i < first.size() || i < second.size(); i++) {
+        if(i < first.size()) {
+            res.push_back(first[i]);
+        }
+        if(i < second.size()) {
+            res.push_back(second[i]);
+        }
+    }
+    return res;
+}
+
+
+Resolver::Resolver(int _ttl): ttl(_ttl) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+
+Resolver::~Resolver() throw() {
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void Resolver::store(const string &key, const endpoints_t &endpoints) {
+    pthread_mutex_lock(&mutex);
+    entry_t &entry = cache[key];
+    entry.endpoints = endpoints;
+    entry.expires = monotonic_usec() + (unsigned long long)ttl*1000000;
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void *Resolver::lookup(void *args) {
+    lookup_t *job = reinterpret_cast<lookup_t*>(args);
+
+    struct addrinfo hints, *found = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    int status = getaddrinfo(job->host.c_str(), job->service.c_str(),
+                             &hints, &found);
+
+    endpoints_t endpoints;
+    for(struct addrinfo *it = found; status == 0 && it; it = it->ai_next) {
+        endpoint_t endpoint;
+        memset(&endpoint.address, 0, sizeof(endpoint.address));
+        memcpy(&endpoint.address, it->ai_addr, it->ai_addrlen);
+        endpoint.length = it->ai_addrlen;
+        endpoints.push_back(endpoint);
+    }
+    if(found) {
+        freeaddrinfo(found);
+    }
+    if(status == 0 && endpoints.empty()) {
+        status = EAI_NONAME;
+    }
+    if(status == 0) {
+        endpoints = interleave(endpoints);
+        job->owner->store(job->key, endpoints);
+    }
+
+    pthread_mutex_lock(&job->mutex);
+    job->status = status;
+    job->endpoints = endpoints;
+    job->done = true;
+    pthread_cond_signal(&job->finished);
+    pthread_mutex_unlock(&job->mutex);
+    job->release();
+    return NULL;
+}
+
+
+endpoints_t Resolver::resolve(const string &host, int port, int timeout) {
+    string key = endpoint_key(host, port);
+
+    pthread_mutex_lock(&mutex);
+    map<string, entry_t>::iterator it = cache.find(key);
+    if(it != cache.end() && it->second.expires > monotonic_usec()) {
+        endpoints_t res = it->second.endpoints;
+        pthread_mutex_unlock(&mutex);
+        return res;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    lookup_t *job = new lookup_t;
+    job->owner = this;
+    job->key = key;
+    job->host = host;
+    stringstream service;
+    service << port;
+    job->service = service.str();
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, Resolver::lookup, job) != 0) {
+        delete job;
+        throw ConnectionError("Cannot start resolver: " + get_system_error());
+    }
+    pthread_detach(thread);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout/1000;
+    deadline.tv_nsec += (timeout%1000)*1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&job->mutex);
+    while(!job->done) {
+        if(pthread_cond_timedwait(&job->finished, &job->mutex,
+                                  &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool done = job->done;
+    int status = job->status;
+    endpoints_t res = job->endpoints;
+    pthread_mutex_unlock(&job->mutex);
+    job->release();
+
+    if(done && status == 0) {
+        return res;
+    }
+
+    // Better an address that used to work than none
+    pthread_mutex_lock(&mutex);
+    it = cache.find(key);
+    if(it != cache.end()) {
+        res = it->second.endpoints;
+    }
+    pthread_mutex_unlock(&mutex);
+    if(!res.empty()) {
+        return res;
+    }
+
+    stringstream buf;
+    buf << "Cannot resolve " << host << ": "
+        << (done ? gai_strerror(status) : "timed out");
+    throw ConnectionError(buf.str());
+}
+
+
+void Resolver::forget(const string &host, int port) {
+    pthread_mutex_lock(&mutex);
+    cache.erase(endpoint_key(host, port));
+    pthread_mutex_unlock(&mutex);
+}
+
+
+static void set_blocking(int fd, bool blocking) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
+
+int race_connect(const endpoints_t &endpoints, int timeout, int stagger) {
+    unsigned long long now = monotonic_usec();
+    unsigned long long deadline = now + (unsigned long long)timeout*1000;
+    unsigned long long next_attempt = now;
+    vector<struct pollfd> pending;
+    size_t next = 0;
+    int winner = -1;
+    string error = "no addresses";
+
+    while(winner < 0) {
+        now = monotonic_usec();
+        if(next < endpoints.size() && now >= next_attempt) {
+            const endpoint_t &endpoint = endpoints[next++];
+            next_attempt = now + (unsigned long long)stagger*1000;
+            int handle = socket(endpoint.family(), SOCK_STREAM, 0);
+            if(handle < 0) {
+                error = get_system_error();
+                next_attempt = now;
+                continue;
+            }
+            set_blocking(handle, false);
+            if(connect(handle, (const struct sockaddr*)&endpoint.address,
+                       endpoint.length) == 0) {
+                winner = handle;
+                break;
+            }
+            if(errno != EINPROGRESS) {
+                error = get_system_error();
+                close(handle);
+                next_attempt = now;
+                continue;
+            }
+            struct pollfd fd;
+            fd.fd = handle;
+            fd.events = POLLOUT;
+            fd.revents = 0;
+            pending.push_back(fd);
+            continue;
+        }
+
+        if(pending.empty() && next >= endpoints.size()) {
+            break;
+        }
+        if(now >= deadline) {
+            error = "timed out";
+            break;
+        }
+        unsigned long long until = deadline;
+        if(next < endpoints.size() && next_attempt < until) {
+            until = next_attempt;
+        }
+        int wait = (until - now + 999)/1000;
+        if(pending.empty()) {
+            usleep(wait*1000);
+            continue;
+        }
+        if(poll(pending.data(), pending.size(), wait) < 0 && errno != EINTR) {
+            error = get_system_error();
+            break;
+        }
+
+        for(size_t i = 0; i < pending.size() && winner < 0;) {
+            if(!pending[i].revents) {
+                i++;
+                continue;
+            }
+            int status = 0;
+            socklen_t length = sizeof(status);
+            getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &status, &length);
+            if(status == 0) {
+                winner = pending[i].fd;
+            } else {
+                error = strerror(status);
+                close(pending[i].fd);
+                // The next address need not wait for its turn
+                next_attempt = monotonic_usec();
+            }
+            pending.erase(pending.begin() + i);
+        }
+    }
+
+    for(size_t i = 0; i < pending.size(); i++) {
+        close(pending[i].fd);
+    }
+    if(winner < 0) {
+        throw ConnectionError("Cannot connect: " + error);
+    }
+    set_blocking(winner, true);
+    return winner;
+}
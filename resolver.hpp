@@ -0,0 +1,64 @@
+#ifndef _RESOLVER_HPP_INCLUDED_
+#define _RESOLVER_HPP_INCLUDED_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "constants.hpp"
+
+
+struct endpoint_t {
+    struct sockaddr_storage address;
+    socklen_t length;
+
+    int family() const {
+        return address.ss_family;
+    }
+};
+
+typedef std::vector<endpoint_t> endpoints_t;
+
+
+// Caches host lookups for a fixed time since getaddrinfo does not report
+// record TTLs. Lookups run on a thread of their own so a stuck resolver
+// costs the caller no more than its timeout; a late answer still lands in
+// the cache, and a stale entry is served while the resolver is failing.
+class Resolver {
+private:
+    struct entry_t {
+        endpoints_t endpoints;
+        unsigned long long expires;
+    };
+
+    std::map<std::string, entry_t> cache;
+    pthread_mutex_t mutex;
+    int ttl;
+
+    static void *lookup(void *args);
+    void store(const std::string &key, const endpoints_t &endpoints);
+
+public:
+    Resolver(int _ttl=RESOLVER_TTL);
+    ~Resolver() throw();
+
+    // Addresses of host with v4 and v6 interleaved in the preferred order
+    endpoints_t resolve(const std::string &host, int port,
+                        int timeout=RESOLVER_TIMEOUT);
+    void forget(const std::string &host, int port);
+};
+
+extern Resolver resolver;
+
+
+// Connects to whichever endpoint answers first within timeout milliseconds.
+// Attempts are started stagger milliseconds apart, or right away once the
+// previous one fails, and race each other (happy eyeballs, RFC 8305).
+int race_connect(const endpoints_t &endpoints,
+                 int timeout=CONTROL_CONNECT_TIMEOUT,
+                 int stagger=CONTROL_CONNECT_STAGGER);
+
+#endif
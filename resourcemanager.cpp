@@ -13,64 +13,73 @@ const char * ResourceIsBusy::what() const throw() {
 }
 
 
-void Resources::take_resource(const string &resource) {
-    auto &&it = resources.find(resource);
-    if(it == resources.end()) {
+void Resources::take_resource(symbol_t resource) {
+    if(resource == NO_SYMBOL) {
         return;
     }
-    bool rsc = it->second;
-    if(!rsc) {
-        throw ResourceIsBusy(resource);
+    if(!resources[resource]) {
+        throw ResourceIsBusy(symbols.name(resource));
     }
-    auto &&git = binds.find(resource);
-    if(git == binds.end()) {
+    symbol_t group = binds[resource];
+    if(group == NO_SYMBOL) {
         return;
     }
-    auto &group = git->second;
     if(groups[group]) {
-        it->second = false;
+        resources[resource] = false;
     } else {
-        throw ResourceIsBusy(resource);
+        throw ResourceIsBusy(symbols.name(resource));
     }
 }
 
 
-void Resources::take_group(const string &resource) {
-    auto &&git = binds.find(resource);
-    if(git == binds.end()) {
+void Resources::take_group(symbol_t resource) {
+    if(resource == NO_SYMBOL || binds[resource] == NO_SYMBOL) {
         return;
     }
-    groups[git->second] = false;
+    groups[binds[resource]] = false;
 }
 
 
 void Resources::add_resource(const string &resource, const string &group) {
-    resources[resource] = true;
-    binds[resource] = group;
-    groups[group] = true;
-    group_binds[group].push_back(resource);
+    add_resource(resource);
+    symbol_t id = symbols.lookup(resource);
+    symbol_t group_id = group_symbols.intern(group);
+    if((size_t)group_id >= groups.size()) {
+        groups.resize(group_id + 1, true);
+        group_binds.resize(group_id + 1);
+    }
+    binds[id] = group_id;
+    groups[group_id] = true;
+    group_binds[group_id].push_back(id);
 }
 
 
 void Resources::add_resource(const string &resource) {
-    resources[resource] = true;
+    symbol_t id = symbols.intern(resource);
+    if((size_t)id >= resources.size()) {
+        resources.resize(id + 1, true);
+        binds.resize(id + 1, NO_SYMBOL);
+    }
+    resources[id] = true;
 }
 
 
 void Resources::release(const string &resource) {
-    auto &&it = resources.find(resource);
-    if(it == resources.end()) {
+    release(symbols.lookup(resource));
+}
+
+
+void Resources::release(symbol_t resource) {
+    if(resource == NO_SYMBOL) {
         return;
     }
-    it->second = true;
-    auto &&bit = binds.find(resource);
-    if(bit == binds.end()) {
+    resources[resource] = true;
+    symbol_t group = binds[resource];
+    if(group == NO_SYMBOL) {
         return;
     }
-    auto &group = bit->second;
-    auto &ress = group_binds[group];
     bool all_free = true;
-    for(auto &rit: ress) {
+    for(auto rit: group_binds[group]) {
         if(!resources[rit]) {
             all_free = false;
             break;
@@ -82,6 +91,16 @@ void Resources::release(const string &resource) {
 }
 
 
+symbol_t Resources::lookup(const string &resource) const {
+    return symbols.lookup(resource);
+}
+
+
+const string &Resources::name(symbol_t resource) const {
+    return symbols.name(resource);
+}
+
+
 ResourcesTaker *Resources::taker() {
     return new ResourcesTaker(*this);
 }
@@ -92,11 +111,11 @@ ResourcesTaker::ResourcesTaker(Resources &resources): res(resources), success(fa
 
 ResourcesTaker::~ResourcesTaker() throw() {
     if(success) {
-        for(auto &it: groups_to_take) {
+        for(auto it: resources_taken) {
             res.take_group(it);
         }
     } else {
-        for(auto &it: resources_taken) {
+        for(auto it: resources_taken) {
             res.release(it);
         }
     }
@@ -104,20 +123,26 @@ ResourcesTaker::~ResourcesTaker() throw() {
 
 
 void ResourcesTaker::take(const string &resource) {
+    take(res.lookup(resource));
+}
+
+
+void ResourcesTaker::take(symbol_t resource) {
     try {
         res.take_resource(resource);
     } catch(...) {
-        for(auto &it: resources_taken) {
+        for(auto it: resources_taken) {
             res.release(it);
         }
         throw;
     }
-    resources_taken.push_back(resource);
-    groups_to_take.push_back(resource);
+    if(resource != NO_SYMBOL) {
+        resources_taken.push_back(resource);
+    }
 }
 
 
-list<string> ResourcesTaker::captured() {
+symbols_t ResourcesTaker::captured() {
     return resources_taken;
 }
 
@@ -125,3 +150,30 @@ list<string> ResourcesTaker::captured() {
 void ResourcesTaker::approve() {
     success = true;
 }
+
+
+void BusyResources::hold(const string &name, const symbols_t &resources) {
+    symbol_t id = names.intern(name);
+    if((size_t)id >= held.size()) {
+        held.resize(id + 1);
+    }
+    held[id] = resources;
+}
+
+
+bool BusyResources::holds(const string &name) const {
+    return names.lookup(name) != NO_SYMBOL;
+}
+
+
+void BusyResources::release(const string &name, Resources &res) {
+    symbol_t id = names.lookup(name);
+    if(id == NO_SYMBOL) {
+        return;
+    }
+    for(auto it: held[id]) {
+        res.release(it);
+    }
+    held[id].clear();
+    names.release(id);
+}
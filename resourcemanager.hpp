@@ -2,8 +2,9 @@
 #define _RESOURCESMANAGER_HPP_INCLUDED_
 
 #include <string>
-#include <map>
-#include <list>
+#include <vector>
+
+#include "symbols.hpp"
 
 
 class ResourcesTaker;
@@ -17,22 +18,26 @@ public:
 };
 
 
-typedef std::map<std::string, bool> MapSB;
-
 class Resources {
 private:
-    MapSB resources;
-    MapSB groups;
-    std::map<std::string, std::string> binds;
-    std::map<std::string, std::list<std::string> > group_binds;
+    SymbolTable symbols;
+    SymbolTable group_symbols;
+    std::vector<bool> resources;
+    std::vector<bool> groups;
+    symbols_t binds;
+    std::vector<symbols_t> group_binds;
 
-    void take_resource(const std::string &);
-    void take_group(const std::string &);
+    void take_resource(symbol_t);
+    void take_group(symbol_t);
 
 public:
     void add_resource(const std::string &, const std::string &);
     void add_resource(const std::string &);
     void release(const std::string &);
+    void release(symbol_t);
+
+    symbol_t lookup(const std::string &) const;
+    const std::string &name(symbol_t) const;
 
     friend class ResourcesTaker;
     ResourcesTaker *taker();
@@ -42,16 +47,29 @@ public:
 class ResourcesTaker {
 private:
     Resources &res;
-    std::list<std::string> groups_to_take;
-    std::list<std::string> resources_taken;
+    symbols_t resources_taken;
     bool success;
 
 public:
     ResourcesTaker(Resources &);
     virtual ~ResourcesTaker() throw();
     void take(const std::string &);
-    std::list<std::string> captured();
+    void take(symbol_t);
+    symbols_t captured();
     void approve();
 };
 
+
+// Resources held by named schedules
+class BusyResources {
+private:
+    SymbolTable names;
+    std::vector<symbols_t> held;
+
+public:
+    void hold(const std::string &, const symbols_t &);
+    bool holds(const std::string &) const;
+    void release(const std::string &, Resources &);
+};
+
 #endif
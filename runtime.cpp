@@ -1,38 +1,144 @@
 #include <memory>
+#include <stdexcept>
 
 #include "runtime.hpp"
 
 
 using namespace std;
 
+string Result::value() const {
+    stringstream buf;
+    switch(_kind) {
+    case RESULT_INTEGER:
+        buf << data.integer;
+        break;
+    case RESULT_FLOAT:
+        buf << data.floating;
+        break;
+    default:
+        return text;
+    }
+    return buf.str();
+}
+
+
+SchedulerStats scheduler_stats;
+
+const char *SCHEDULE_KIND_NAMES[SCHEDULE_KINDS] = {
+    "SINGLE", "COUPLED", "CONDITIONED", "SEQUENCE"
+};
+
+
+SchedulerStats::SchedulerStats() {
+    reset();
+}
+
+
+void SchedulerStats::reset() {
+    for(int i = 0; i < SCHEDULE_KINDS; i++) {
+        lateness[i].reset();
+        fired[i] = 0;
+        coalesced[i] = 0;
+        missed[i] = 0;
+        deferred[i] = 0;
+        banded[i] = 0;
+        evaluated[i] = 0;
+        unchanged[i] = 0;
+    }
+}
+
+
+string SchedulerStats::view() const {
+    stringstream buf;
+    for(int i = 0; i < SCHEDULE_KINDS; i++) {
+        string name = SCHEDULE_KIND_NAMES[i];
+        buf << "STAT=LATENESS." << name << ":" <<
+            lateness[i].snapshot().view() << "\n";
+        buf << "STAT=FIRED." << name << ":VALUE=" << fired[i] << "\n";
+        buf << "STAT=COALESCED." << name << ":VALUE=" << coalesced[i] << "\n";
+        buf << "STAT=MISSED." << name << ":VALUE=" << missed[i] << "\n";
+        buf << "STAT=DEFERRED." << name << ":VALUE=" << deferred[i] << "\n";
+        buf << "STAT=BANDED." << name << ":VALUE=" << banded[i] << "\n";
+        buf << "STAT=EVALUATED." << name << ":VALUE=" << evaluated[i] << "\n";
+        buf << "STAT=UNCHANGED." << name << ":VALUE=" << unchanged[i] << "\n";
+    }
+    return buf.str();
+}
+
+
 Results* Executor::execute() throw() {
     Results *results = new Results;
+    results->reserve(commands.size());
     for(Commands::iterator it = commands.begin();
         it != commands.end(); it++) {
-        Result *res = (**it).execute();
-        results->push_back(res);
+        if(it->command->cancelled()) {
+            cancelled++;
+            results->push_back(Result(RESULT_CANCELLED,
+                                      "Schedule was dropped"));
+        } else if(it->deadline >= 0 && time(NULL) > it->deadline) {
+            timed_out++;
+            results->push_back(Result(RESULT_TIMEOUT,
+                                      "Deadline exceeded"));
+        } else {
+            if(it->fire >= 0) {
+                long long late = (long long)wallclock_msec() -
+                    (long long)it->fire*1000;
+                scheduler_stats.lateness[it->kind].record(late > 0 ? late : 0);
+                scheduler_stats.fired[it->kind]++;
+            }
+            results->push_back(it->command->execute());
+        }
     }
 
     return results;
 }
 
 
+// Queues what a command leaves to be run once its schedule is let go, a
+// device switched on by several commands is switched off once
+static void queue_releaser(Command *command, schedule_kind_t kind,
+                           Commands &commands) {
+    Command *releaser = command->releaser();
+    if(releaser == NULL) {
+        return;
+    }
+    for(Commands::iterator it = commands.begin(); it != commands.end(); it++) {
+        if(it->command == releaser) {
+            return;
+        }
+    }
+    commands.push_back(queued_command_t(releaser, -1, -1, kind));
+}
+
+
 ListSchedule::~ListSchedule() throw() {
     for(ListSchedule::iterator it = this->begin();
         it != this->end(); it++) {
         delete *it;
     }
+    for(ListSchedule::iterator it = expired.begin();
+        it != expired.end(); it++) {
+        delete *it;
+    }
 }
 
 
 Commands *ListSchedule::get_commands(time_t tm) {
     auto_ptr<Commands> result(new Commands);
 
-    for(ListSchedule::iterator it = this->begin();
-        it != this->end(); it++) {
-        if(!(*it)->is_expired()) {
-            auto_ptr<Commands> src((*it)->get_commands(tm));
-            result->splice(result->end(), *src);
+    while(!expired.empty()) {
+        delete expired.front();
+        expired.pop_front();
+    }
+
+    ListSchedule::iterator it = this->begin();
+    while(it != this->end()) {
+        auto_ptr<Commands> src((*it)->get_commands(tm));
+        result->splice(result->end(), *src);
+        if((*it)->is_expired()) {
+            expired.splice(expired.end(), *this, it++);
+        } else {
+            ++it;
         }
     }
 
@@ -47,27 +153,37 @@ ListSchedule& ListSchedule::operator<<(BaseSchedule *item) {
 
 
 bool ListSchedule::is_expired() {
-    ListSchedule::iterator it = this->begin();
-    int not_expired_counter = 0;
+    return this->empty();
+}
 
-    while(it != this->end()) {
-        if((*it)->is_expired()) {
-            delete *it;
-            this->erase(it++);
-        } else {
-            not_expired_counter++;
-            ++it;
-        }
+
+void ListSchedule::cancel() {
+    for(ListSchedule::iterator it = this->begin();
+        it != this->end(); it++) {
+        (*it)->cancel();
     }
+}
+
 
-    return not_expired_counter < 1;
+void ListSchedule::release(Commands &commands) {
+    for(ListSchedule::iterator it = this->begin();
+        it != this->end(); it++) {
+        (*it)->release(commands);
+    }
+    for(ListSchedule::iterator it = expired.begin();
+        it != expired.end(); it++) {
+        (*it)->release(commands);
+    }
 }
 
 
 NamedSchedule::~NamedSchedule() throw() {
-    for(NamedSchedule::iterator it = this->begin();
-        it != this->end(); it++) {
-        delete it->second;
+    for(size_t id = 0; id < schedules.size(); id++) {
+        delete schedules[id];
+    }
+    for(list<pair<BaseSchedule*, bool> >::iterator it = retired.begin();
+        it != retired.end(); it++) {
+        delete it->first;
     }
 }
 
@@ -75,11 +191,19 @@ NamedSchedule::~NamedSchedule() throw() {
 Commands *NamedSchedule::get_commands(time_t tm) {
     auto_ptr<Commands> result(new Commands);
 
-    for(NamedSchedule::iterator it = this->begin();
-        it != this->end(); it++) {
-        if(!it->second->is_expired()) {
-            auto_ptr<Commands> src(it->second->get_commands(tm));
-            result->splice(result->end(), *src);
+    reclaim(RUNTIME_RECLAIM_BATCH);
+
+    for(size_t id = 0; id < schedules.size(); id++) {
+        BaseSchedule *item = schedules[id];
+        if(item == NULL || expiring[id]) {
+            continue;
+        }
+        auto_ptr<Commands> src(item->get_commands(tm));
+        result->splice(result->end(), *src);
+        if(item->is_expired()) {
+            expiring[id] = true;
+            expiring_count++;
+            expiry.push_back(id);
         }
     }
 
@@ -87,46 +211,139 @@ Commands *NamedSchedule::get_commands(time_t tm) {
 }
 
 
-NamedSchedule& NamedSchedule::set_schedule(string name, BaseSchedule *sched) {
-    NamedSchedule::iterator it = this->find(name);
-    if(it != this->end()) {
-        delete it->second;
+void NamedSchedule::unmark(symbol_t id) {
+    if(expiring[id]) {
+        expiring[id] = false;
+        expiring_count--;
+    }
+}
+
+
+void NamedSchedule::reclaim(size_t limit) {
+    for(size_t i = 0; i < limit && !expiry.empty(); i++) {
+        symbol_t id = expiry.front();
+        expiry.pop_front();
+        // The schedule may have been dropped or replaced since it expired
+        if(!names.valid(id) || !expiring[id]) {
+            continue;
+        }
+        // Only a schedule ended by its stop point switches off what it
+        // switched on, one which ran out leaves the devices as they are
+        string name = names.name(id);
+        remove(id, schedules[id]->stopped());
+        if(reclaim_handler != NULL) {
+            reclaim_handler->reclaimed(name);
+        }
+    }
+}
+
+
+void NamedSchedule::retire(BaseSchedule *sched, bool release) {
+    if(sched == NULL) {
+        return;
+    }
+    if(executing > 0) {
+        // Its commands may still switch something on meanwhile
+        sched->cancel();
+        retired.push_back(make_pair(sched, release));
+        return;
+    }
+    if(release) {
+        sched->release(releasing);
+    }
+    delete sched;
+}
+
+
+NamedSchedule& NamedSchedule::set_schedule(const string &name,
+                                           BaseSchedule *sched) {
+    symbol_t id = names.intern(name);
+    if((size_t)id >= schedules.size()) {
+        schedules.resize(id + 1, NULL);
+        expiring.resize(id + 1, false);
     }
-    (*this)[name] = sched;
+    unmark(id);
+    retire(schedules[id], true);
+    schedules[id] = sched;
     return *this;
 }
 
 
-void NamedSchedule::drop_schedule(string name) {
-    NamedSchedule::iterator it = this->find(name);
-    if(it != this->end()) {
-        delete it->second;
+void NamedSchedule::drop_schedule(const string &name) {
+    drop_schedule(names.lookup(name));
+}
+
+
+void NamedSchedule::drop_schedule(symbol_t id) {
+    remove(id, true);
+}
+
+
+void NamedSchedule::remove(symbol_t id, bool release) {
+    if(!names.valid(id)) {
+        return;
     }
-    (*this).erase(name);
+    unmark(id);
+    retire(schedules[id], release);
+    schedules[id] = NULL;
+    names.release(id);
 }
 
 
-bool NamedSchedule::is_expired() {
-    int not_expired_counter = 0;
+void NamedSchedule::cancel() {
+    for(size_t id = 0; id < schedules.size(); id++) {
+        if(schedules[id] != NULL) {
+            schedules[id]->cancel();
+        }
+    }
+}
 
-    for(NamedSchedule::iterator it = this->begin();
-        it != this->end(); ) {
-        if(it->second->is_expired()) {
-            delete it->second;
-            this->erase(it++);
-        } else {
-            not_expired_counter++;
-            ++it;
+
+void NamedSchedule::begin_execution() {
+    executing++;
+}
+
+
+void NamedSchedule::finish_execution() {
+    if(executing > 0) {
+        executing--;
+    }
+    if(executing > 0) {
+        return;
+    }
+    while(!retired.empty()) {
+        if(retired.front().second) {
+            retired.front().first->release(releasing);
         }
+        delete retired.front().first;
+        retired.pop_front();
     }
+}
+
 
-    return not_expired_counter < 1;
+void NamedSchedule::take_releasing(Commands &commands) {
+    commands.splice(commands.begin(), releasing);
+}
+
+
+BaseSchedule *NamedSchedule::at(const string &name) const {
+    symbol_t id = names.lookup(name);
+    if(id == NO_SYMBOL) {
+        throw out_of_range(name);
+    }
+    return schedules[id];
+}
+
+
+bool NamedSchedule::is_expired() {
+    return names.size() <= expiring_count;
 }
 
 
 SingleCommandSchedule::SingleCommandSchedule(Command *cmd,
                                              time_t start, time_t stop,
-                                             int restart) {
+                                             int restart,
+                                             catchup_policy_t policy) {
     if(restart >= 0 && restart < RUNTIME_WAKE_PAUSE*2) {
         stringstream buf;
         buf << "Restart period must be longer than " <<
@@ -137,24 +354,62 @@ SingleCommandSchedule::SingleCommandSchedule(Command *cmd,
     start_point = start;
     stop_point = stop;
     restart_period = restart;
+    catchup = policy;
     expired = false;
+    stop_reached = false;
 }
 
 
 Commands *SingleCommandSchedule::get_commands(time_t tm) {
     auto_ptr<Commands> result(new Commands);
-    if(tm >= start_point && !expired) {
-        if(stop_point <= 0 || tm < stop_point) {
-            result->push_back(command);
-        } else {
-            expired = true;
+    if(tm < start_point || expired) {
+        return result.release();
+    }
+    if(stop_point > 0 && tm >= stop_point) {
+        expired = true;
+        stop_reached = true;
+        return result.release();
+    }
+    time_t deadline = tm + RUNTIME_COMMAND_DEADLINE;
+    if(restart_period < 0) {
+        result->push_back(
+            queued_command_t(command, deadline, start_point, kind()));
+        expired = true;
+        return result.release();
+    }
+
+    // Restarts that came due since the last tick, a stall makes it more
+    // than one
+    long due = (tm - start_point)/restart_period + 1;
+    if(stop_point > 0) {
+        long limit = (stop_point - 1 - start_point)/restart_period + 1;
+        if(due > limit) {
+            due = limit;
         }
-        if(restart_period >= 0) {
-            start_point += restart_period;
-        } else {
-            expired = true;
+    }
+    switch(catchup) {
+    case CATCHUP_ALL:
+        for(long i = 0; i < due; i++) {
+            result->push_back(
+                queued_command_t(command, deadline,
+                                 start_point + i*restart_period, kind()));
         }
+        break;
+    case CATCHUP_ONCE:
+        result->push_back(
+            queued_command_t(command, deadline,
+                             start_point + (due - 1)*restart_period, kind()));
+        scheduler_stats.coalesced[kind()] += due - 1;
+        break;
+    case CATCHUP_SKIP:
+        // The current period still runs, only the past ones are dropped
+        result->push_back(
+            queued_command_t(command, deadline,
+                             start_point + (due - 1)*restart_period, kind()));
+        scheduler_stats.missed[kind()] += due - 1;
+        break;
     }
+    start_point += due*restart_period;
     return result.release();
 }
 
@@ -164,6 +419,21 @@ bool SingleCommandSchedule::is_expired() {
 }
 
 
+bool SingleCommandSchedule::stopped() {
+    return stop_reached;
+}
+
+
+void SingleCommandSchedule::cancel() {
+    command->cancel();
+}
+
+
+void SingleCommandSchedule::release(Commands &commands) {
+    queue_releaser(command, kind(), commands);
+}
+
+
 CoupledCommandSchedule::~CoupledCommandSchedule() throw() {
     delete coupled_command;
 }
@@ -173,8 +443,13 @@ CoupledCommandSchedule::CoupledCommandSchedule(Command *cmd,
                                                time_t start, time_t stop,
                                                Command *coupled_cmd,
                                                int coupled,
-                                               int restart):
-    SingleCommandSchedule(cmd, start, stop, restart) {
+                                               int restart,
+                                               catchup_policy_t policy):
+    SingleCommandSchedule(cmd, start, stop, restart, policy) {
+    if(policy == CATCHUP_ALL) {
+        throw ScheduleSetupError("Coupled commands cannot catch up with"
+                                 " all missed restarts");
+    }
     if(coupled <= 0) {
         throw ScheduleSetupError("Coupling command interval must"
                                  " be greater than 0");
@@ -193,23 +468,36 @@ CoupledCommandSchedule::CoupledCommandSchedule(Command *cmd,
 
 Commands *CoupledCommandSchedule::get_commands(time_t tm) {
     if(!on_coupling) {
-        time_t start = get_start_point();
         Commands *result = SingleCommandSchedule::get_commands(tm);
         if(result->size() > 0) {
             on_coupling = true;
-            coupled_point = start + coupled_interval;
+            coupled_point = result->back().fire + coupled_interval;
         }
         return result;
     }
     auto_ptr<Commands> result(new Commands);
     if(tm >= coupled_point) {
-        result->push_back(coupled_command);
+        result->push_back(
+            queued_command_t(coupled_command, tm + RUNTIME_COMMAND_DEADLINE,
+                             coupled_point, SCHEDULE_COUPLED));
         on_coupling = false;
     }
     return result.release();
 }
 
 
+void CoupledCommandSchedule::cancel() {
+    SingleCommandSchedule::cancel();
+    coupled_command->cancel();
+}
+
+
+void CoupledCommandSchedule::release(Commands &commands) {
+    SingleCommandSchedule::release(commands);
+    queue_releaser(coupled_command, SCHEDULE_COUPLED, commands);
+}
+
+
 bool CoupledCommandSchedule::is_expired() {
     if(!on_coupling) {
         return SingleCommandSchedule::is_expired();
@@ -221,12 +509,16 @@ bool CoupledCommandSchedule::is_expired() {
 ConditionedSchedule::ConditionedSchedule(Command *cmd,
                                          Command *coupled_cmd,
                                          BaseCondition *cnd,
-                                         time_t start, time_t stop):
+                                         time_t start, time_t stop,
+                                         int dwell):
     command(cmd), coupled_command(coupled_cmd), condition(cnd) {
     start_point = start;
     stop_point = stop;
     to_be_stopped = false;
     expired = false;
+    min_dwell = dwell;
+    switched_at = -1;
+    deferred = false;
 }
 
 
@@ -237,19 +529,46 @@ ConditionedSchedule::~ConditionedSchedule() throw() {
 }
 
 
+bool ConditionedSchedule::dwelt(time_t tm) {
+    if(min_dwell <= 0 || switched_at < 0 || tm - switched_at >= min_dwell) {
+        return true;
+    }
+    scheduler_stats.deferred[SCHEDULE_CONDITIONED]++;
+    deferred = true;
+    return false;
+}
+
+
 Commands *ConditionedSchedule::get_commands(time_t tm) {
     auto_ptr<Commands> result(new Commands);
-    if(condition->indeed()) {
+
+    // Nothing to reconsider unless the inputs moved, a switch waits for
+    // its dwell time or the stop point has come
+    bool stopping = stop_point > 0 && tm >= stop_point && !expired;
+    if(!condition->changed() && !deferred && !stopping) {
+        scheduler_stats.unchanged[SCHEDULE_CONDITIONED]++;
+        return result.release();
+    }
+    scheduler_stats.evaluated[SCHEDULE_CONDITIONED]++;
+    deferred = false;
+
+    if(to_be_stopped ? condition->holds() : condition->indeed()) {
         if(stop_point > 0) {
             expired = tm >= stop_point;
         }
-        if(!to_be_stopped && !expired) {
-            result->push_back(command);
+        if(!to_be_stopped && !expired && dwelt(tm)) {
+            result->push_back(
+                queued_command_t(command, tm + RUNTIME_COMMAND_DEADLINE,
+                                 tm, SCHEDULE_CONDITIONED));
             to_be_stopped = true;
+            switched_at = tm;
         }
-    } else if(to_be_stopped == true) {
-        result->push_back(coupled_command);
+    } else if(to_be_stopped == true && dwelt(tm)) {
+        result->push_back(
+            queued_command_t(coupled_command, tm + RUNTIME_COMMAND_DEADLINE,
+                             tm, SCHEDULE_CONDITIONED));
         to_be_stopped = false;
+        switched_at = tm;
     }
     return result.release();
 }
@@ -258,3 +577,138 @@ Commands *ConditionedSchedule::get_commands(time_t tm) {
 bool ConditionedSchedule::is_expired() {
     return expired && !to_be_stopped;
 }
+
+
+bool ConditionedSchedule::stopped() {
+    return expired;
+}
+
+
+void ConditionedSchedule::cancel() {
+    command->cancel();
+    coupled_command->cancel();
+}
+
+
+void ConditionedSchedule::release(Commands &commands) {
+    queue_releaser(command, SCHEDULE_CONDITIONED, commands);
+    queue_releaser(coupled_command, SCHEDULE_CONDITIONED, commands);
+}
+
+
+SequenceSchedule::SequenceSchedule(time_t start, time_t stop):
+    current(0), start_point(start), stop_point(stop), reached(start),
+    expired(false), stop_reached(false), waiting(false) {}
+
+
+SequenceSchedule::~SequenceSchedule() throw() {
+    for(size_t i = 0; i < steps.size(); i++) {
+        delete steps[i].command;
+        delete steps[i].condition;
+    }
+}
+
+
+void SequenceSchedule::add(step_op_t op, Command *cmd, int delay,
+                           BaseCondition *cnd) {
+    sequence_step_t step;
+    step.op = op;
+    step.command = cmd;
+    step.delay = delay;
+    step.condition = cnd;
+    steps.push_back(step);
+}
+
+
+SequenceSchedule& SequenceSchedule::run(Command *cmd) {
+    add(STEP_RUN, cmd, 0, NULL);
+    return *this;
+}
+
+
+SequenceSchedule& SequenceSchedule::wait(int seconds) {
+    if(seconds <= 0) {
+        throw ScheduleSetupError("Sequence delay must be greater than 0");
+    }
+    add(STEP_WAIT, NULL, seconds, NULL);
+    return *this;
+}
+
+
+SequenceSchedule& SequenceSchedule::until(BaseCondition *cnd) {
+    add(STEP_UNTIL, NULL, 0, cnd);
+    return *this;
+}
+
+
+Commands *SequenceSchedule::get_commands(time_t tm) {
+    auto_ptr<Commands> result(new Commands);
+    if(expired || tm < start_point) {
+        return result.release();
+    }
+    if(stop_point > 0 && tm >= stop_point) {
+        expired = true;
+        stop_reached = true;
+        return result.release();
+    }
+
+    while(current < steps.size()) {
+        sequence_step_t &step = steps[current];
+        if(step.op == STEP_RUN) {
+            result->push_back(
+                queued_command_t(step.command, tm + RUNTIME_COMMAND_DEADLINE,
+                                 reached, SCHEDULE_SEQUENCE));
+            // After a stall the following delays count from now rather
+            // than run back to back
+            if(tm - reached > RUNTIME_WAKE_PAUSE) {
+                reached = tm;
+            }
+        } else if(step.op == STEP_WAIT) {
+            if(tm < reached + step.delay) {
+                break;
+            }
+            reached += step.delay;
+        } else {
+            // Checked as the step is reached, then only when the inputs
+            // have moved
+            if((waiting && !step.condition->changed()) ||
+               !step.condition->indeed()) {
+                waiting = true;
+                break;
+            }
+            waiting = false;
+            reached = tm;
+        }
+        current++;
+    }
+    expired = current >= steps.size();
+    return result.release();
+}
+
+
+bool SequenceSchedule::is_expired() {
+    return expired;
+}
+
+
+bool SequenceSchedule::stopped() {
+    return stop_reached;
+}
+
+
+void SequenceSchedule::cancel() {
+    for(size_t i = 0; i < steps.size(); i++) {
+        if(steps[i].command != NULL) {
+            steps[i].command->cancel();
+        }
+    }
+}
+
+
+void SequenceSchedule::release(Commands &commands) {
+    for(size_t i = 0; i < steps.size(); i++) {
+        if(steps[i].command != NULL) {
+            queue_releaser(steps[i].command, SCHEDULE_SEQUENCE, commands);
+        }
+    }
+}
@@ -4,107 +4,193 @@
 
 #include <map>
 #include <list>
+#include <deque>
+#include <vector>
 #include <string>
 #include <sstream>
 #include <typeinfo>
 #include <ctime>
+#include <atomic>
 #include <pthread.h>
 
+#include "symbols.hpp"
+#include "metrics.hpp"
+
 
 const int RUNTIME_WAKE_PAUSE = 5; //
+const int RUNTIME_COMMAND_DEADLINE = RUNTIME_WAKE_PAUSE; // Since a tick
+const int RUNTIME_RECLAIM_BATCH = 64; // Expired schedules deleted per tick
 
 
 typedef enum {
     RESULT_SERIAL_ERROR,
-    RESULT_SERIAL_WRONGLINE
+    RESULT_SERIAL_WRONGLINE,
+    RESULT_TIMEOUT,
+    RESULT_CANCELLED
 } error_result_t;
 
 
+// Outcome of a command: an integer, a float, a string or an error code with
+// a message. Passed by value, formatted only when it is serialized.
 class Result {
 public:
-    virtual ~Result() throw() {};
-    virtual std::string value() throw() = 0;
-};
-
+    typedef enum {
+        RESULT_INTEGER,
+        RESULT_FLOAT,
+        RESULT_STRING,
+        RESULT_ERROR
+    } kind_t;
 
-class ErrorResult: public Result {
 private:
-    std::string message;
-    error_result_t error_code;
+    kind_t _kind;
+    union {
+        int integer;
+        double floating;
+        error_result_t error_code;
+    } data;
+    std::string text;
 
 public:
-    ErrorResult(error_result_t err_code,
-                std::string msg):
-        message(msg), error_code(err_code) {};
-    virtual ~ErrorResult() throw() {};
+    Result(int value): _kind(RESULT_INTEGER) {
+        data.integer = value;
+    };
+    Result(double value): _kind(RESULT_FLOAT) {
+        data.floating = value;
+    };
+    Result(const std::string &value): _kind(RESULT_STRING), text(value) {
+        data.integer = 0;
+    };
+    Result(error_result_t err_code, const std::string &msg):
+        _kind(RESULT_ERROR), text(msg) {
+        data.error_code = err_code;
+    };
 
-    std::string value() throw() {
-        return message;
+    kind_t kind() const throw() {
+        return _kind;
+    };
+    bool is_error() const throw() {
+        return _kind == RESULT_ERROR;
     };
-    error_result_t code() throw() {
-        return error_code;
+    error_result_t code() const throw() {
+        return data.error_code;
+    };
+    double number() const throw() {
+        switch(_kind) {
+        case RESULT_INTEGER:
+            return data.integer;
+        case RESULT_FLOAT:
+            return data.floating;
+        default:
+            return 0;
+        }
     };
+
+    std::string value() const;
 };
 
 
-class StringResult: public Result, public std::string {
+class Command {
+private:
+    std::atomic<bool> is_cancelled;
+
 public:
-    StringResult(const std::string &msg): std::string(msg) {};
-    virtual ~StringResult() throw() {};
+    Command(): is_cancelled(false) {};
+    virtual ~Command() throw() {};
+    virtual Result execute() throw() = 0;
 
-    std::string value() throw() {
-        return *this;
+    // Commands of a dropped schedule that have not started yet are skipped
+    void cancel() throw() {
+        is_cancelled = true;
+    };
+    bool cancelled() const throw() {
+        return is_cancelled;
+    };
+
+    // Command to run once the schedule owning this one is dropped,
+    // replaced or stopped, e.g. the off for an on that went through.
+    // NULL for none.
+    virtual Command *releaser() throw() {
+        return NULL;
     };
 };
 
 
-template <class T> class ParametrizedResult: public Result {
-private:
-    T _value;
+class Results: public std::vector<Result> {};
 
-public:
-    ParametrizedResult(T res_value): _value(res_value) {};
-    virtual ~ParametrizedResult() throw() {};
+typedef enum {
+    SCHEDULE_SINGLE,
+    SCHEDULE_COUPLED,
+    SCHEDULE_CONDITIONED,
+    SCHEDULE_SEQUENCE,
+    SCHEDULE_KINDS
+} schedule_kind_t;
 
-    std::string value() throw() {
-        std::stringstream buf;
-        buf << _value;
-        return buf.str();
-    };
-};
+extern const char *SCHEDULE_KIND_NAMES[SCHEDULE_KINDS];
 
 
-typedef ParametrizedResult<int> IntResult;
-typedef ParametrizedResult<double> FloatResult;
+// What to do with restarts missed while the runtime was stalled
+typedef enum {
+    CATCHUP_SKIP, // Run the current restart, drop the missed ones
+    CATCHUP_ONCE, // Run once for all of them
+    CATCHUP_ALL   // Run each of them
+} catchup_policy_t;
 
 
-class Command {
-public:
-    virtual ~Command() throw() {};
-    virtual Result *execute() throw() = 0;
+struct queued_command_t {
+    Command *command;
+    time_t deadline; // Skip the command when it is dequeued later, -1 is none
+    time_t fire;     // Intended fire time, -1 is none
+    schedule_kind_t kind;
+
+    queued_command_t(Command *cmd, time_t dl = -1, time_t fr = -1,
+                     schedule_kind_t knd = SCHEDULE_SINGLE):
+        command(cmd), deadline(dl), fire(fr), kind(knd) {};
 };
 
 
-class Results: public std::list<Result*> {
+// Drift of the runtime per schedule type: lateness of fired commands in
+// milliseconds after their intended fire time, restarts coalesced into one
+// run or missed entirely after a stall.
+class SchedulerStats {
 public:
-    ~Results() throw() {
-        for(Results::iterator it = this->begin(); it != this->end(); it++) {
-            delete *it;
-        }
-    }
+    Histogram lateness[SCHEDULE_KINDS];
+    std::atomic<unsigned long> fired[SCHEDULE_KINDS];
+    std::atomic<unsigned long> coalesced[SCHEDULE_KINDS];
+    std::atomic<unsigned long> missed[SCHEDULE_KINDS];
+    // Switches held back by a minimum dwell time
+    std::atomic<unsigned long> deferred[SCHEDULE_KINDS];
+    // Switches absorbed by a deadband between on and off thresholds
+    std::atomic<unsigned long> banded[SCHEDULE_KINDS];
+    // Condition evaluations done and skipped for unchanged inputs
+    std::atomic<unsigned long> evaluated[SCHEDULE_KINDS];
+    std::atomic<unsigned long> unchanged[SCHEDULE_KINDS];
+
+    SchedulerStats();
+    void reset();
+    std::string view() const;
 };
 
-typedef std::list<Command*> Commands;
+extern SchedulerStats scheduler_stats;
+
+typedef std::list<queued_command_t> Commands;
 
 
 class Executor {
 private:
     Commands &commands;
+    int timed_out, cancelled;
 
 public:
     virtual ~Executor() throw() {};
     Results *execute() throw();
-    Executor(Commands *cmds): commands(*cmds) {};
+    Executor(Commands *cmds): commands(*cmds), timed_out(0), cancelled(0) {};
+
+    int get_timed_out() {
+        return timed_out;
+    };
+    int get_cancelled() {
+        return cancelled;
+    };
 };
 
 
@@ -130,27 +216,100 @@ public:
     virtual ~BaseSchedule() throw() {};
     virtual Commands *get_commands(time_t tm) = 0;
     virtual bool is_expired() = 0;
+    virtual void cancel() {};
+    // Queues the releasers of its commands
+    virtual void release(Commands &commands) {};
+    // Expired at its stop point rather than by running out
+    virtual bool stopped() {
+        return false;
+    }
 };
 
 
 
 class ListSchedule: public BaseSchedule, protected std::list<BaseSchedule*> {
+private:
+    // Children expired on the last tick, their commands may still be queued
+    std::list<BaseSchedule*> expired;
+
 public:
     virtual ~ListSchedule() throw();
     Commands *get_commands(time_t tm);
     ListSchedule& operator<<(BaseSchedule *item);
     bool is_expired();
+    void cancel();
+    void release(Commands &commands);
 };
 
 
-class NamedSchedule: public BaseSchedule,
-                     public std::map<std::string, BaseSchedule*> {
+// Told about schedules which NamedSchedule lets go after they have expired
+// by themselves, called under the schedule lock
+class ReclaimHandler {
 public:
+    virtual ~ReclaimHandler() throw() {};
+    virtual void reclaimed(const std::string &name) = 0;
+};
+
+
+class NamedSchedule: public BaseSchedule {
+private:
+    SymbolTable names;
+    std::vector<BaseSchedule*> schedules;
+    int executing;
+    // Dropped while executing, along with whether to release them
+    std::list<std::pair<BaseSchedule*, bool> > retired;
+    Commands releasing;
+
+    // Schedules are queued here the tick they expire and reclaimed in
+    // batches on the following ticks
+    std::deque<symbol_t> expiry;
+    std::vector<bool> expiring;
+    size_t expiring_count;
+    ReclaimHandler *reclaim_handler;
+
+    void retire(BaseSchedule *sched, bool release);
+    void remove(symbol_t id, bool release);
+    void unmark(symbol_t id);
+    void reclaim(size_t limit);
+
+public:
+    NamedSchedule(): executing(0), expiring_count(0), reclaim_handler(NULL) {};
     virtual ~NamedSchedule() throw();
     Commands *get_commands(time_t tm);
-    NamedSchedule& set_schedule(std::string name, BaseSchedule *sched);
-    void drop_schedule(std::string name);
+    NamedSchedule& set_schedule(const std::string &name, BaseSchedule *sched);
+    void drop_schedule(const std::string &name);
+    void drop_schedule(symbol_t id);
     bool is_expired();
+    void cancel();
+
+    // Commands got from the schedule are being executed outside of the
+    // schedule lock: schedules dropped meanwhile are cancelled, released
+    // and deleted only when the execution is finished.
+    void begin_execution();
+    void finish_execution();
+
+    // Releasers of the schedules dropped, replaced or stopped since the
+    // last call. They switch hardware, so they are run outside of the
+    // schedule lock. Schedules which ran out by themselves leave none.
+    // Queued ahead of the given commands, which may switch the same
+    // devices on again.
+    void take_releasing(Commands &commands);
+
+    // NULL for none
+    void on_reclaim(ReclaimHandler *handler) {
+        reclaim_handler = handler;
+    }
+
+    symbol_t lookup(const std::string &name) const {
+        return names.lookup(name);
+    }
+    bool has(const std::string &name) const {
+        return names.lookup(name) != NO_SYMBOL;
+    }
+    BaseSchedule *at(const std::string &name) const;
+    size_t size() const {
+        return names.size();
+    }
 };
 
 
@@ -160,7 +319,14 @@ private:
     time_t start_point;
     time_t stop_point;
     int restart_period;
+    catchup_policy_t catchup;
     bool expired;
+    bool stop_reached;
+
+protected:
+    virtual schedule_kind_t kind() const {
+        return SCHEDULE_SINGLE;
+    };
 
 public:
     ~SingleCommandSchedule() throw() {
@@ -168,13 +334,17 @@ public:
     }
 
     SingleCommandSchedule(Command *cmd, time_t start_point, time_t stop_point,
-                          int restart_period = -1);
+                          int restart_period = -1,
+                          catchup_policy_t catchup = CATCHUP_ONCE);
 
     Commands *get_commands(time_t tm);
     time_t get_start_point() {
         return start_point;
     };
     bool is_expired();
+    bool stopped();
+    void cancel();
+    void release(Commands &commands);
 };
 
 
@@ -185,6 +355,11 @@ private:
     int coupled_interval;
     bool on_coupling;
 
+protected:
+    schedule_kind_t kind() const {
+        return SCHEDULE_COUPLED;
+    };
+
 public:
     ~CoupledCommandSchedule() throw ();
 
@@ -192,10 +367,13 @@ public:
                            time_t start_point, time_t stop_point,
                            Command *coupled_command,
                            int coupled_interval,
-                           int restart_period = -1);
+                           int restart_period = -1,
+                           catchup_policy_t catchup = CATCHUP_ONCE);
 
     Commands *get_commands(time_t tm);
     bool is_expired();
+    void cancel();
+    void release(Commands &commands);
 };
 
 
@@ -203,6 +381,18 @@ class BaseCondition {
 public:
     virtual ~BaseCondition() throw() {};
     virtual bool indeed() = 0;
+
+    // Checked instead of indeed() while the condition is engaged, conditions
+    // with a deadband release at a threshold different from the engaging one
+    virtual bool holds() {
+        return indeed();
+    }
+
+    // Whether the inputs may have changed since the last call, conditions
+    // which can not tell are evaluated on every tick
+    virtual bool changed() {
+        return true;
+    }
 };
 
 
@@ -213,6 +403,11 @@ private:
     time_t start_point, stop_point;
     bool to_be_stopped;
     bool expired;
+    int min_dwell;
+    time_t switched_at;
+    bool deferred;
+
+    bool dwelt(time_t tm);
 
 public:
     ~ConditionedSchedule() throw();
@@ -220,9 +415,60 @@ public:
     ConditionedSchedule(Command *cmd,
                         Command *coupled_cmd,
                         BaseCondition *cnd,
-                        time_t start_point = -1, time_t stop_point = -1);
+                        time_t start_point = -1, time_t stop_point = -1,
+                        int min_dwell = 0);
+    Commands *get_commands(time_t tm);
+    bool is_expired();
+    bool stopped();
+    void cancel();
+    void release(Commands &commands);
+};
+
+
+typedef enum {
+    STEP_RUN,   // Queue a command
+    STEP_WAIT,  // Suspend for a number of seconds
+    STEP_UNTIL  // Suspend until a condition comes true
+} step_op_t;
+
+
+struct sequence_step_t {
+    step_op_t op;
+    Command *command;
+    int delay;
+    BaseCondition *condition;
+};
+
+
+// Runs a program of steps locally, e.g. switch on, wait 10 minutes, wait
+// for a temperature, switch off. A suspended sequence is just the index of
+// its current step and the time that step was reached, it is resumed by
+// the regular ticks.
+class SequenceSchedule: public BaseSchedule {
+private:
+    std::vector<sequence_step_t> steps;
+    size_t current;
+    time_t start_point, stop_point;
+    time_t reached;
+    bool expired;
+    bool stop_reached;
+    bool waiting; // The current step's condition was false when last checked
+
+    void add(step_op_t op, Command *cmd, int delay, BaseCondition *cnd);
+
+public:
+    ~SequenceSchedule() throw();
+    SequenceSchedule(time_t start_point, time_t stop_point = -1);
+
+    SequenceSchedule& run(Command *cmd);
+    SequenceSchedule& wait(int seconds);
+    SequenceSchedule& until(BaseCondition *cnd);
+
     Commands *get_commands(time_t tm);
     bool is_expired();
+    bool stopped();
+    void cancel();
+    void release(Commands &commands);
 };
 
 
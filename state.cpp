@@ -0,0 +1,78 @@
+#include <cmath>
+#include <sstream>
+
+#include "state.hpp"
+
+
+using namespace std;
+
+
+const char *STATE_ASPECT_NAMES[] = {"relay", "temperature"};
+
+
+DeviceState device_state;
+
+
+DeviceState::DeviceState(): current(0), started(time(NULL)) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+
+DeviceState::~DeviceState() throw() {
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void DeviceState::stamp(entry_t &entry, const string &value, double number) {
+    entry.value = value;
+    entry.number = number;
+    entry.version = ++current;
+}
+
+
+void DeviceState::relay(BaseDescrDevice *device, bool on) {
+    const string value = on ? "ON" : "OFF";
+    pthread_mutex_lock(&mutex);
+    map<key_t, entry_t>::iterator it = entries.find(
+        key_t(device, STATE_RELAY));
+    if(it == entries.end()) {
+        stamp(entries[key_t(device, STATE_RELAY)], value, on);
+    } else if(it->second.value != value) {
+        stamp(it->second, value, on);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void DeviceState::temperature(BaseDescrDevice *device, double value) {
+    pthread_mutex_lock(&mutex);
+    map<key_t, entry_t>::iterator it = entries.find(
+        key_t(device, STATE_TEMPERATURE));
+    // Sensor noise is not worth a sync
+    if(it == entries.end() ||
+       fabs(it->second.number - value) > STATE_EPSILON) {
+        stringstream buf;
+        buf << value;
+        stamp(entries[key_t(device, STATE_TEMPERATURE)], buf.str(), value);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+unsigned long DeviceState::since(unsigned long version,
+                                 state_changes_t &changes) {
+    pthread_mutex_lock(&mutex);
+    for(map<key_t, entry_t>::iterator it = entries.begin();
+        it != entries.end(); it++) {
+        if(it->second.version > version) {
+            state_change_t change;
+            change.device = it->first.first;
+            change.aspect = it->first.second;
+            change.value = it->second.value;
+            changes.push_back(change);
+        }
+    }
+    unsigned long res = current;
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
@@ -0,0 +1,71 @@
+#ifndef _STATE_HPP_INCLUDED_
+#define _STATE_HPP_INCLUDED_
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "confbind.hpp"
+
+
+enum state_aspect_t {
+    STATE_RELAY,
+    STATE_TEMPERATURE,
+    STATE_ASPECTS
+};
+
+extern const char *STATE_ASPECT_NAMES[];
+
+const double STATE_EPSILON = 0.1; // Degrees a reading has to move
+
+
+struct state_change_t {
+    BaseDescrDevice *device;
+    state_aspect_t aspect;
+    std::string value;
+};
+
+typedef std::vector<state_change_t> state_changes_t;
+
+
+// Last known relay positions and sensor readings, every change is stamped
+// with a version increasing by one. Versions restart along with the
+// process, the epoch tells clients holding an older one to take it all.
+class DeviceState {
+private:
+    typedef std::pair<BaseDescrDevice*, state_aspect_t> key_t;
+
+    struct entry_t {
+        std::string value;
+        double number;
+        unsigned long version;
+    };
+
+    std::map<key_t, entry_t> entries;
+    unsigned long current;
+    time_t started;
+    pthread_mutex_t mutex;
+
+    void stamp(entry_t &entry, const std::string &value, double number);
+
+public:
+    DeviceState();
+    ~DeviceState() throw();
+
+    void relay(BaseDescrDevice *device, bool on);
+    void temperature(BaseDescrDevice *device, double value);
+
+    // Entries changed after the given version, returns the current one
+    unsigned long since(unsigned long version, state_changes_t &changes);
+
+    time_t epoch() const {
+        return started;
+    }
+};
+
+extern DeviceState device_state;
+
+#endif
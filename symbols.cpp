@@ -0,0 +1,125 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "symbols.hpp"
+
+
+using namespace std;
+
+const symbol_t SLOT_EMPTY = -1;
+const symbol_t SLOT_DELETED = -2;
+const size_t INITIAL_SLOTS = 16;
+
+
+SymbolTable::SymbolTable(): slots(INITIAL_SLOTS, SLOT_EMPTY), used(0), count(0) {}
+
+
+size_t SymbolTable::hash(const char *name, size_t size) {
+    // FNV-1a
+    size_t res = 2166136261u;
+    for(size_t i = 0; i < size; i++) {
+        res ^= (unsigned char)name[i];
+        res *= 16777619u;
+    }
+    return res;
+}
+
+
+size_t SymbolTable::probe(const char *name, size_t size,
+                          size_t hashed) const {
+    size_t mask = slots.size() - 1;
+    size_t pos = hashed & mask;
+    while(true) {
+        symbol_t id = slots[pos];
+        if(id == SLOT_EMPTY) {
+            return pos;
+        }
+        if(id >= 0 && hashes[id] == hashed && names[id].size() == size &&
+           memcmp(names[id].data(), name, size) == 0) {
+            return pos;
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+
+
+void SymbolTable::rehash(size_t capacity) {
+    slots.assign(capacity, SLOT_EMPTY);
+    used = 0;
+    size_t mask = capacity - 1;
+    for(size_t id = 0; id < names.size(); id++) {
+        if(!alive[id]) {
+            continue;
+        }
+        size_t pos = hashes[id] & mask;
+        while(slots[pos] != SLOT_EMPTY) {
+            pos = (pos + 1) & mask;
+        }
+        slots[pos] = id;
+        used++;
+    }
+}
+
+
+symbol_t SymbolTable::intern(const string &name) {
+    size_t hashed = hash(name.data(), name.size());
+    size_t pos = probe(name.data(), name.size(), hashed);
+    if(slots[pos] >= 0) {
+        return slots[pos];
+    }
+
+    if((used + 1)*4 > slots.size()*3) {
+        size_t capacity = slots.size();
+        while((count + 1)*2 > capacity) {
+            capacity *= 2;
+        }
+        rehash(capacity);
+        pos = probe(name.data(), name.size(), hashed);
+    }
+
+    symbol_t id;
+    if(!vacant.empty()) {
+        id = vacant.back();
+        vacant.pop_back();
+        names[id] = name;
+        hashes[id] = hashed;
+        alive[id] = true;
+    } else {
+        id = names.size();
+        names.push_back(name);
+        hashes.push_back(hashed);
+        alive.push_back(true);
+    }
+    slots[pos] = id;
+    used++;
+    count++;
+    return id;
+}
+
+
+symbol_t SymbolTable::lookup(const char *name, size_t size) const {
+    size_t pos = probe(name, size, hash(name, size));
+    symbol_t id = slots[pos];
+    return id >= 0 ? id : NO_SYMBOL;
+}
+
+
+const string &SymbolTable::name(symbol_t id) const {
+    if(!valid(id)) {
+        throw out_of_range("No such symbol");
+    }
+    return names[id];
+}
+
+
+void SymbolTable::release(symbol_t id) {
+    if(!valid(id)) {
+        return;
+    }
+    size_t pos = probe(names[id].data(), names[id].size(), hashes[id]);
+    slots[pos] = SLOT_DELETED;
+    alive[id] = false;
+    names[id].clear();
+    vacant.push_back(id);
+    count--;
+}
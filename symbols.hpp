@@ -0,0 +1,58 @@
+#ifndef _SYMBOLS_HPP_INCLUDED_
+#define _SYMBOLS_HPP_INCLUDED_
+
+#include <string>
+#include <vector>
+
+
+typedef int symbol_t;
+typedef std::vector<symbol_t> symbols_t;
+
+const symbol_t NO_SYMBOL = -1;
+
+
+// Interns names into dense integer identifiers. Identifiers are indices into
+// flat arrays kept by the owners of the table, names are looked up through
+// an open-addressed hash table with linear probing. Released identifiers are
+// reused by subsequent interning.
+class SymbolTable {
+private:
+    std::vector<std::string> names;
+    std::vector<size_t> hashes;
+    std::vector<bool> alive;
+    std::vector<symbol_t> slots;
+    symbols_t vacant;
+    size_t used;
+    size_t count;
+
+    static size_t hash(const char *name, size_t size);
+    size_t probe(const char *name, size_t size, size_t hashed) const;
+    void rehash(size_t capacity);
+
+public:
+    SymbolTable();
+
+    symbol_t intern(const std::string &name);
+    symbol_t lookup(const std::string &name) const {
+        return lookup(name.data(), name.size());
+    }
+    // Looks up a name embedded in a longer text without copying it out
+    symbol_t lookup(const char *name, size_t size) const;
+    const std::string &name(symbol_t id) const;
+    void release(symbol_t id);
+
+    bool valid(symbol_t id) const {
+        return id >= 0 && (size_t)id < names.size() && alive[id];
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // Upper bound of identifiers ever handed out
+    size_t bound() const {
+        return names.size();
+    }
+};
+
+#endif
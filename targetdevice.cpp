@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <memory.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -109,6 +110,13 @@ string SerialCommunicator::talk(string request) {
     if(count < (int)len) {
         throw TargetDeviceInternalError(request);
     }
+    // A dead board must not block the caller forever
+    struct pollfd pfd;
+    pfd.fd = this->fd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, SERIAL_RESPONSE_TIMEOUT) <= 0) {
+        throw TargetDeviceInternalError(request);
+    }
     char response_buf[256];
     count = read(this->fd, response_buf, 255);
     if(count < 3 || count > 255) {
@@ -0,0 +1,284 @@
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+
+#include "telemetry.hpp"
+#include "locker.hpp"
+
+
+using namespace std;
+
+
+Telemetry telemetry;
+
+
+SeriesEncoder::SeriesEncoder():
+    free(0), count(0), last_time(0), last_delta(0), last_value(0),
+    leading(-1), trailing(0) {}
+
+
+void SeriesEncoder::put(uint64_t bits, int length) {
+    while(length > 0) {
+        if(free == 0) {
+            bytes.push_back(0);
+            free = 8;
+        }
+        int chunk = min(free, length);
+        uint64_t part = (bits >> (length - chunk)) & ((1u << chunk) - 1);
+        bytes.back() |= part << (free - chunk);
+        free -= chunk;
+        length -= chunk;
+    }
+}
+
+
+void SeriesEncoder::append(time_t time, double value) {
+    uint64_t raw;
+    memcpy(&raw, &value, sizeof(raw));
+
+    if(count++ == 0) {
+        put(time, 32);
+        put(raw, 64);
+        last_time = time;
+        last_value = raw;
+        return;
+    }
+
+    long delta = time - last_time;
+    long dod = delta - last_delta;
+    if(dod == 0) {
+        put(0, 1);
+    } else if(dod >= -63 && dod <= 64) {
+        put(2, 2);
+        put(dod + 63, 7);
+    } else if(dod >= -255 && dod <= 256) {
+        put(6, 3);
+        put(dod + 255, 9);
+    } else if(dod >= -2047 && dod <= 2048) {
+        put(14, 4);
+        put(dod + 2047, 12);
+    } else {
+        put(15, 4);
+        put((uint32_t)dod, 32);
+    }
+    last_time = time;
+    last_delta = delta;
+
+    uint64_t diff = raw ^ last_value;
+    last_value = raw;
+    if(diff == 0) {
+        put(0, 1);
+        return;
+    }
+    put(1, 1);
+    int lead = min(__builtin_clzll(diff), 31);
+    int trail = __builtin_ctzll(diff);
+    if(leading >= 0 && lead >= leading && trail >= trailing) {
+        // Fits the window of the previous value
+        put(0, 1);
+        put(diff >> trailing, 64 - leading - trailing);
+        return;
+    }
+    leading = lead;
+    trailing = trail;
+    int meaningful = 64 - lead - trail;
+    put(1, 1);
+    put(lead, 5);
+    put(meaningful & 63, 6); // 64 wraps to 0
+    put(diff >> trail, meaningful);
+}
+
+
+SeriesDecoder::SeriesDecoder(const vector<unsigned char> &data):
+    bytes(data), position(0), count(0), last_time(0), last_delta(0),
+    last_value(0), leading(0), trailing(0) {}
+
+
+uint64_t SeriesDecoder::get(int length) {
+    uint64_t res = 0;
+    for(; length > 0; length--, position++) {
+        int bit = (bytes.at(position/8) >> (7 - position%8)) & 1;
+        res = (res << 1) | bit;
+    }
+    return res;
+}
+
+
+void SeriesDecoder::next(time_t &time, double &value) {
+    if(count++ == 0) {
+        last_time = get(32);
+        last_value = get(64);
+    } else {
+        long dod;
+        if(get(1) == 0) {
+            dod = 0;
+        } else if(get(1) == 0) {
+            dod = (long)get(7) - 63;
+        } else if(get(1) == 0) {
+            dod = (long)get(9) - 255;
+        } else if(get(1) == 0) {
+            dod = (long)get(12) - 2047;
+        } else {
+            dod = (int32_t)get(32);
+        }
+        last_delta += dod;
+        last_time += last_delta;
+
+        if(get(1)) {
+            if(get(1)) {
+                leading = get(5);
+                int meaningful = get(6);
+                if(meaningful == 0) {
+                    meaningful = 64;
+                }
+                trailing = 64 - leading - meaningful;
+            }
+            last_value ^= get(64 - leading - trailing) << trailing;
+        }
+    }
+    time = last_time;
+    memcpy(&value, &last_value, sizeof(value));
+}
+
+
+string base64(const vector<unsigned char> &data) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string res;
+    res.reserve((data.size() + 2)/3*4);
+    for(size_t i = 0; i < data.size(); i += 3) {
+        unsigned long chunk = data[i] << 16;
+        if(i + 1 < data.size()) {
+            chunk |= data[i + 1] << 8;
+        }
+        if(i + 2 < data.size()) {
+            chunk |= data[i + 2];
+        }
+        res += alphabet[(chunk >> 18) & 63];
+        res += alphabet[(chunk >> 12) & 63];
+        res += i + 1 < data.size() ? alphabet[(chunk >> 6) & 63] : '=';
+        res += i + 2 < data.size() ? alphabet[chunk & 63] : '=';
+    }
+    return res;
+}
+
+
+Telemetry::Telemetry(int _interval, size_t _capacity):
+    next_seq(1), acked(0), dropped(0), last_round(0), interval(_interval),
+    capacity(_capacity) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+
+Telemetry::~Telemetry() throw() {
+    pthread_mutex_destroy(&mutex);
+}
+
+
+size_t Telemetry::track(const string &name, DeviceTemperature *device) {
+    pthread_mutex_lock(&mutex);
+    series_t added;
+    added.name = name;
+    added.device = device;
+    series.push_back(added);
+    size_t res = series.size() - 1;
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
+
+
+void Telemetry::sample(time_t now) {
+    if(now - last_round < interval) {
+        return;
+    }
+    last_round = now;
+
+    // Sensors are never untracked, so the hardware is read without the lock
+    pthread_mutex_lock(&mutex);
+    vector<DeviceTemperature*> devices;
+    for(size_t id = 0; id < series.size(); id++) {
+        devices.push_back(series[id].device);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    PriorityScope scope(PRIORITY_BACKGROUND);
+    for(size_t id = 0; id < devices.size(); id++) {
+        try {
+            double value;
+            {
+                PriorityLocker<DeviceTemperature, TargetDeviceDriver> cover(
+                    devices[id]);
+                value = cover->get_temperature();
+            }
+            record(id, now, value);
+        } catch(...) {
+            ; // A failed reading is left as a gap
+        }
+    }
+}
+
+
+void Telemetry::record(size_t id, time_t time, double value) {
+    pthread_mutex_lock(&mutex);
+    deque<sample_t> &samples = series.at(id).samples;
+    sample_t added;
+    added.seq = next_seq++;
+    added.time = time;
+    added.value = value;
+    samples.push_back(added);
+    if(samples.size() > capacity) {
+        samples.pop_front();
+        dropped++;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void Telemetry::acknowledge(unsigned long seq) {
+    pthread_mutex_lock(&mutex);
+    for(size_t id = 0; id < series.size(); id++) {
+        deque<sample_t> &samples = series[id].samples;
+        while(!samples.empty() && samples.front().seq <= seq) {
+            samples.pop_front();
+        }
+    }
+    acked = max(acked, seq);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+string Telemetry::batch(size_t limit) {
+    stringstream body;
+    pthread_mutex_lock(&mutex);
+    // Counted from the oldest sample kept, samples dropped on an overflow
+    // would otherwise make for batches with nothing in them
+    unsigned long oldest = next_seq;
+    for(size_t id = 0; id < series.size(); id++) {
+        if(!series[id].samples.empty()) {
+            oldest = min(oldest, series[id].samples.front().seq);
+        }
+    }
+    unsigned long upper = min(max(acked, oldest - 1) + limit, next_seq - 1);
+    size_t pending = 0;
+    for(size_t id = 0; id < series.size(); id++) {
+        deque<sample_t> &samples = series[id].samples;
+        SeriesEncoder encoder;
+        for(size_t i = 0; i < samples.size(); i++) {
+            if(samples[i].seq > upper) {
+                pending += samples.size() - i;
+                break;
+            }
+            encoder.append(samples[i].time, samples[i].value);
+        }
+        if(encoder.size() > 0) {
+            body << series[id].name << ":COUNT=" << encoder.size()
+                 << ":DATA=" << base64(encoder.data()) << "\n";
+        }
+    }
+    stringstream buf;
+    buf << "SEQ=" << upper << ":PENDING=" << pending << ":DROPPED="
+        << dropped << "\n";
+    pthread_mutex_unlock(&mutex);
+    return buf.str() + body.str();
+}
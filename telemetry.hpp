@@ -0,0 +1,110 @@
+#ifndef _TELEMETRY_HPP_INCLUDED_
+#define _TELEMETRY_HPP_INCLUDED_
+
+#include <ctime>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "confbind.hpp"
+#include "constants.hpp"
+
+
+// Packs a time series the way Gorilla does: timestamps as deltas of
+// deltas, values XOR'ed with the previous one leaving out the leading and
+// trailing zero bits. Steady minute readings take a couple of bits each.
+class SeriesEncoder {
+private:
+    std::vector<unsigned char> bytes;
+    int free;
+    size_t count;
+    time_t last_time;
+    long last_delta;
+    uint64_t last_value;
+    int leading, trailing;
+
+    void put(uint64_t bits, int length);
+
+public:
+    SeriesEncoder();
+
+    void append(time_t time, double value);
+
+    size_t size() const {
+        return count;
+    }
+    const std::vector<unsigned char> &data() const {
+        return bytes;
+    }
+};
+
+
+class SeriesDecoder {
+private:
+    const std::vector<unsigned char> &bytes;
+    size_t position, count;
+    time_t last_time;
+    long last_delta;
+    uint64_t last_value;
+    int leading, trailing;
+
+    uint64_t get(int length);
+
+public:
+    SeriesDecoder(const std::vector<unsigned char> &data);
+
+    // Throws out_of_range past the end of the data
+    void next(time_t &time, double &value);
+};
+
+
+std::string base64(const std::vector<unsigned char> &data);
+
+
+struct sample_t {
+    unsigned long seq;
+    time_t time;
+    double value;
+};
+
+
+// Sensor readings taken every interval seconds and kept until the server
+// acknowledges them. Every sample is numbered, a batch stands for all the
+// kept samples up to its number, so an unacknowledged one is sent again.
+class Telemetry {
+private:
+    struct series_t {
+        std::string name;
+        DeviceTemperature *device;
+        std::deque<sample_t> samples;
+    };
+
+    std::vector<series_t> series;
+    unsigned long next_seq, acked, dropped;
+    time_t last_round;
+    int interval;
+    size_t capacity;
+    pthread_mutex_t mutex;
+
+public:
+    Telemetry(int _interval=TELEMETRY_INTERVAL,
+              size_t _capacity=TELEMETRY_CAPACITY);
+    ~Telemetry() throw();
+
+    size_t track(const std::string &name, DeviceTemperature *device);
+    // Reads every tracked sensor once the interval is over
+    void sample(time_t now);
+    void record(size_t id, time_t time, double value);
+
+    void acknowledge(unsigned long seq);
+    // SEQ=<seq>:PENDING=<samples left>:DROPPED=<samples lost>, then
+    // <name>:COUNT=<n>:DATA=<base64 series> for at most limit samples
+    std::string batch(size_t limit);
+};
+
+extern Telemetry telemetry;
+
+#endif
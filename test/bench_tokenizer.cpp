@@ -0,0 +1,96 @@
+// Lines per second of the instruction tokenizer against the former
+// stringstream and std::map splitting, run as ./bench_tokenizer [lines]
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <map>
+#include <string>
+#include <sstream>
+#include <vector>
+
+#include "../model.hpp"
+
+
+using namespace std;
+
+
+typedef map<string, string> s_map;
+
+
+static void map_deconstruct(const string &source, s_map &dest) {
+    stringstream buf(source);
+    string item;
+    while(getline(buf, item, ':')) {
+        size_t pos = item.find('=');
+        if(pos == string::npos) {
+            throw InteruptionHandling("Wrong fragment");
+        }
+        dest[item.substr(0, pos)] = item.substr(pos + 1);
+    }
+}
+
+
+static long map_consume(const string &line) {
+    s_map ref;
+    map_deconstruct(line, ref);
+    if(ref.find("ID") == ref.end() || ref.find("START") == ref.end()) {
+        throw InteruptionHandling("Key required");
+    }
+    string id = ref["ID"];
+    string name = ref["NAME"];
+    return id.size() + name.size() + strtol(ref["START"].c_str(), NULL, 10);
+}
+
+
+static long fields_consume(const string &line) {
+    InstructionFields ref;
+    ref.tokenize(line.data(), line.size());
+    if(!ref.has(FIELD_ID) || !ref.has(FIELD_START)) {
+        throw InteruptionHandling("Key required");
+    }
+    string id = ref[FIELD_ID];
+    string name = ref[FIELD_NAME];
+    return id.size() + name.size() + ref.number(FIELD_START);
+}
+
+
+template<typename F>
+static double lines_per_second(const vector<string> &lines, F consume,
+                               long &checksum) {
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+    for(size_t i = 0; i < lines.size(); i++) {
+        checksum += consume(lines[i]);
+    }
+    chrono::duration<double> spent = chrono::steady_clock::now() - begin;
+    return lines.size()/spent.count();
+}
+
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+
+    vector<string> lines;
+    for(size_t i = 0; i < count; i++) {
+        stringstream buf;
+        buf << "TYPE=COUPLED:ID=" << i << ":NAME=task" << i
+            << ":COMMAND=boiler.on:COUPLE=boiler.off:START=" << 1500000000 + i
+            << ":STOP=" << 1500003600 + i << ":COUPLING-INTERVAL=300"
+            << ":CATCHUP=SKIP";
+        lines.push_back(buf.str());
+    }
+
+    long before = 0, after = 0;
+    double old_rate = lines_per_second(lines, map_consume, before);
+    double new_rate = lines_per_second(lines, fields_consume, after);
+    if(before != after) {
+        fprintf(stderr, "Parsers disagree: %ld != %ld\n", before, after);
+        return 1;
+    }
+
+    printf("lines:        %zu\n", count);
+    printf("std::map:     %.0f lines/s\n", old_rate);
+    printf("tokenize:     %.0f lines/s\n", new_rate);
+    printf("speedup:      %.1fx\n", new_rate/old_rate);
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include "initializer.hpp"
 #include "drivers.hpp"
 #include "../confparser.hpp"
+#include "../commands.hpp"
 
 #include <cstdio>
 #include <memory>
@@ -50,6 +51,7 @@ ConfigInitializer::ConfigInitializer(const char *config_file_name) {
 
     drivers = new TestDrivers(conf->drivers());
     devices = new Devices(*drivers, conf->devices());
+    device_commands.build(*devices);
 }
 
 
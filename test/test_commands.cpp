@@ -25,52 +25,64 @@ BOOST_AUTO_TEST_CASE(test_driver_creation) {
     Drivers &drivers = *init.drivers;
     Devices &devices = *init.devices;
 
-    Result *r;
-
     BOOST_CHECK_EQUAL(drivers.serial("targetdevice")->relay_get(2), 0);
     SwitcherOn *swon = new SwitcherOn(devices.device("switcher"));
-    r = swon->execute();
-    BOOST_CHECK_EQUAL(r->value().c_str(), "1");
+    Result r = swon->execute();
+    BOOST_CHECK_EQUAL(r.value().c_str(), "1");
     BOOST_CHECK_EQUAL(drivers.serial("targetdevice")->relay_get(2), 1);
     delete swon;
 
-    delete r;
-
     r = SwitcherOff(devices.device("switcher")).execute();
-    BOOST_CHECK_EQUAL(r->value().c_str(), "1");
+    BOOST_CHECK_EQUAL(r.value().c_str(), "1");
     BOOST_CHECK_EQUAL(drivers.serial("targetdevice")->relay_get(2), 0);
-    delete r;
 
     r = TemperatureGet(devices.device("temperature")).execute();
-    BOOST_CHECK_EQUAL(atof(r->value().c_str()), 0);
-    delete r;
+    BOOST_CHECK_EQUAL(atof(r.value().c_str()), 0);
 
     r = TemperatureGet(devices.device("temperature")).execute();
-    BOOST_CHECK(fabs(atof(r->value().c_str()) - 1./1023.*5.) < 1e-6);
-    delete r;
+    BOOST_CHECK(fabs(atof(r.value().c_str()) - 1./1023.*5.) < 1e-6);
 
     r = TemperatureGet(devices.device("temperature")).execute();
-    BOOST_CHECK(fabs(atof(r->value().c_str()) - 2./1023.*5.) < 1e-6);
-    delete r;
+    BOOST_CHECK(fabs(atof(r.value().c_str()) - 2./1023.*5.) < 1e-6);
 
     r = SwitcherOn(devices.device("boiler")).execute();
-    BOOST_CHECK_EQUAL(r->value().c_str(), "1");
-    delete r;
+    BOOST_CHECK_EQUAL(r.value().c_str(), "1");
 
     r = SwitcherOff(devices.device("boiler")).execute();
-    BOOST_CHECK_EQUAL(r->value().c_str(), "1");
-    delete r;
-
+    BOOST_CHECK_EQUAL(r.value().c_str(), "1");
 
     r = TemperatureGet(devices.device("boiler")).execute();
-    BOOST_CHECK_EQUAL(atof(r->value().c_str()), 0);
-    delete r;
+    BOOST_CHECK_EQUAL(atof(r.value().c_str()), 0);
 
     r = TemperatureGet(devices.device("boiler")).execute();
-    BOOST_CHECK(fabs(atof(r->value().c_str()) - 1./1023.*5.) < 1e-6);
-    delete r;
+    BOOST_CHECK(fabs(atof(r.value().c_str()) - 1./1023.*5.) < 1e-6);
 
     r = TemperatureGet(devices.device("boiler")).execute();
-    BOOST_CHECK(fabs(atof(r->value().c_str()) - 2./1023.*5.) < 1e-6);
-    delete r;
+    BOOST_CHECK(fabs(atof(r.value().c_str()) - 2./1023.*5.) < 1e-6);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_device_commands) {
+    Drivers &drivers = *init.drivers;
+    Devices &devices = *init.devices;
+    symbol_t switcher = devices.lookup("switcher");
+
+    Command *on = device_commands.get(switcher, DEVICE_OPERATION_ON);
+    Command *off = device_commands.get(switcher, DEVICE_OPERATION_OFF);
+    BOOST_REQUIRE(on != NULL && off != NULL);
+    BOOST_CHECK(device_commands.get(switcher, DEVICE_OPERATION_TEMPERATURE) ==
+                NULL);
+    BOOST_CHECK(device_commands.get(devices.lookup("temperature"),
+                                    DEVICE_OPERATION_ON) == NULL);
+    BOOST_CHECK(device_commands.get(NO_SYMBOL, DEVICE_OPERATION_ON) == NULL);
+
+    BOOST_CHECK(!on->execute().is_error());
+    BOOST_CHECK_EQUAL(drivers.serial("targetdevice")->relay_get(2), 1);
+
+    // Throwing a handle away leaves the relay as it is
+    delete new CommandHandle(*on);
+    BOOST_CHECK_EQUAL(drivers.serial("targetdevice")->relay_get(2), 1);
+
+    BOOST_CHECK(!off->execute().is_error());
+    BOOST_CHECK_EQUAL(drivers.serial("targetdevice")->relay_get(2), 0);
 }
@@ -5,10 +5,16 @@
 #include <cstdio>
 #include <memory>
 
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
 #include <boost/test/unit_test.hpp>
 #include <boost/algorithm/string/replace.hpp>
 
 #include "../controller.hpp"
+#include "../local.hpp"
 #include "initializer.hpp"
 
 using namespace std;
@@ -65,12 +71,12 @@ class InstrResponseConnection: public BaseConnection {
         }
         string test_sample =
             "SUCCESS=1\n"
-            "ID=1:SUCCESS=1:VALUE=OK\n"
-            "ID=2:SUCCESS=1:VALUE=OK\n"
             "ID=0xfff0:SUCCESS=1:VALUE=0\n"
             "ID=0xfff1:SUCCESS=1:VALUE=0.00488759\n"
             "ID=0xfff2:SUCCESS=1:VALUE=0\n"
             "ID=0xfff3:SUCCESS=1:VALUE=0.00488759\n"
+            "ID=1:SUCCESS=1:VALUE=OK\n"
+            "ID=2:SUCCESS=1:VALUE=OK\n"
             "ID=3:SUCCESS=0:ERROR=Unable to take resource boiler.on\n";
         BOOST_CHECK_EQUAL(data, test_sample);
     }
@@ -136,3 +142,252 @@ BOOST_AUTO_TEST_CASE(test_instruction_response_server) {
     ctrl.execute();
     BOOST_CHECK_EQUAL(sched->size(), 2);
 }
+
+
+class SessionConnection: public BaseConnection {
+public:
+    static list<string> requests;
+    static vector<string> sent;
+
+    ~SessionConnection() throw() {};
+
+    bool connected() {
+        return true;
+    }
+
+    void send(string data) {
+        sent.push_back(data);
+    }
+
+    bool wait(int timeout) {
+        return !requests.empty();
+    }
+
+    string receive() {
+        string res = requests.front();
+        requests.pop_front();
+        return res;
+    }
+};
+list<string> SessionConnection::requests;
+vector<string> SessionConnection::sent;
+
+
+BOOST_AUTO_TEST_CASE(test_persistent_session) {
+    auto_ptr<NamedSchedule> sched(new NamedSchedule);
+    auto_ptr<Resources> res(new Resources);
+    TestController<SessionConnection> ctrl(
+        init.conf, init.devices, sched.get(), res.get());
+
+    SessionConnection::requests.push_back("CONFIG\nGET");
+    SessionConnection::requests.push_back("HEARTBEAT");
+    SessionConnection::requests.push_back("UNKNOWN");
+    BOOST_CHECK_THROW(ctrl.serve(), ConnectionError);
+
+    vector<string> &sent = SessionConnection::sent;
+    BOOST_REQUIRE_EQUAL(sent.size(), 3 + CONTROL_HEARTBEAT_MISSES);
+    BOOST_CHECK_EQUAL(sent[0].substr(0, 5), "READY");
+    BOOST_CHECK(sent[0].find("HEARTBEAT=") != string::npos);
+    BOOST_CHECK_EQUAL(sent[1].substr(0, 10), "SUCCESS=1\n");
+    BOOST_CHECK_EQUAL(sent[2],
+                      "SUCCESS=0\nUNKNOWN: operation not supported");
+    // Idle heartbeats back off and announce the next one
+    BOOST_CHECK_EQUAL(sent[3], "HEARTBEAT\nINTERVAL=60\n");
+    BOOST_CHECK_EQUAL(sent.back(), "HEARTBEAT\nINTERVAL=240\n");
+}
+
+
+BOOST_AUTO_TEST_CASE(test_adaptive_interval) {
+    AdaptiveInterval interval(10, 100);
+    BOOST_CHECK_EQUAL(interval.current(), 10);
+    interval.idle();
+    interval.idle();
+    BOOST_CHECK_EQUAL(interval.current(), 40);
+    for(int i = 0; i < 10; i++) {
+        interval.idle();
+    }
+    BOOST_CHECK_EQUAL(interval.current(), 100);
+    for(int i = 0; i < 100; i++) {
+        int value = interval.jittered();
+        BOOST_CHECK(value >= 50 && value <= 100);
+    }
+    interval.active();
+    BOOST_CHECK_EQUAL(interval.current(), 10);
+
+    interval.hint(70);
+    BOOST_CHECK_EQUAL(interval.current(), 70);
+    interval.hint(1000);
+    BOOST_CHECK_EQUAL(interval.current(), 100);
+    interval.hint(1);
+    BOOST_CHECK_EQUAL(interval.current(), 10);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_stats_include_handshakes) {
+    auto_ptr<NamedSchedule> sched(new NamedSchedule);
+    auto_ptr<Resources> res(new Resources);
+    TestController<SessionConnection> ctrl(
+        init.conf, init.devices, sched.get(), res.get());
+
+    string result = ctrl.handle("STATS\nGET");
+    BOOST_CHECK_EQUAL(result.substr(0, 10), "SUCCESS=1\n");
+    BOOST_CHECK(result.find("STAT=LATENESS.SINGLE:") != string::npos);
+    BOOST_CHECK(result.find("STAT=HANDSHAKE.FULL:COUNT=0") != string::npos);
+    BOOST_CHECK(result.find("STAT=HANDSHAKE.RESUMED:COUNT=0") !=
+                string::npos);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_pipelined_requests) {
+    auto_ptr<NamedSchedule> sched(new NamedSchedule);
+    auto_ptr<Resources> res(new Resources);
+    TestController<SessionConnection> ctrl(
+        init.conf, init.devices, sched.get(), res.get());
+
+    vector<string> batch;
+    batch.push_back("INSTRUCTIONS:REQUEST=1\n"
+                    "ID=7:TYPE=VALUE:COMMAND=temperature.temperature");
+    batch.push_back("CONFIG\nGET");
+    batch.push_back("STATS:REQUEST=2\nGET");
+    batch.push_back("NOTHING:REQUEST=3");
+    batch.push_back("EVENTS:REQUEST=4\nACK=0");
+    batch.push_back("TELEMETRY:REQUEST=5\nGET");
+
+    vector<string> responses = ctrl.handle(batch);
+    BOOST_REQUIRE_EQUAL(responses.size(), 6);
+    // Read-only requests first, acknowledgements keep their place
+    BOOST_CHECK_EQUAL(responses[1].substr(0, 20), "REQUEST=5\nSUCCESS=1\n");
+    responses.erase(responses.begin() + 1);
+    BOOST_CHECK_EQUAL(responses[4].substr(0, 20), "REQUEST=4\nSUCCESS=1\n");
+    BOOST_CHECK_EQUAL(responses[0].substr(0, 20), "REQUEST=2\nSUCCESS=1\n");
+    BOOST_CHECK_EQUAL(responses[1].substr(0, 20), "REQUEST=1\nSUCCESS=1\n");
+    BOOST_CHECK(responses[1].find("ID=7:SUCCESS=1") != string::npos);
+    BOOST_CHECK_EQUAL(responses[2],
+                      "SUCCESS=1\n"
+                      "boiler:boiler\n"
+                      "switcher:switcher\n"
+                      "temperature:temperature\n");
+    BOOST_CHECK_EQUAL(responses[3],
+                      "REQUEST=3\nSUCCESS=0\nNOTHING: operation not supported");
+}
+
+
+BOOST_AUTO_TEST_CASE(test_local_socket) {
+    auto_ptr<NamedSchedule> sched(new NamedSchedule);
+    auto_ptr<Resources> res(new Resources);
+    TestController<SessionConnection> ctrl(
+        init.conf, init.devices, sched.get(), res.get());
+
+    const string path = "/tmp/test_tdevice.sock";
+    LocalListener listener(ctrl, path);
+
+    // Open to the owner and group only
+    struct stat info;
+    BOOST_REQUIRE_EQUAL(stat(path.c_str(), &info), 0);
+    BOOST_CHECK_EQUAL(info.st_mode & 0777, LOCAL_SOCKET_MODE);
+
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    BOOST_REQUIRE(client >= 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    BOOST_REQUIRE_EQUAL(
+        connect(client, (struct sockaddr*)&addr, sizeof(addr)), 0);
+
+    string request = FrameReader::frame("CONFIG\nGET") +
+        FrameReader::frame("STATS:REQUEST=5\nGET");
+    BOOST_REQUIRE_EQUAL(write(client, request.data(), request.size()),
+                        (ssize_t)request.size());
+    // Sent requests are still answered after the client stops writing
+    shutdown(client, SHUT_WR);
+
+    FrameReader reader;
+    message_view_t message;
+    vector<string> responses;
+    for(int i = 0; i < 10 && responses.size() < 2; i++) {
+        listener.poll(100);
+        char *dest = reader.space(4096);
+        ssize_t received = recv(client, dest, reader.available(),
+                                MSG_DONTWAIT);
+        if(received > 0) {
+            reader.commit(received);
+        }
+        while(reader.next(message)) {
+            responses.push_back(message.str());
+        }
+    }
+    close(client);
+
+    BOOST_REQUIRE_EQUAL(responses.size(), 2);
+    BOOST_CHECK_EQUAL(responses[0],
+                      "SUCCESS=1\n"
+                      "boiler:boiler\n"
+                      "switcher:switcher\n"
+                      "temperature:temperature\n");
+    BOOST_CHECK_EQUAL(responses[1].substr(0, 20), "REQUEST=5\nSUCCESS=1\n");
+    BOOST_CHECK_EQUAL(listener.size(), 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_local_socket_drain) {
+    auto_ptr<NamedSchedule> sched(new NamedSchedule);
+    auto_ptr<Resources> res(new Resources);
+    TestController<SessionConnection> ctrl(
+        init.conf, init.devices, sched.get(), res.get());
+
+    const string path = "/tmp/test_tdevice.sock";
+    LocalListener listener(ctrl, path);
+
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    BOOST_REQUIRE(client >= 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    BOOST_REQUIRE_EQUAL(
+        connect(client, (struct sockaddr*)&addr, sizeof(addr)), 0);
+
+    // More answers than the socket buffer holds before the client reads
+    const size_t COUNT = 4000;
+    string request;
+    for(size_t i = 0; i < COUNT; i++) {
+        request += FrameReader::frame("CONFIG\nGET");
+    }
+    BOOST_REQUIRE_EQUAL(write(client, request.data(), request.size()),
+                        (ssize_t)request.size());
+    shutdown(client, SHUT_WR);
+    listener.poll(100);
+
+    FrameReader reader;
+    message_view_t message;
+    size_t responses = 0;
+    for(int i = 0; i < 1000 && listener.size() > 0; i++) {
+        char *dest = reader.space(65536);
+        ssize_t received = recv(client, dest, reader.available(),
+                                MSG_DONTWAIT);
+        if(received > 0) {
+            reader.commit(received);
+        }
+        while(reader.next(message)) {
+            responses++;
+        }
+        listener.poll(10);
+    }
+    while(true) {
+        char *dest = reader.space(65536);
+        ssize_t received = recv(client, dest, reader.available(),
+                                MSG_DONTWAIT);
+        if(received <= 0) {
+            break;
+        }
+        reader.commit(received);
+    }
+    while(reader.next(message)) {
+        responses++;
+    }
+    close(client);
+
+    BOOST_CHECK_EQUAL(responses, COUNT);
+    BOOST_CHECK_EQUAL(listener.size(), 0);
+}
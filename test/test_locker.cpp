@@ -0,0 +1,112 @@
+#define BOOST_TEST_IGNORE_SIGKILL
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE LockerCpp
+
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include "../locker.hpp"
+
+
+using namespace std;
+
+
+struct lane_client_t {
+    PriorityLane *lane;
+    priority_t priority;
+    vector<priority_t> *order;
+};
+
+
+void *lane_client(void *args) {
+    lane_client_t *client = reinterpret_cast<lane_client_t*>(args);
+    client->lane->acquire(client->priority);
+    client->order->push_back(client->priority);
+    client->lane->release();
+    return NULL;
+}
+
+
+void wait_queued(PriorityLane &lane, priority_t priority, int count) {
+    while(lane.queued(priority) < count) {
+        usleep(1000);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_interactive_goes_first) {
+    PriorityLane lane;
+    vector<priority_t> order;
+    lane_client_t background = {&lane, PRIORITY_BACKGROUND, &order};
+    lane_client_t interactive = {&lane, PRIORITY_INTERACTIVE, &order};
+    pthread_t first, second;
+
+    lane.acquire(PRIORITY_BACKGROUND);
+    pthread_create(&first, NULL, lane_client, &background);
+    wait_queued(lane, PRIORITY_BACKGROUND, 1);
+    pthread_create(&second, NULL, lane_client, &interactive);
+    wait_queued(lane, PRIORITY_INTERACTIVE, 1);
+    lane.release();
+
+    pthread_join(first, NULL);
+    pthread_join(second, NULL);
+    BOOST_REQUIRE_EQUAL(order.size(), 2);
+    BOOST_CHECK_EQUAL(order[0], PRIORITY_INTERACTIVE);
+    BOOST_CHECK_EQUAL(order[1], PRIORITY_BACKGROUND);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_background_is_not_starved) {
+    PriorityLane lane;
+    vector<priority_t> order;
+    lane_client_t background = {&lane, PRIORITY_BACKGROUND, &order};
+    lane_client_t interactive = {&lane, PRIORITY_INTERACTIVE, &order};
+    const int INTERACTIVE = PriorityLane::STARVATION_LIMIT + 2;
+    pthread_t threads[INTERACTIVE + 1];
+
+    // Build up an interactive streak
+    for(int i = 0; i < PriorityLane::STARVATION_LIMIT; i++) {
+        lane.acquire(PRIORITY_INTERACTIVE);
+        lane.release();
+    }
+
+    lane.acquire(PRIORITY_INTERACTIVE);
+    pthread_create(&threads[0], NULL, lane_client, &background);
+    wait_queued(lane, PRIORITY_BACKGROUND, 1);
+    for(int i = 1; i <= INTERACTIVE; i++) {
+        pthread_create(&threads[i], NULL, lane_client, &interactive);
+    }
+    wait_queued(lane, PRIORITY_INTERACTIVE, INTERACTIVE);
+    lane.release();
+
+    for(int i = 0; i <= INTERACTIVE; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    BOOST_REQUIRE_EQUAL(order.size(), INTERACTIVE + 1);
+    BOOST_CHECK_EQUAL(order[0], PRIORITY_BACKGROUND);
+}
+
+
+class Guarded {};
+
+
+BOOST_AUTO_TEST_CASE(test_latency_per_class) {
+    Guarded object;
+    {
+        PriorityScope scope(PRIORITY_INTERACTIVE);
+        PriorityLocker<Guarded, Guarded> cover(&object);
+    }
+    {
+        PriorityLocker<Guarded, Guarded> cover(&object);
+    }
+    {
+        PriorityLocker<Guarded, Guarded> cover(&object);
+    }
+    BOOST_CHECK_EQUAL(PriorityScope::current(), PRIORITY_BACKGROUND);
+    PriorityLane &lane = LaneType<Guarded>::lane;
+    BOOST_CHECK_EQUAL(lane.latency(PRIORITY_INTERACTIVE).snapshot().count, 1);
+    BOOST_CHECK_EQUAL(lane.latency(PRIORITY_BACKGROUND).snapshot().count, 2);
+}
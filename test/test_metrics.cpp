@@ -0,0 +1,34 @@
+#define BOOST_TEST_IGNORE_SIGKILL
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE MetricsCpp
+
+#include <boost/test/unit_test.hpp>
+
+#include "../metrics.hpp"
+
+
+using namespace std;
+
+
+BOOST_AUTO_TEST_CASE(test_histogram_percentiles) {
+    Histogram hist;
+    BOOST_CHECK_EQUAL(hist.percentile(0.5), 0);
+
+    for(int i = 0; i < 90; i++) {
+        hist.record(10);
+    }
+    for(int i = 0; i < 10; i++) {
+        hist.record(5000);
+    }
+
+    histogram_snapshot_t snap = hist.snapshot();
+    BOOST_CHECK_EQUAL(snap.count, 100);
+    BOOST_CHECK_EQUAL(snap.sum, 90*10 + 10*5000);
+    BOOST_CHECK_EQUAL(snap.max, 5000);
+    BOOST_CHECK(snap.percentile(0.5) >= 10 && snap.percentile(0.5) < 16);
+    BOOST_CHECK(snap.percentile(0.99) > 4000);
+    BOOST_CHECK(snap.percentile(0.99) <= 5000);
+
+    hist.reset();
+    BOOST_CHECK_EQUAL(hist.snapshot().count, 0);
+}
@@ -2,7 +2,9 @@
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE ConfParserModule
 
+#include <climits>
 #include <cstdio>
+#include <cstring>
 #include <memory>
 
 #include <unistd.h>
@@ -36,33 +38,128 @@ BOOST_AUTO_TEST_CASE(test_config_get) {
 }
 
 
+BOOST_AUTO_TEST_CASE(test_stats_get) {
+    StatsModel stats;
+    model_call_params_t params;
+    params.request_data = "GET";
+
+    string res = stats.execute(params);
+    BOOST_CHECK(res.find("STAT=LATENESS.SINGLE:COUNT=") != string::npos);
+    BOOST_CHECK(res.find("STAT=MISSED.COUPLED:VALUE=") != string::npos);
+    BOOST_CHECK(res.find("STAT=LATENCY.INTERACTIVE:COUNT=") != string::npos);
+
+    params.request_data = "PUT";
+    BOOST_REQUIRE_THROW(stats.execute(params), InteruptionHandling);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_state_delta) {
+    StateModel state;
+    model_call_params_t params;
+    params.config = init.conf;
+    params.devices = init.devices;
+    params.request_data = "GET";
+
+    string full = state.execute(params);
+    stringstream epoch;
+    epoch << ":EPOCH=" << device_state.epoch();
+    state_changes_t changes;
+    unsigned long version = device_state.since(0, changes);
+    stringstream since;
+    since << "SINCE=" << version << epoch.str();
+
+    {
+        SwitcherOn on(init.devices->device("switcher"));
+        BOOST_REQUIRE(!on.execute().is_error());
+        params.request_data = since.str();
+        string delta = state.execute(params);
+        BOOST_CHECK_EQUAL(delta.substr(delta.find('\n') + 1),
+                          "switcher.relay:ON\n");
+
+        // Repeating a position is not a change
+        on.execute();
+        since.str("");
+        since << "SINCE=" << version + 1 << epoch.str();
+        params.request_data = since.str();
+        delta = state.execute(params);
+        BOOST_CHECK_EQUAL(delta.substr(delta.find('\n') + 1), "");
+        SwitcherOff(init.devices->device("switcher")).execute();
+    }
+
+    // A client from before a restart gets everything
+    params.request_data = "SINCE=1:EPOCH=1";
+    string reset = state.execute(params);
+    BOOST_CHECK(reset.find("switcher.relay:OFF\n") != string::npos);
+
+    params.request_data = "SINCE=1";
+    BOOST_CHECK_THROW(state.execute(params), InteruptionHandling);
+}
+
+
 BOOST_AUTO_TEST_CASE(test_deconstruct) {
-    s_map ref;
+    InstructionFields ref;
     BOOST_REQUIRE_THROW(BaseInstructionLine::deconstruct("dddd", ref),
                         InteruptionHandling);
     BOOST_REQUIRE_THROW(BaseInstructionLine::deconstruct("ID=1:COMMAND", ref),
                         InteruptionHandling);
     BOOST_REQUIRE_NO_THROW(BaseInstructionLine::deconstruct("ID=1:TEST=12:",
                                                             ref));
-    BOOST_CHECK_EQUAL(ref["ID"], "1");
-    BOOST_CHECK_EQUAL(ref["TEST"], "12");
+    BOOST_CHECK_EQUAL(ref[FIELD_ID], "1");
+    BOOST_CHECK(!ref.has(FIELD_COMMAND));
+    BOOST_CHECK_EQUAL(InstructionFields::key("TEST", 4), -1);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_tokenize) {
+    const char line[] = "ID=7:START=-15:ID=8:COUPLING-INTERVAL=3:NAME=";
+    InstructionFields ref;
+    ref.tokenize(line, sizeof(line) - 1);
+    BOOST_CHECK_EQUAL(ref[FIELD_ID], "8");
+    BOOST_CHECK_EQUAL(ref.number(FIELD_START), -15);
+    BOOST_CHECK_EQUAL(ref.number(FIELD_COUPLING_INTERVAL), 3);
+    BOOST_CHECK(ref.has(FIELD_NAME));
+    BOOST_CHECK(ref.equals(FIELD_NAME, ""));
+    BOOST_CHECK(!ref.equals(FIELD_ID, "7"));
+    BOOST_REQUIRE_THROW(ref.number(FIELD_NAME), InteruptionHandling);
+    BOOST_REQUIRE_THROW(ref.number(FIELD_STOP), InteruptionHandling);
+
+    // A missing key is reported as such, before its value is looked at
+    try {
+        ref.number(FIELD_RESTART);
+        BOOST_ERROR("A missing key parsed as a number");
+    } catch(InteruptionHandling &e) {
+        BOOST_CHECK_EQUAL(e, "Key RESTART required");
+    }
+
+    // Values which do not fit an int are refused rather than wrapped
+    const char huge[] = "RESTART=99999999999999999999:STOP=-2147483648:"
+        "START=2147483647";
+    ref.tokenize(huge, sizeof(huge) - 1);
+    BOOST_REQUIRE_THROW(ref.number(FIELD_RESTART), InteruptionHandling);
+    BOOST_REQUIRE_THROW(ref.number(FIELD_STOP), InteruptionHandling);
+    BOOST_CHECK_EQUAL(ref.number(FIELD_START), INT_MAX);
+
+    // Only the given span is looked at
+    ref.tokenize(line, 4);
+    BOOST_CHECK_EQUAL(ref[FIELD_ID], "7");
+    BOOST_CHECK(!ref.has(FIELD_START));
 }
 
 
 BOOST_AUTO_TEST_CASE(test_value_instruction) {
-    s_map ref;
+    InstructionFields ref;
     BaseInstructionLine::deconstruct("ID=1:COMMAND=boiler.on", ref);
     ValueInstructionLine instr(ref);
     BOOST_CHECK_EQUAL(instr.id, "1");
     BOOST_CHECK_EQUAL(instr.command, "boiler.on");
 
-    s_map nref;
+    InstructionFields nref;
     BaseInstructionLine::deconstruct("ID=1", nref);
     BOOST_REQUIRE_THROW(
                   unique_ptr<BaseInstructionLine>(new ValueInstructionLine(nref)),
                   InteruptionHandling);
 
-    s_map nnref;
+    InstructionFields nnref;
     BaseInstructionLine::deconstruct("COMMAND=nova", nnref);
     BOOST_REQUIRE_THROW(
                  unique_ptr<BaseInstructionLine>(new ValueInstructionLine(nnref)),
@@ -71,7 +168,7 @@ BOOST_AUTO_TEST_CASE(test_value_instruction) {
 
 
 BOOST_AUTO_TEST_CASE(test_single_instruction) {
-    s_map ref;
+    InstructionFields ref;
     BaseInstructionLine::deconstruct(
                            "ID=1:NAME=boiler-on:COMMAND=boiler.on:START=12",
                            ref);
@@ -116,7 +213,17 @@ BOOST_AUTO_TEST_CASE(test_single_instruction) {
         BOOST_CHECK_EQUAL(instr.restart, 50);
     }
 
-    const int LENGTH = 8;
+    ref.clear();
+    BaseInstructionLine::deconstruct(
+         "ID=1:NAME=boiler-on:COMMAND=boiler.on:START=12:RESTART=50:CATCHUP=SKIP",
+         ref);
+
+    {
+        SingleInstructionLine instr(ref);
+        BOOST_CHECK_EQUAL(instr.catchup, CATCHUP_SKIP);
+    }
+
+    const int LENGTH = 9;
     const char *wrong_instrs[LENGTH] = {
         "ID=1:START=12",
         "NAME=boiler-on:COMMAND=boiler.on:START=12:STOP=16:RESTART=50",
@@ -125,7 +232,8 @@ BOOST_AUTO_TEST_CASE(test_single_instruction) {
         "ID=1:NAME=boiler-on:COMMAND=boiler.on:STOP=13:RESTART=50",
         "ID=1:NAME=boiler-on:COMMAND=boiler.on:START=A:STOP=13:RESTART=50",
         "ID=1:NAME=boiler-on:COMMAND=boiler.on:START=12:STOP=A:RESTART=50",
-        "ID=1:NAME=boiler-on:COMMAND=boiler.on:START=12:STOP=16:RESTART=a"
+        "ID=1:NAME=boiler-on:COMMAND=boiler.on:START=12:STOP=16:RESTART=a",
+        "ID=1:NAME=boiler-on:COMMAND=boiler.on:START=12:RESTART=50:CATCHUP=NOW"
     };
 
     for(int i = 0; i < LENGTH; i++) {
@@ -139,7 +247,7 @@ BOOST_AUTO_TEST_CASE(test_single_instruction) {
 
 
 BOOST_AUTO_TEST_CASE(test_couple_instruction) {
-    s_map ref;
+    InstructionFields ref;
     BaseInstructionLine::deconstruct(
          "ID=1:NAME=boiler-on:COMMAND=boiler.on:START=12:COUPLE=boiler.off:COUPLING-INTERVAL=40",
          ref);
@@ -205,6 +313,33 @@ BOOST_AUTO_TEST_CASE(test_parser_condition) {
     BOOST_CHECK_EQUAL(res.operation, COMPARISON_GT);
     BOOST_CHECK_EQUAL(res.value, 80);
 
+    res = parse_comparison("boiler.temperature.LT_50_OFF_55_DWELL_30");
+    BOOST_CHECK_EQUAL(res.operation, COMPARISON_LT);
+    BOOST_CHECK_EQUAL(res.value, 50);
+    BOOST_CHECK_EQUAL(res.release, 55);
+    BOOST_CHECK_EQUAL(res.dwell, 30);
+
+    res = parse_comparison("boiler.temperature.GT_80_DWELL_10");
+    BOOST_CHECK_EQUAL(res.value, 80);
+    BOOST_CHECK_EQUAL(res.release, 80);
+    BOOST_CHECK_EQUAL(res.dwell, 10);
+
+    res = parse_comparison("boiler.temperature.GE_80_OFF_70");
+    BOOST_CHECK_EQUAL(res.release, 70);
+    BOOST_CHECK_EQUAL(res.dwell, 0);
+
+    BOOST_REQUIRE_THROW(parse_comparison("boiler.temperature.LT_50_OFF_45"),
+                        InteruptionHandling);
+    BOOST_REQUIRE_THROW(parse_comparison("boiler.temperature.GT_50_OFF_55"),
+                        InteruptionHandling);
+    BOOST_REQUIRE_THROW(parse_comparison("boiler.temperature.EQ_50_OFF_55"),
+                        InteruptionHandling);
+    BOOST_REQUIRE_THROW(parse_comparison("boiler.temperature.LT_50_OFF"),
+                        InteruptionHandling);
+    BOOST_REQUIRE_THROW(parse_comparison("boiler.temperature.LT_50_DWELL_-1"),
+                        InteruptionHandling);
+    BOOST_REQUIRE_THROW(parse_comparison("boiler.temperature.LT_50_HOLD_1"),
+                        InteruptionHandling);
     BOOST_REQUIRE_THROW(parse_comparison("boiler.camera.GT_80"),
                         InteruptionHandling);
     BOOST_REQUIRE_THROW(parse_comparison("boiler.camera.GT_80"),
@@ -220,8 +355,76 @@ BOOST_AUTO_TEST_CASE(test_parser_condition) {
 }
 
 
+BOOST_AUTO_TEST_CASE(test_parser_compound_condition) {
+    BOOST_CHECK(!is_compound_condition("boiler.temperature.LT_80"));
+    BOOST_CHECK(!is_compound_condition("boiler.temperature.LT_50_OFF_55"));
+    BOOST_CHECK(is_compound_condition("TIME.GE_0600"));
+    BOOST_CHECK(is_compound_condition(
+                    "boiler.temperature.LT_switcher.temperature"));
+
+    condition_expression_t res = parse_condition(
+        "boiler.temperature.LT_50 AND "
+        "(TIME.GE_0600 OR NOT boiler.temperature.LT_room.temperature)");
+    BOOST_REQUIRE_EQUAL(res.sensors.size(), 2);
+    BOOST_CHECK_EQUAL(res.sensors[0], "boiler");
+    BOOST_CHECK_EQUAL(res.sensors[1], "room");
+    BOOST_REQUIRE_EQUAL(res.program.size(), 6);
+    BOOST_CHECK_EQUAL(res.program[0].op, CONDITION_SENSOR);
+    BOOST_CHECK_EQUAL(res.program[0].value, 50);
+    BOOST_CHECK_EQUAL(res.program[1].op, CONDITION_AND);
+    BOOST_CHECK_EQUAL(res.program[1].left, 6);
+    BOOST_CHECK_EQUAL(res.program[2].op, CONDITION_TIME);
+    BOOST_CHECK_EQUAL(res.program[2].value, 600);
+    BOOST_CHECK_EQUAL(res.program[3].op, CONDITION_OR);
+    BOOST_CHECK_EQUAL(res.program[3].left, 6);
+    BOOST_CHECK_EQUAL(res.program[4].op, CONDITION_SENSORS);
+    BOOST_CHECK_EQUAL(res.program[4].left, 0);
+    BOOST_CHECK_EQUAL(res.program[4].right, 1);
+    BOOST_CHECK_EQUAL(res.program[5].op, CONDITION_NOT);
+
+    const char *wrong[] = {
+        "boiler.temperature.LT_50 AND",
+        "(boiler.temperature.LT_50",
+        "boiler.temperature.LT_50)",
+        "boiler.temperature.LT_50 OR OR TIME.GE_0600",
+        "boiler.temperature.LT_50_OFF_55 AND TIME.GE_0600",
+        "TIME.GE_2460",
+        "TIME.XX_0600",
+        "boiler.temperature.LT_room.camera",
+        "boiler.temperature.LT_50 boiler.temperature.GT_40"
+    };
+    for(size_t i = 0; i < sizeof(wrong)/sizeof(wrong[0]); i++) {
+        BOOST_CHECK_THROW(parse_condition(wrong[i]), InteruptionHandling);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_expression_condition) {
+    struct tm parts = {};
+    parts.tm_year = 100;
+    parts.tm_mday = 1;
+    parts.tm_hour = 7;
+    parts.tm_min = 30;
+    parts.tm_isdst = -1;
+    time_t morning = mktime(&parts);
+    parts.tm_hour = 22;
+    time_t evening = mktime(&parts);
+
+    condition_expression_t res = parse_condition(
+        "TIME.GE_0600 AND NOT TIME.GT_2100");
+    ExpressionCondition cond(res.program, vector<DeviceTemperature*>());
+    BOOST_CHECK_EQUAL(cond.evaluate(morning), true);
+    BOOST_CHECK_EQUAL(cond.evaluate(evening), false);
+
+    res = parse_condition("TIME.LT_0600 OR (TIME.GE_0700 AND TIME.LT_0800)");
+    ExpressionCondition cond2(res.program, vector<DeviceTemperature*>());
+    BOOST_CHECK_EQUAL(cond2.evaluate(morning), true);
+    BOOST_CHECK_EQUAL(cond2.evaluate(evening), false);
+}
+
+
 BOOST_AUTO_TEST_CASE(test_conditioned_instruction) {
-    s_map ref;
+    InstructionFields ref;
     BaseInstructionLine::deconstruct(
         "ID=1:NAME=boiler-on:COMMAND=boiler.on:START=12:COUPLE=boiler.off:CONDITION=boiler.temperature.LT_80",
         ref);
@@ -300,21 +503,39 @@ BOOST_AUTO_TEST_CASE(test_command_generation) {
     params.request_data =
         "ID=1:TYPE=value:COMMAND=switcher.on";
 
-    unique_ptr<Command> cmd1(command_from_string(params, "switcher.on"));
-    BOOST_CHECK(dynamic_cast<SwitcherOn*>(cmd1.get()) != NULL);
-
-    unique_ptr<Command> cmd2(command_from_string(params, "switcher.off"));
-    BOOST_CHECK(dynamic_cast<SwitcherOff*>(cmd2.get()) != NULL);
-
-    unique_ptr<Command> cmd3(command_from_string(params,
-                                               "temperature.temperature"));
-    BOOST_CHECK(dynamic_cast<TemperatureGet*>(cmd3.get()) != NULL);
-
-    unique_ptr<Command> cmd4(command_from_string(params, "boiler.on"));
-    BOOST_CHECK(dynamic_cast<SwitcherOn*>(cmd4.get()) != NULL);
-
-    unique_ptr<Command> cmd5(command_from_string(params, "boiler.off"));
-    BOOST_CHECK(dynamic_cast<SwitcherOff*>(cmd5.get()) != NULL);
+    BOOST_CHECK(dynamic_cast<SwitcherOn*>(
+                    &device_command(params, "switcher.on")) != NULL);
+    BOOST_CHECK(dynamic_cast<SwitcherOff*>(
+                    &device_command(params, "switcher.off")) != NULL);
+    BOOST_CHECK(dynamic_cast<TemperatureGet*>(
+                    &device_command(params, "temperature.temperature")) != NULL);
+    BOOST_CHECK(dynamic_cast<SwitcherOn*>(
+                    &device_command(params, "boiler.on")) != NULL);
+    BOOST_CHECK(dynamic_cast<SwitcherOff*>(
+                    &device_command(params, "boiler.off")) != NULL);
+
+    // Schedules get handles to the one shared command
+    unique_ptr<Command> cmd1(command_from_string(params, "boiler.on"));
+    unique_ptr<Command> cmd2(command_from_string(params, "boiler.on"));
+    CommandHandle *handle1 = dynamic_cast<CommandHandle*>(cmd1.get());
+    CommandHandle *handle2 = dynamic_cast<CommandHandle*>(cmd2.get());
+    BOOST_REQUIRE(handle1 != NULL && handle2 != NULL);
+    BOOST_CHECK_EQUAL(&handle1->target(), &device_command(params, "boiler.on"));
+    BOOST_CHECK_EQUAL(&handle1->target(), &handle2->target());
+
+    // An on handle leaves the shared off once it has gone through
+    BOOST_CHECK(cmd1->releaser() == NULL);
+    BOOST_CHECK(!cmd1->execute().is_error());
+    BOOST_CHECK_EQUAL(cmd1->releaser(), &device_command(params, "boiler.off"));
+    BOOST_CHECK(cmd2->releaser() == NULL);
+    unique_ptr<Command> off(command_from_string(params, "boiler.off"));
+    off->execute();
+    BOOST_CHECK(off->releaser() == NULL);
+
+    // Cancelling one schedule's handle leaves the others alone
+    cmd1->cancel();
+    BOOST_CHECK(!cmd2->cancelled());
+    BOOST_CHECK(!handle1->target().cancelled());
 
     BOOST_REQUIRE_THROW(
         unique_ptr<Command>(command_from_string(params, "boiler.of")),
@@ -331,6 +552,35 @@ BOOST_AUTO_TEST_CASE(test_command_generation) {
     BOOST_REQUIRE_THROW(
         unique_ptr<Command>(command_from_string(params, "ah")),
         InteruptionHandling);
+
+    BOOST_REQUIRE_THROW(
+        unique_ptr<Command>(command_from_string(params, "boiler.onn")),
+        InteruptionHandling);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_device_operations) {
+    for(int op = 0; op < DEVICE_OPERATIONS; op++) {
+        const char *name = DEVICE_OPERATION_NAMES[op];
+        BOOST_CHECK_EQUAL(device_operation(name, strlen(name)), op);
+    }
+    BOOST_CHECK_EQUAL(device_operation("of", 2), -1);
+    BOOST_CHECK_EQUAL(device_operation("", 0), -1);
+    BOOST_CHECK_EQUAL(device_operation("temperaturE", 11), -1);
+    // Only the given span is looked at
+    BOOST_CHECK_EQUAL(device_operation("offset", 3), DEVICE_OPERATION_OFF);
+
+    BOOST_CHECK_EQUAL(device_capabilities(DEVICE_UNDEFINED), 0u);
+    BOOST_CHECK_EQUAL(device_capabilities(DEVICE_SWITCHER),
+                      1u << DEVICE_OPERATION_ON | 1u << DEVICE_OPERATION_OFF);
+    BOOST_CHECK_EQUAL(device_capabilities(DEVICE_THERMOSWITCHER),
+                      1u << DEVICE_OPERATION_TEMPERATURE);
+
+    BOOST_CHECK_EQUAL(init.devices->type(init.devices->lookup("boiler")),
+                      DEVICE_BOILER);
+    BOOST_CHECK_EQUAL(init.devices->type(NO_SYMBOL), DEVICE_UNDEFINED);
+    BOOST_CHECK_EQUAL(init.devices->lookup("boiler.on", 6),
+                      init.devices->lookup("boiler"));
 }
 
 
@@ -340,7 +590,7 @@ BOOST_AUTO_TEST_CASE(test_conditioned_schedule_getting) {
     params.devices = init.devices;
     params.request_data =
         "ID=1:TYPE=value:COMMAND=switcher.on";
-    s_map ref;
+    InstructionFields ref;
 
     ref.clear();
     stringstream buf;
@@ -368,13 +618,41 @@ BOOST_AUTO_TEST_CASE(test_conditioned_schedule_getting) {
 }
 
 
+BOOST_AUTO_TEST_CASE(test_compound_schedule_getting) {
+    model_call_params_t params;
+    params.config = init.conf;
+    params.devices = init.devices;
+    InstructionFields ref;
+
+    stringstream buf;
+    buf << "ID=1:NAME=boiler-on:COMMAND=boiler.on:START=";
+    buf << time(NULL) + 4000;
+    buf << ":COUPLE=boiler.off:CONDITION=boiler.temperature.LT_80 OR "
+        "boiler.temperature.GT_temperature.temperature";
+    BaseInstructionLine::deconstruct(buf.str(), ref);
+    ConditionInstructionLine instr(ref);
+    BOOST_CHECK(instr.compound);
+
+    unique_ptr<BaseSchedule> cond_sched(get_conditioned(params, &instr));
+    BOOST_CHECK(dynamic_cast<ConditionedSchedule*>(cond_sched.get()) !=
+                (BaseSchedule*)NULL);
+
+    ref.clear();
+    string wrong = buf.str();
+    boost::replace_all(wrong, "GT_temperature", "GT_nosuchdevice");
+    BaseInstructionLine::deconstruct(wrong, ref);
+    ConditionInstructionLine instr2(ref);
+    BOOST_CHECK_THROW(get_conditioned(params, &instr2), InteruptionHandling);
+}
+
+
 BOOST_AUTO_TEST_CASE(test_coupled_schedule_getting) {
     model_call_params_t params;
     params.config = init.conf;
     params.devices = init.devices;
     params.request_data =
         "ID=1:TYPE=value:COMMAND=switcher.on";
-    s_map ref;
+    InstructionFields ref;
 
     ref.clear();
     stringstream buf;
@@ -409,7 +687,7 @@ BOOST_AUTO_TEST_CASE(test_single_schedule_getting) {
     params.devices = init.devices;
     params.request_data =
         "ID=1:TYPE=value:COMMAND=switcher.on";
-    s_map ref;
+    InstructionFields ref;
 
     ref.clear();
     stringstream buf;
@@ -441,7 +719,7 @@ BOOST_AUTO_TEST_CASE(test_single_schedule_getting) {
 BOOST_AUTO_TEST_CASE(test_instruction_list_model) {
     model_call_params_t params;
     unique_ptr<NamedSchedule> sched(new NamedSchedule());
-    unique_ptr<map<string, list<string> > > busy(new map<string, list<string> >);
+    unique_ptr<BusyResources> busy(new BusyResources);
     params.config = init.conf;
     params.devices = init.devices;
     params.sched = sched.get();
@@ -463,13 +741,12 @@ BOOST_AUTO_TEST_CASE(test_instruction_list_model) {
 
     InstructionListModel model;
     BOOST_CHECK_EQUAL(model.execute(params),
-                      "ID=1:SUCCESS=1:VALUE=OK\n"
-                      "ID=2:SUCCESS=1:VALUE=OK\n"
-                      // "ID=3:SUCCESS=1:VALUE=OK\n"
                       "ID=0xfff0:SUCCESS=1:VALUE=0\n"
                       "ID=0xfff1:SUCCESS=1:VALUE=0.00488759\n"
                       "ID=0xfff2:SUCCESS=1:VALUE=0\n"
                       "ID=0xfff3:SUCCESS=1:VALUE=0.00488759\n"
+                      "ID=1:SUCCESS=1:VALUE=OK\n"
+                      "ID=2:SUCCESS=1:VALUE=OK\n"
                       );
 
     BOOST_CHECK_EQUAL(params.sched->size(), 2);
@@ -481,7 +758,7 @@ BOOST_AUTO_TEST_CASE(test_instruction_list_model) {
     req =
         "ID=10:NAME=1:TYPE=DROP\n"
         "ID=3:TYPE=CONDITIONED:NAME=3:COMMAND=boiler.on:COUPLE=boiler.off:START=replaceit:CONDITION=boiler.temperature.LT_50\n";
-    buf.clear();
+    buf.str("");
     buf << time(NULL) + 4000;
     boost::replace_all(req, "replaceit", buf.str());
     params.request_data = req;
@@ -496,10 +773,89 @@ BOOST_AUTO_TEST_CASE(test_instruction_list_model) {
 }
 
 
+BOOST_AUTO_TEST_CASE(test_instruction_batch) {
+    model_call_params_t params;
+    unique_ptr<NamedSchedule> sched(new NamedSchedule());
+    unique_ptr<BusyResources> busy(new BusyResources);
+    params.config = init.conf;
+    params.devices = init.devices;
+    params.sched = sched.get();
+    params.res = init.resources;
+    params.busy = busy.get();
+
+    params.res->release("switcher.on");
+    params.res->release("switcher.off");
+    params.res->release("boiler.on");
+    params.res->release("boiler.off");
+
+    stringstream req;
+    req << "ID=1:TYPE=SINGLE:NAME=1:COMMAND=switcher.on:START="
+        << time(NULL) + 4000 << "\n"
+        << "\n"
+        << "ID=2:TYPE=DROP:NAME=1\n"
+        << "ID=3:TYPE=SINGLE:NAME=1:COMMAND=switcher.off:START="
+        << time(NULL) + 4000;
+    string data = req.str();
+
+    // Nothing takes effect before the whole batch is in, however split
+    stringstream out;
+    InstructionBatch batch(params, out);
+    size_t first = data.find('\n') + 1;
+    for(size_t i = 0; i < first; i++) {
+        batch.feed(data.data() + i, 1);
+    }
+    batch.feed(data.data() + first, data.size() - first);
+    BOOST_CHECK_EQUAL(out.str(), "");
+    BOOST_CHECK(!sched->has("1"));
+
+    batch.finish();
+    BOOST_CHECK_EQUAL(out.str(),
+                      "ID=1:SUCCESS=1:VALUE=OK\n"
+                      "ID=DROP.2:SUCCESS=1:VALUE=dropped\n"
+                      "ID=3:SUCCESS=1:VALUE=OK\n");
+    BOOST_CHECK_EQUAL(sched->size(), 1);
+    BOOST_CHECK(params.busy->holds("1"));
+
+    // Failing lines are answered in place and leave the rest of the batch
+    stringstream mixed;
+    mixed << "ID=5:TYPE=SINGLE:NAME=1:COMMAND=switcher.on:START=1\n"
+          << "ID=6:TYPE=SINGLE:NAME=6:COMMAND=boiler.on:START=A\n"
+          << "ID=7:TYPE=SINGLE:NAME=7:COMMAND=boiler.on:START="
+          << time(NULL) + 4000 << "\n"
+          << "ID=8:TYPE=SINGLE:NAME=8:COMMAND=boiler.on:START="
+          << time(NULL) + 4000 << "\n";
+    out.str("");
+    InstructionBatch next(params, out);
+    data = mixed.str();
+    next.feed(data.data(), data.size());
+    next.finish();
+    vector<string> responses;
+    string response;
+    for(stringstream split(out.str()); getline(split, response);) {
+        responses.push_back(response);
+    }
+    BOOST_REQUIRE_EQUAL(responses.size(), 4);
+    BOOST_CHECK_EQUAL(responses[0].substr(0, 15), "ID=5:SUCCESS=0:");
+    BOOST_CHECK_EQUAL(responses[1].substr(0, 15), "ID=6:SUCCESS=0:");
+    BOOST_CHECK_EQUAL(responses[2], "ID=7:SUCCESS=1:VALUE=OK");
+    BOOST_CHECK_EQUAL(responses[3],
+                      "ID=8:SUCCESS=0:ERROR=Unable to take resource boiler.on");
+    BOOST_CHECK_EQUAL(sched->size(), 2);
+    BOOST_CHECK(params.busy->holds("7"));
+    BOOST_CHECK(!params.busy->holds("8"));
+
+    params.request_data = "ID=9:TYPE=DROP:NAME=7\n";
+    InstructionListModel model;
+    model.execute(params);
+    params.request_data = "ID=4:TYPE=DROP:NAME=1\n";
+    model.execute(params);
+}
+
+
 BOOST_AUTO_TEST_CASE(test_wrong_instruction_list_model) {
     model_call_params_t params;
     unique_ptr<NamedSchedule> sched(new NamedSchedule());
-    unique_ptr<map<string, list<string> > > busy(new map<string, list<string> >);
+    unique_ptr<BusyResources> busy(new BusyResources);
     params.config = init.conf;
     params.devices = init.devices;
     params.sched = sched.get();
@@ -526,8 +882,227 @@ BOOST_AUTO_TEST_CASE(test_wrong_instruction_list_model) {
     string res = model.execute(params);
     BOOST_CHECK_EQUAL(
         res,
-        "ID=1:SUCCESS=1:VALUE=OK\n"
         "ID=0xfff1:SUCCESS=0:ERROR=Device \"temperature\" does not support operation \"on\"\n"
+        "ID=1:SUCCESS=1:VALUE=OK\n"
         "ID=2:SUCCESS=0:ERROR=Key COMMAND required\n"
         "ID=3:SUCCESS=0:ERROR=Unable to take resource boiler.on\n");
 }
+
+
+BOOST_AUTO_TEST_CASE(test_expired_schedule_releases_resources) {
+    model_call_params_t params;
+    unique_ptr<NamedSchedule> sched(new NamedSchedule());
+    unique_ptr<BusyResources> busy(new BusyResources);
+    params.config = init.conf;
+    params.devices = init.devices;
+    params.sched = sched.get();
+    params.res = init.resources;
+    params.busy = busy.get();
+    ResourcesReclaimer reclaimer(*params.busy, *params.res);
+    sched->on_reclaim(&reclaimer);
+
+    params.res->release("boiler.on");
+
+    time_t now = time(NULL);
+    stringstream req;
+    req << "ID=1:TYPE=SINGLE:NAME=once:COMMAND=boiler.on:START=" << now << "\n";
+    params.request_data = req.str();
+
+    InstructionListModel model;
+    BOOST_CHECK_EQUAL(model.execute(params), "ID=1:SUCCESS=1:VALUE=OK\n");
+
+    // Runs once, then is reclaimed along with its resources on the
+    // following tick
+    unique_ptr<Commands> fired(sched->get_commands(now));
+    delete Executor(fired.get()).execute();
+    BOOST_CHECK(busy->holds("once"));
+    delete sched->get_commands(now + 1);
+    BOOST_CHECK_EQUAL(sched->size(), 0);
+    BOOST_CHECK(!busy->holds("once"));
+
+    // The relay stays on, the schedule ran out rather than being dropped
+    Commands releasing;
+    sched->take_releasing(releasing);
+    BOOST_CHECK_EQUAL(releasing.size(), 0);
+
+    req.str("");
+    req << "ID=2:TYPE=SINGLE:NAME=next:COMMAND=boiler.on:START=" << now << "\n";
+    params.request_data = req.str();
+    BOOST_CHECK_EQUAL(model.execute(params), "ID=2:SUCCESS=1:VALUE=OK\n");
+    params.res->release("boiler.on");
+}
+
+
+class NopCommand: public Command {
+public:
+    Result execute() throw() {
+        return Result(0);
+    }
+};
+
+
+class FakeSensor: public DeviceTemperature {
+public:
+    double value;
+    int reads;
+    bool broken;
+
+    FakeSensor(Drivers &drivers, Thermoswitcher *conf):
+        DeviceTemperature(drivers, conf), value(0), reads(0), broken(false) {};
+    ~FakeSensor() throw() {};
+
+    double get_temperature() {
+        reads++;
+        if(broken) {
+            throw TargetDeviceInternalError("No response");
+        }
+        return value;
+    }
+};
+
+
+BOOST_AUTO_TEST_CASE(test_sampled_conditions) {
+    Thermoswitcher conf(serial_link_t("targetdevice", 1), 1, 0);
+    FakeSensor sensor(*init.drivers, &conf);
+    time_t ftr = time(NULL) + 4000;
+    scheduler_stats.reset();
+
+    ConditionedSchedule sched(
+        new NopCommand, new NopCommand,
+        new TemperatureCondition(&sensor, 50, compare_lt<double>), ftr, -1);
+
+    sensor.value = 40;
+    sensor_sampler.sample();
+    unique_ptr<Commands> res(sched.get_commands(ftr));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+    BOOST_CHECK_EQUAL(sensor.reads, 1);
+
+    // Moves within the epsilon do not wake the condition up
+    sensor.value = 40 + SAMPLER_EPSILON/2;
+    sensor_sampler.sample();
+    res.reset(sched.get_commands(ftr + 1));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    BOOST_CHECK_EQUAL(scheduler_stats.evaluated[SCHEDULE_CONDITIONED], 1);
+    BOOST_CHECK_EQUAL(scheduler_stats.unchanged[SCHEDULE_CONDITIONED], 1);
+
+    sensor.value = 60;
+    sensor_sampler.sample();
+    res.reset(sched.get_commands(ftr + 2));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+    BOOST_CHECK_EQUAL(scheduler_stats.evaluated[SCHEDULE_CONDITIONED], 2);
+    BOOST_CHECK_EQUAL(sensor.reads, 3);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_failing_sensor) {
+    Thermoswitcher conf(serial_link_t("targetdevice", 1), 1, 0);
+    FakeSensor sensor(*init.drivers, &conf);
+    time_t ftr = time(NULL) + 4000;
+
+    ConditionedSchedule sched(
+        new NopCommand, new NopCommand,
+        new TemperatureCondition(&sensor, 50, compare_lt<double>), ftr, -1);
+
+    // Never read: the condition does not hold and nothing escapes
+    sensor.broken = true;
+    unique_ptr<Commands> res;
+    BOOST_REQUIRE_NO_THROW(sensor_sampler.sample());
+    BOOST_REQUIRE_NO_THROW(res.reset(sched.get_commands(ftr)));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+
+    sensor.broken = false;
+    sensor.value = 40;
+    sensor_sampler.sample();
+    res.reset(sched.get_commands(ftr + 1));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+
+    // A dead sensor keeps its last reading
+    sensor.broken = true;
+    BOOST_REQUIRE_NO_THROW(sensor_sampler.sample());
+    res.reset(sched.get_commands(ftr + 2));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_sequence_instruction) {
+    InstructionFields ref;
+    BaseInstructionLine::deconstruct(
+        "ID=1:NAME=heat:START=12:STEPS=boiler.on;WAIT_600;"
+        "UNTIL_boiler.temperature.GT_60 OR TIME.GE_2200;boiler.off",
+        ref);
+    SequenceInstructionLine instr(ref);
+    BOOST_CHECK_EQUAL(instr.id, "1");
+    BOOST_CHECK_EQUAL(instr.name, "heat");
+    BOOST_CHECK_EQUAL(instr.start, 12);
+    BOOST_CHECK_EQUAL(instr.stop, -1);
+    BOOST_REQUIRE_EQUAL(instr.steps.size(), 4);
+    BOOST_CHECK_EQUAL(instr.steps[0].op, STEP_RUN);
+    BOOST_CHECK_EQUAL(instr.steps[0].command, "boiler.on");
+    BOOST_CHECK_EQUAL(instr.steps[1].op, STEP_WAIT);
+    BOOST_CHECK_EQUAL(instr.steps[1].delay, 600);
+    BOOST_CHECK_EQUAL(instr.steps[2].op, STEP_UNTIL);
+    BOOST_CHECK(instr.steps[2].compound);
+    BOOST_CHECK_EQUAL(instr.steps[3].command, "boiler.off");
+
+    const char *wrong[] = {
+        "ID=1:NAME=heat:START=12",
+        "ID=1:NAME=heat:STEPS=boiler.on",
+        "ID=1:NAME=heat:START=12:STEPS=boiler.on;WAIT_0",
+        "ID=1:NAME=heat:START=12:STEPS=boiler.on;WAIT_x",
+        "ID=1:NAME=heat:START=12:STEPS=boiler.on;;boiler.off",
+        "ID=1:NAME=heat:START=12:STEPS=UNTIL_boiler.camera.GT_1",
+        "ID=1:NAME=heat:START=12:STEPS=UNTIL_boiler.temperature.GT_60_OFF_55",
+        "ID=1:NAME=heat:START=12:STEPS=UNTIL_boiler.temperature.GT_60_DWELL_60"
+    };
+    for(size_t i = 0; i < sizeof(wrong)/sizeof(wrong[0]); i++) {
+        ref.clear();
+        BaseInstructionLine::deconstruct(wrong[i], ref);
+        BOOST_CHECK_THROW(SequenceInstructionLine instr(ref),
+                          InteruptionHandling);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_sequence_instruction_list_model) {
+    model_call_params_t params;
+    unique_ptr<NamedSchedule> sched(new NamedSchedule());
+    unique_ptr<BusyResources> busy(new BusyResources);
+    params.config = init.conf;
+    params.devices = init.devices;
+    params.sched = sched.get();
+    params.res = init.resources;
+    params.busy = busy.get();
+
+    params.res->release("boiler.on");
+    params.res->release("boiler.off");
+
+    stringstream req;
+    req << "ID=1:TYPE=SEQUENCE:NAME=heat:START=" << time(NULL) + 4000 <<
+        ":STEPS=boiler.on;WAIT_600;UNTIL_boiler.temperature.GT_60;boiler.off\n"
+        "ID=2:TYPE=SINGLE:NAME=other:COMMAND=boiler.off:START=" <<
+        time(NULL) + 4000 << "\n";
+    params.request_data = req.str();
+
+    InstructionListModel model;
+    BOOST_CHECK_EQUAL(model.execute(params),
+                      "ID=1:SUCCESS=1:VALUE=OK\n"
+                      "ID=2:SUCCESS=0:ERROR=Unable to take resource "
+                      "boiler.off\n");
+    BOOST_CHECK(dynamic_cast<SequenceSchedule*>(params.sched->at("heat"))
+                != NULL);
+
+    params.request_data = "ID=3:TYPE=DROP:NAME=heat\n";
+    model.execute(params);
+
+    // Steps running the same command share the resource taken for it
+    req.str("");
+    req << "ID=4:TYPE=SEQUENCE:NAME=cycle:START=" << time(NULL) + 4000 <<
+        ":STEPS=boiler.on;WAIT_60;boiler.off;WAIT_60;boiler.on\n";
+    params.request_data = req.str();
+    BOOST_CHECK_EQUAL(model.execute(params), "ID=4:SUCCESS=1:VALUE=OK\n");
+
+    params.request_data = "ID=5:TYPE=DROP:NAME=cycle\n";
+    model.execute(params);
+    params.res->release("boiler.on");
+    params.res->release("boiler.off");
+}
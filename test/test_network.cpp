@@ -45,3 +45,48 @@ BOOST_AUTO_TEST_CASE(test_network_connector) {
     BOOST_REQUIRE_THROW(conn2.set_connection("localhost", 50001),
                         ConnectionError);
 }
+
+
+void feed(FrameReader &reader, const string &data, size_t chunk) {
+    for(size_t pos = 0; pos < data.length(); pos += chunk) {
+        string part = data.substr(pos, chunk);
+        memcpy(reader.space(part.length()), part.data(), part.length());
+        reader.commit(part.length());
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_frame_reader) {
+    FrameReader reader;
+    message_view_t message;
+
+    BOOST_CHECK_EQUAL(FrameReader::frame("CONFIG\nGET"), "10\nCONFIG\nGET");
+    BOOST_CHECK_EQUAL(reader.next(message), false);
+
+    // Frames split and glued at arbitrary points
+    string big(5000, 'x');
+    string stream = FrameReader::frame("first") + FrameReader::frame(big) +
+        FrameReader::frame("") + FrameReader::frame("last");
+    feed(reader, stream.substr(0, 1024), 1024);
+    BOOST_REQUIRE(reader.next(message));
+    BOOST_CHECK_EQUAL(message.str(), "first");
+    BOOST_CHECK_EQUAL(reader.ready(), false);
+    BOOST_CHECK_EQUAL(reader.next(message), false);
+    feed(reader, stream.substr(1024), 7);
+    BOOST_CHECK(reader.ready());
+    BOOST_REQUIRE(reader.next(message));
+    BOOST_CHECK_EQUAL(message.size, big.length());
+    BOOST_CHECK(message.str() == big);
+    BOOST_REQUIRE(reader.next(message));
+    BOOST_CHECK_EQUAL(message.size, 0);
+    BOOST_REQUIRE(reader.next(message));
+    BOOST_CHECK_EQUAL(message.str(), "last");
+    BOOST_CHECK_EQUAL(reader.next(message), false);
+
+    FrameReader wrong;
+    feed(wrong, "12a\nxx", 16);
+    BOOST_CHECK_THROW(wrong.next(message), ConnectionError);
+    FrameReader huge;
+    feed(huge, "99999999999\n", 16);
+    BOOST_CHECK_THROW(huge.next(message), ConnectionError);
+}
@@ -0,0 +1,126 @@
+#define BOOST_TEST_IGNORE_SIGKILL
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE OutboxCpp
+
+#include <cstdlib>
+#include <fstream>
+
+#include <unistd.h>
+#include <dirent.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include "../outbox.hpp"
+
+
+using namespace std;
+
+
+// Fresh directory removed along with the segments left in it
+class Spool {
+public:
+    string path;
+
+    Spool() {
+        char name[] = "/tmp/test_outbox.XXXXXX";
+        path = mkdtemp(name);
+    }
+
+    ~Spool() throw() {
+        DIR *dir = opendir(path.c_str());
+        for(struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+            unlink((path + "/" + entry->d_name).c_str());
+        }
+        closedir(dir);
+        rmdir(path.c_str());
+    }
+
+    size_t segments() const {
+        size_t res = 0;
+        DIR *dir = opendir(path.c_str());
+        for(struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+            res += string(entry->d_name).find(".seg") != string::npos;
+        }
+        closedir(dir);
+        return res;
+    }
+};
+
+
+BOOST_AUTO_TEST_CASE(test_not_opened) {
+    Outbox box;
+    box.push("EVENT=1");
+    BOOST_CHECK_EQUAL(box.pending(), 0);
+    BOOST_CHECK_EQUAL(box.batch(10), "SEQ=0:PENDING=0:DROPPED=1\n");
+}
+
+
+BOOST_AUTO_TEST_CASE(test_batches_until_acknowledged) {
+    Spool spool;
+    {
+        Outbox box;
+        box.open(spool.path);
+        box.push("EVENT=1");
+        box.push("EVENT=2");
+        box.push("EVENT=3");
+        BOOST_CHECK_EQUAL(box.pending(), 3);
+        BOOST_CHECK_EQUAL(box.batch(2),
+                          "SEQ=2:PENDING=1:DROPPED=0\nEVENT=1\nEVENT=2\n");
+        // Lost acknowledgement, the same batch is sent again
+        BOOST_CHECK_EQUAL(box.batch(2),
+                          "SEQ=2:PENDING=1:DROPPED=0\nEVENT=1\nEVENT=2\n");
+        box.acknowledge(2);
+        BOOST_CHECK_EQUAL(box.batch(2), "SEQ=3:PENDING=0:DROPPED=0\nEVENT=3\n");
+    }
+
+    // Whatever was not acknowledged survives a restart
+    Outbox box;
+    box.open(spool.path);
+    BOOST_CHECK_EQUAL(box.pending(), 1);
+    box.push("EVENT=4");
+    BOOST_CHECK_EQUAL(box.batch(10),
+                      "SEQ=4:PENDING=0:DROPPED=0\nEVENT=3\nEVENT=4\n");
+    box.acknowledge(4);
+    BOOST_CHECK_EQUAL(box.pending(), 0);
+    BOOST_CHECK_EQUAL(spool.segments(), 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_torn_record) {
+    Spool spool;
+    {
+        Outbox box;
+        box.open(spool.path);
+        box.push("EVENT=1");
+        box.push("EVENT=2");
+    }
+    {
+        // A crash in the middle of the third record
+        ofstream segment((spool.path + "/00000000000000000001.seg").c_str(),
+                         ios::app);
+        segment << "3 7 ffff\nEVE";
+    }
+
+    Outbox box;
+    box.open(spool.path);
+    BOOST_CHECK_EQUAL(box.pending(), 2);
+    box.push("EVENT=3");
+    BOOST_CHECK_EQUAL(box.batch(10),
+                      "SEQ=3:PENDING=0:DROPPED=0\n"
+                      "EVENT=1\nEVENT=2\nEVENT=3\n");
+}
+
+
+BOOST_AUTO_TEST_CASE(test_size_cap_drops_oldest) {
+    Spool spool;
+    Outbox box;
+    // Records take about 30 bytes, two of them fill a segment
+    box.open(spool.path, 150, 48);
+    for(int i = 0; i < 10; i++) {
+        box.push("EVENT=abcdefghij");
+    }
+    BOOST_CHECK(spool.segments() <= 3);
+    string batch = box.batch(10);
+    BOOST_CHECK_EQUAL(batch.substr(0, batch.find('\n')),
+                      "SEQ=10:PENDING=0:DROPPED=6");
+}
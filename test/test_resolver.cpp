@@ -0,0 +1,89 @@
+#define BOOST_TEST_IGNORE_SIGKILL
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE ResolverCpp
+
+#include <cstring>
+
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include "../resolver.hpp"
+#include "../network.hpp"
+
+
+using namespace std;
+
+
+static endpoint_t loopback(int port) {
+    endpoint_t endpoint;
+    memset(&endpoint.address, 0, sizeof(endpoint.address));
+    struct sockaddr_in *address = (struct sockaddr_in*)&endpoint.address;
+    address->sin_family = AF_INET;
+    address->sin_port = htons(port);
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    endpoint.length = sizeof(struct sockaddr_in);
+    return endpoint;
+}
+
+
+// Listens on an ephemeral loopback port, returns the socket
+static int listening(int &port) {
+    endpoint_t endpoint = loopback(0);
+    int handle = socket(AF_INET, SOCK_STREAM, 0);
+    BOOST_REQUIRE(handle >= 0);
+    BOOST_REQUIRE_EQUAL(
+        bind(handle, (struct sockaddr*)&endpoint.address, endpoint.length), 0);
+    BOOST_REQUIRE_EQUAL(listen(handle, 4), 0);
+    socklen_t length = endpoint.length;
+    getsockname(handle, (struct sockaddr*)&endpoint.address, &length);
+    port = ntohs(((struct sockaddr_in*)&endpoint.address)->sin_port);
+    return handle;
+}
+
+
+BOOST_AUTO_TEST_CASE(test_resolve_cached) {
+    Resolver cached(60);
+    endpoints_t endpoints = cached.resolve("127.0.0.1", 4444);
+    BOOST_REQUIRE_EQUAL(endpoints.size(), 1);
+    BOOST_CHECK_EQUAL(endpoints[0].family(), AF_INET);
+    struct sockaddr_in *address = (struct sockaddr_in*)&endpoints[0].address;
+    BOOST_CHECK_EQUAL(ntohs(address->sin_port), 4444);
+
+    // A fresh entry is answered without waiting for a lookup
+    BOOST_CHECK_EQUAL(cached.resolve("127.0.0.1", 4444, 0).size(), 1);
+    cached.forget("127.0.0.1", 4444);
+    BOOST_CHECK_EQUAL(cached.resolve("127.0.0.1", 4444).size(), 1);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_resolve_failure) {
+    Resolver uncached(0);
+    BOOST_CHECK_THROW(uncached.resolve("no-such-host.invalid", 4444),
+                      ConnectionError);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_race_connect) {
+    int port;
+    int server = listening(port);
+
+    // Nothing listens on the server port once it is closed
+    int closed_port;
+    close(listening(closed_port));
+
+    endpoints_t endpoints;
+    endpoints.push_back(loopback(closed_port));
+    endpoints.push_back(loopback(port));
+    int handle = race_connect(endpoints, 1000, 500);
+    BOOST_CHECK(handle >= 0);
+    close(handle);
+
+    endpoints.pop_back();
+    BOOST_CHECK_THROW(race_connect(endpoints, 1000, 500), ConnectionError);
+    BOOST_CHECK_THROW(race_connect(endpoints_t(), 1000, 500),
+                      ConnectionError);
+    close(server);
+}
@@ -16,8 +16,8 @@ class TestCommand2: public Command {
 public:
     static int counter;
 
-    Result *execute() throw() {
-        return new IntResult(TestCommand2::counter++);
+    Result execute() throw() {
+        return Result(TestCommand2::counter++);
     }
 };
 int TestCommand2::counter = 0;
@@ -31,13 +31,49 @@ public:
         TestCommand2::counter++;
     }
 
-    Result *execute() throw() {
-        return new IntResult(TestCommand::counter++);
+    Result execute() throw() {
+        return Result(TestCommand::counter++);
     }
 };
 int TestCommand::counter = 0;
 
 
+class RelayOff: public Command {
+public:
+    Result execute() throw();
+};
+
+
+// Switches a relay on, once it went through the off is left to be run
+// when its schedule is let go
+class RelayOn: public Command {
+private:
+    bool engaged;
+
+public:
+    static bool relay;
+    static RelayOff off;
+
+    RelayOn(): engaged(false) {};
+
+    Result execute() throw() {
+        relay = engaged = true;
+        return Result(1);
+    }
+    Command *releaser() throw() {
+        return engaged ? &off : NULL;
+    }
+};
+bool RelayOn::relay = false;
+RelayOff RelayOn::off;
+
+
+Result RelayOff::execute() throw() {
+    RelayOn::relay = false;
+    return Result(0);
+}
+
+
 time_t future() {
     return time(NULL) + 1000;
 }
@@ -55,17 +91,79 @@ BOOST_AUTO_TEST_CASE(test_runtime_executor) {
     int i = 0;
     for(Results::iterator it = out->begin();
         it != out->end(); it++, i++) {
-        BOOST_CHECK_EQUAL(atol((**it).value().c_str()), i);
+        BOOST_CHECK_EQUAL(atol(it->value().c_str()), i);
     }
 
     for(Commands::iterator it = res.begin();
         it != res.end(); it++) {
-        delete *it;
+        delete it->command;
     }
     delete out;
 }
 
 
+BOOST_AUTO_TEST_CASE(test_executor_deadline) {
+    TestCommand cmd;
+    Commands res;
+    res.push_back(queued_command_t(&cmd, time(NULL) - 10));
+    res.push_back(queued_command_t(&cmd, time(NULL) + 10));
+    res.push_back(queued_command_t(&cmd));
+
+    TestCommand::counter = 0;
+    Executor exec(&res);
+    unique_ptr<Results> out(exec.execute());
+    BOOST_REQUIRE_EQUAL(out->size(), 3);
+    BOOST_CHECK(out->at(0).is_error());
+    BOOST_CHECK_EQUAL(out->at(0).code(), RESULT_TIMEOUT);
+    BOOST_CHECK(!out->at(1).is_error());
+    BOOST_CHECK(!out->at(2).is_error());
+    BOOST_CHECK_EQUAL(exec.get_timed_out(), 1);
+    BOOST_CHECK_EQUAL(TestCommand::counter, 2);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_drop_during_execution) {
+    time_t now = time(NULL);
+    NamedSchedule sched;
+    sched.set_schedule("1", new SingleCommandSchedule(new TestCommand, now, -1));
+    sched.set_schedule("2", new SingleCommandSchedule(new TestCommand, now, -1));
+
+    unique_ptr<Commands> res(sched.get_commands(now));
+    BOOST_REQUIRE_EQUAL(res->size(), 2);
+    sched.begin_execution();
+
+    // Dropped before the executor got to it: not deleted yet, but cancelled
+    TestCommand2::counter = 0;
+    sched.drop_schedule("2");
+    BOOST_CHECK_EQUAL(TestCommand2::counter, 0);
+    BOOST_CHECK_EQUAL(sched.size(), 1);
+
+    TestCommand::counter = 0;
+    Executor exec(res.get());
+    unique_ptr<Results> out(exec.execute());
+    BOOST_CHECK_EQUAL(TestCommand::counter, 1);
+    BOOST_CHECK_EQUAL(exec.get_cancelled(), 1);
+    BOOST_CHECK_EQUAL(out->at(1).code(), RESULT_CANCELLED);
+
+    sched.finish_execution();
+    BOOST_CHECK_EQUAL(TestCommand2::counter, 1);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_result_values) {
+    BOOST_CHECK_EQUAL(Result(1).value(), "1");
+    BOOST_CHECK_EQUAL(Result(0.5).value(), "0.5");
+    BOOST_CHECK_EQUAL(Result(string("OK")).value(), "OK");
+    BOOST_CHECK_EQUAL(Result(0.5).number(), 0.5);
+
+    Result error(RESULT_SERIAL_ERROR, "No response");
+    BOOST_CHECK(error.is_error());
+    BOOST_CHECK_EQUAL(error.code(), RESULT_SERIAL_ERROR);
+    BOOST_CHECK_EQUAL(error.value(), "No response");
+    BOOST_CHECK(!Result(1).is_error());
+}
+
+
 BOOST_AUTO_TEST_CASE(test_single_command) {
     time_t ftr = future();
 
@@ -268,6 +366,55 @@ BOOST_AUTO_TEST_CASE(test_conditioned_urgent_exit) {
 }
 
 
+class Reading: public BaseCondition {
+public:
+    double value, bound, release;
+
+    ~Reading() throw() {};
+    Reading(double bnd, double rls): value(0), bound(bnd), release(rls) {};
+    bool indeed() {
+        return value < bound;
+    }
+    bool holds() {
+        return value < release;
+    }
+};
+
+
+BOOST_AUTO_TEST_CASE(test_conditioned_deadband_dwell) {
+    time_t ftr = future();
+    Reading *reading = new Reading(50, 55);
+    ConditionedSchedule sched(new TestCommand, new TestCommand2,
+                              reading, ftr, -1, 30);
+    scheduler_stats.reset();
+
+    reading->value = 40;
+    unique_ptr<Commands> res(sched.get_commands(ftr));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+
+    // Inside the deadband the engaged condition holds
+    reading->value = 52;
+    res.reset(sched.get_commands(ftr + 10));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+
+    // Released too early after the last switch
+    reading->value = 60;
+    res.reset(sched.get_commands(ftr + 20));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    BOOST_CHECK_EQUAL(scheduler_stats.deferred[SCHEDULE_CONDITIONED], 1);
+    res.reset(sched.get_commands(ftr + 30));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+
+    // Not engaged again until below the lower threshold
+    reading->value = 52;
+    res.reset(sched.get_commands(ftr + 40));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    reading->value = 49;
+    res.reset(sched.get_commands(ftr + 70));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+}
+
+
 BOOST_AUTO_TEST_CASE(test_stop_point_single) {
     time_t ftr = future();
 
@@ -498,3 +645,288 @@ BOOST_AUTO_TEST_CASE(test_general_schedule) {
     delete exec;
     delete nores;
 }
+
+
+BOOST_AUTO_TEST_CASE(test_catchup_policies) {
+    time_t ftr = future();
+
+    // Four restarts came due during a stall
+    scheduler_stats.reset();
+    SingleCommandSchedule once(new TestCommand, ftr, -1, 100, CATCHUP_ONCE);
+    unique_ptr<Commands> res(once.get_commands(ftr + 350));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+    BOOST_CHECK_EQUAL(res->front().fire, ftr + 300);
+    BOOST_CHECK_EQUAL(scheduler_stats.coalesced[SCHEDULE_SINGLE], 3);
+    res.reset(once.get_commands(ftr + 399));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    res.reset(once.get_commands(ftr + 400));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+
+    SingleCommandSchedule all(new TestCommand, ftr, -1, 100, CATCHUP_ALL);
+    res.reset(all.get_commands(ftr + 350));
+    BOOST_REQUIRE_EQUAL(res->size(), 4);
+    BOOST_CHECK_EQUAL(res->front().fire, ftr);
+    BOOST_CHECK_EQUAL(res->back().fire, ftr + 300);
+
+    SingleCommandSchedule skip(new TestCommand, ftr, -1, 100, CATCHUP_SKIP);
+    res.reset(skip.get_commands(ftr + 350));
+    BOOST_REQUIRE_EQUAL(res->size(), 1);
+    BOOST_CHECK_EQUAL(res->front().fire, ftr + 300);
+    BOOST_CHECK_EQUAL(scheduler_stats.missed[SCHEDULE_SINGLE], 3);
+    res.reset(skip.get_commands(ftr + 399));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    res.reset(skip.get_commands(ftr + 401));
+    BOOST_REQUIRE_EQUAL(res->size(), 1);
+    BOOST_CHECK_EQUAL(res->front().fire, ftr + 400);
+    BOOST_CHECK_EQUAL(scheduler_stats.missed[SCHEDULE_SINGLE], 3);
+
+    // Restarts past the stop point are never due
+    SingleCommandSchedule stop(new TestCommand, ftr, ftr + 250, 100,
+                               CATCHUP_ALL);
+    res.reset(stop.get_commands(ftr + 249));
+    BOOST_CHECK_EQUAL(res->size(), 3);
+
+    BOOST_CHECK_THROW(CoupledCommandSchedule(new TestCommand, ftr, -1,
+                                             new TestCommand2, 20, 100,
+                                             CATCHUP_ALL),
+                      ScheduleSetupError);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_lateness_stats) {
+    time_t now = time(NULL);
+    scheduler_stats.reset();
+
+    SingleCommandSchedule sched(new TestCommand, now - 2, -1);
+    unique_ptr<Commands> res(sched.get_commands(now));
+    Executor exec(res.get());
+    delete exec.execute();
+
+    histogram_snapshot_t snap =
+        scheduler_stats.lateness[SCHEDULE_SINGLE].snapshot();
+    BOOST_CHECK_EQUAL(snap.count, 1);
+    BOOST_CHECK(snap.max >= 2000);
+    BOOST_CHECK_EQUAL(scheduler_stats.fired[SCHEDULE_SINGLE], 1);
+    BOOST_CHECK_EQUAL(scheduler_stats.fired[SCHEDULE_COUPLED], 0);
+}
+
+
+class ReclaimedNames: public ReclaimHandler, public vector<string> {
+public:
+    void reclaimed(const string &name) {
+        push_back(name);
+    }
+};
+
+
+BOOST_AUTO_TEST_CASE(test_expiry_reclaim) {
+    time_t ftr = future();
+    NamedSchedule sched;
+    ReclaimedNames names;
+    sched.on_reclaim(&names);
+    for(int i = 0; i < RUNTIME_RECLAIM_BATCH + 6; i++) {
+        stringstream name;
+        name << "once" << i;
+        sched.set_schedule(name.str(),
+                           new SingleCommandSchedule(new TestCommand, ftr, -1));
+    }
+    sched.set_schedule("forever",
+                       new SingleCommandSchedule(new TestCommand, ftr, -1, 600));
+
+    unique_ptr<Commands> res(sched.get_commands(ftr));
+    BOOST_CHECK_EQUAL(res->size(), RUNTIME_RECLAIM_BATCH + 7);
+    BOOST_CHECK_EQUAL(sched.is_expired(), false);
+    BOOST_CHECK_EQUAL(sched.size(), RUNTIME_RECLAIM_BATCH + 7);
+
+    // Expired schedules are not asked for commands again and are reclaimed
+    // a batch per tick
+    res.reset(sched.get_commands(ftr + 600));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+    BOOST_CHECK_EQUAL(sched.size(), 7);
+    res.reset(sched.get_commands(ftr + 1200));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+    BOOST_CHECK_EQUAL(sched.size(), 1);
+
+    BOOST_CHECK_EQUAL(names.size(), RUNTIME_RECLAIM_BATCH + 6);
+    BOOST_CHECK_EQUAL(names.front(), "once0");
+    names.clear();
+
+    // A replaced schedule is not reclaimed on behalf of the expired one
+    sched.set_schedule("again",
+                       new SingleCommandSchedule(new TestCommand, ftr, -1));
+    res.reset(sched.get_commands(ftr));
+    sched.set_schedule("again",
+                       new SingleCommandSchedule(new TestCommand, ftr, -1, 600));
+    res.reset(sched.get_commands(ftr + 600));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+    BOOST_CHECK(sched.has("again"));
+    BOOST_CHECK_EQUAL(names.size(), 0);
+
+    sched.drop_schedule("forever");
+    sched.drop_schedule("again");
+    BOOST_CHECK_EQUAL(sched.is_expired(), true);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_release_on_stop_and_drop) {
+    time_t ftr = future();
+    NamedSchedule sched;
+    unique_ptr<Commands> res;
+    unique_ptr<Results> out;
+
+    // Stopped: the off is left once the schedule is reclaimed
+    sched.set_schedule("stopped", new SingleCommandSchedule(
+                           new RelayOn, ftr, ftr + 1000, 600));
+    res.reset(sched.get_commands(ftr));
+    out.reset(Executor(res.get()).execute());
+    BOOST_CHECK_EQUAL(RelayOn::relay, true);
+    res.reset(sched.get_commands(ftr + 1200));
+    sched.take_releasing(*res);
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    res.reset(sched.get_commands(ftr + 1800));
+    BOOST_CHECK_EQUAL(sched.size(), 0);
+    sched.take_releasing(*res);
+    BOOST_REQUIRE_EQUAL(res->size(), 1);
+    out.reset(Executor(res.get()).execute());
+    BOOST_CHECK_EQUAL(RelayOn::relay, false);
+
+    // Ran out by itself: reclaimed without touching the relay
+    sched.set_schedule("once", new SingleCommandSchedule(new RelayOn, ftr, -1));
+    res.reset(sched.get_commands(ftr));
+    out.reset(Executor(res.get()).execute());
+    res.reset(sched.get_commands(ftr + 5));
+    BOOST_CHECK_EQUAL(sched.size(), 0);
+    sched.take_releasing(*res);
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    BOOST_CHECK_EQUAL(RelayOn::relay, true);
+
+    // Dropped: the off is left at once, queued ahead of other commands
+    sched.set_schedule("dropped", new SingleCommandSchedule(
+                           new RelayOn, ftr, -1, 600));
+    res.reset(sched.get_commands(ftr));
+    out.reset(Executor(res.get()).execute());
+    sched.drop_schedule("dropped");
+    res.reset(new Commands);
+    res->push_back(queued_command_t(new TestCommand));
+    sched.take_releasing(*res);
+    BOOST_REQUIRE_EQUAL(res->size(), 2);
+    BOOST_CHECK(res->front().command == &RelayOn::off);
+    delete res->back().command;
+    res->pop_back();
+    out.reset(Executor(res.get()).execute());
+    BOOST_CHECK_EQUAL(RelayOn::relay, false);
+
+    // Dropped while executing: only after the execution
+    sched.set_schedule("dropped", new SingleCommandSchedule(
+                           new RelayOn, ftr, -1, 600));
+    res.reset(sched.get_commands(ftr));
+    sched.begin_execution();
+    out.reset(Executor(res.get()).execute());
+    sched.drop_schedule("dropped");
+    res.reset(new Commands);
+    sched.take_releasing(*res);
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    sched.finish_execution();
+    sched.take_releasing(*res);
+    BOOST_CHECK_EQUAL(res->size(), 1);
+
+    // Never switched on: nothing to switch off
+    sched.set_schedule("idle", new SingleCommandSchedule(
+                           new RelayOn, ftr + 5000, -1));
+    sched.drop_schedule("idle");
+    res.reset(new Commands);
+    sched.take_releasing(*res);
+    BOOST_CHECK_EQUAL(res->size(), 0);
+}
+
+
+// Tells a change only once, as sensor observers do
+class Latched: public BaseCondition {
+public:
+    bool value, moved;
+
+    Latched(): value(false), moved(false) {};
+    bool indeed() {
+        return value;
+    }
+    bool changed() {
+        bool res = moved;
+        moved = false;
+        return res;
+    }
+};
+
+
+BOOST_AUTO_TEST_CASE(test_sequence_until_holding) {
+    time_t ftr = future();
+    Latched *holding = new Latched;
+    Latched *later = new Latched;
+    SequenceSchedule sched(ftr);
+    sched
+        .run(new TestCommand)
+        .wait(600)
+        .until(holding)
+        .run(new TestCommand)
+        .until(later)
+        .run(new TestCommand);
+
+    // True with no change pending when the step is reached
+    holding->value = true;
+    unique_ptr<Commands> res(sched.get_commands(ftr));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+    res.reset(sched.get_commands(ftr + 600));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+
+    // False at first, then looked at again only after a change
+    res.reset(sched.get_commands(ftr + 700));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    later->value = true;
+    res.reset(sched.get_commands(ftr + 800));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    later->moved = true;
+    res.reset(sched.get_commands(ftr + 900));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+    BOOST_CHECK_EQUAL(sched.is_expired(), true);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_sequence_schedule) {
+    time_t ftr = future();
+    Reading *reading = new Reading(50, 50);
+    SequenceSchedule sched(ftr);
+    sched
+        .run(new TestCommand)
+        .wait(600)
+        .until(reading)
+        .run(new TestCommand2)
+        .run(new TestCommand2);
+    BOOST_CHECK_THROW(sched.wait(0), ScheduleSetupError);
+
+    reading->value = 60;
+    unique_ptr<Commands> res(sched.get_commands(ftr - 1));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    res.reset(sched.get_commands(ftr));
+    BOOST_REQUIRE_EQUAL(res->size(), 1);
+    BOOST_CHECK_EQUAL(res->front().fire, ftr);
+    BOOST_CHECK_EQUAL(res->front().kind, SCHEDULE_SEQUENCE);
+    res.reset(sched.get_commands(ftr + 599));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+
+    // Waits for the condition once the delay has passed
+    res.reset(sched.get_commands(ftr + 600));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    BOOST_CHECK_EQUAL(sched.is_expired(), false);
+    reading->value = 40;
+    res.reset(sched.get_commands(ftr + 700));
+    BOOST_REQUIRE_EQUAL(res->size(), 2);
+    BOOST_CHECK_EQUAL(res->back().fire, ftr + 700);
+    BOOST_CHECK_EQUAL(sched.is_expired(), true);
+
+    SequenceSchedule stopped(ftr, ftr + 100);
+    stopped.run(new TestCommand).wait(200).run(new TestCommand);
+    res.reset(stopped.get_commands(ftr));
+    BOOST_CHECK_EQUAL(res->size(), 1);
+    res.reset(stopped.get_commands(ftr + 200));
+    BOOST_CHECK_EQUAL(res->size(), 0);
+    BOOST_CHECK_EQUAL(stopped.is_expired(), true);
+}
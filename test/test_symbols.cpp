@@ -0,0 +1,67 @@
+#define BOOST_TEST_IGNORE_SIGKILL
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE SymbolsCpp
+
+#include <sstream>
+
+#include <boost/test/unit_test.hpp>
+
+#include "../symbols.hpp"
+
+
+using namespace std;
+
+
+BOOST_AUTO_TEST_CASE(test_intern_lookup) {
+    SymbolTable table;
+    symbol_t boiler = table.intern("boiler");
+    symbol_t switcher = table.intern("switcher");
+
+    BOOST_CHECK_EQUAL(boiler, 0);
+    BOOST_CHECK_EQUAL(switcher, 1);
+    BOOST_CHECK_EQUAL(table.intern("boiler"), boiler);
+    BOOST_CHECK_EQUAL(table.lookup("switcher"), switcher);
+    BOOST_CHECK_EQUAL(table.lookup("temperature"), NO_SYMBOL);
+    BOOST_CHECK_EQUAL(table.name(boiler), "boiler");
+    BOOST_CHECK_EQUAL(table.size(), 2);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_release_reuse) {
+    SymbolTable table;
+    table.intern("1");
+    symbol_t two = table.intern("2");
+    table.intern("3");
+
+    table.release(two);
+    BOOST_CHECK_EQUAL(table.lookup("2"), NO_SYMBOL);
+    BOOST_CHECK(!table.valid(two));
+    BOOST_CHECK_EQUAL(table.size(), 2);
+    BOOST_CHECK_THROW(table.name(two), out_of_range);
+
+    BOOST_CHECK_EQUAL(table.intern("4"), two);
+    BOOST_CHECK_EQUAL(table.lookup("3"), 2);
+    BOOST_CHECK_EQUAL(table.bound(), 3);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_growth) {
+    const int LIMIT = 10000;
+    SymbolTable table;
+    for(int i = 0; i < LIMIT; i++) {
+        stringstream buf;
+        buf << "task-" << i;
+        BOOST_REQUIRE_EQUAL(table.intern(buf.str()), i);
+    }
+    for(int i = 0; i < LIMIT; i += 2) {
+        stringstream buf;
+        buf << "task-" << i;
+        table.release(table.lookup(buf.str()));
+    }
+    BOOST_CHECK_EQUAL(table.size(), LIMIT/2);
+    for(int i = 0; i < LIMIT; i++) {
+        stringstream buf;
+        buf << "task-" << i;
+        BOOST_CHECK_EQUAL(table.lookup(buf.str()), i % 2 ? i : NO_SYMBOL);
+    }
+}
@@ -0,0 +1,130 @@
+#define BOOST_TEST_IGNORE_SIGKILL
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE TelemetryCpp
+
+#include <cmath>
+#include <stdexcept>
+
+#include <boost/test/unit_test.hpp>
+
+#include "../telemetry.hpp"
+
+
+using namespace std;
+
+
+BOOST_AUTO_TEST_CASE(test_series_roundtrip) {
+    vector<time_t> times;
+    vector<double> values;
+    time_t now = 1500000000;
+    for(int i = 0; i < 500; i++) {
+        // Mostly regular minutes with an occasional late or lost reading
+        now += i % 97 == 0 ? 61 : (i % 211 == 0 ? 3600 : 60);
+        times.push_back(now);
+        values.push_back(i % 50 == 0 ? -12.5 : floor(20 + sin(i/30.0)*40)/2);
+    }
+    values[7] = 1e300;
+    values[8] = 0.1;
+
+    SeriesEncoder encoder;
+    for(size_t i = 0; i < times.size(); i++) {
+        encoder.append(times[i], values[i]);
+    }
+    BOOST_CHECK_EQUAL(encoder.size(), times.size());
+    // Plain text would take about 20 bytes a sample
+    BOOST_CHECK(encoder.data().size() < times.size()*3);
+
+    SeriesDecoder decoder(encoder.data());
+    for(size_t i = 0; i < times.size(); i++) {
+        time_t time;
+        double value;
+        decoder.next(time, value);
+        BOOST_REQUIRE_EQUAL(time, times[i]);
+        BOOST_REQUIRE_EQUAL(value, values[i]);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(test_steady_series) {
+    SeriesEncoder encoder;
+    for(int i = 0; i < 1000; i++) {
+        encoder.append(1500000000 + i*60, 21.5);
+    }
+    // Two bits a sample once the interval is known
+    BOOST_CHECK_EQUAL(encoder.data().size(), (96 + 10 + 998*2 + 7)/8);
+
+    SeriesDecoder decoder(encoder.data());
+    time_t time;
+    double value;
+    for(int i = 0; i < 1000; i++) {
+        decoder.next(time, value);
+    }
+    BOOST_CHECK_EQUAL(time, 1500000000 + 999*60);
+    BOOST_CHECK_EQUAL(value, 21.5);
+
+    vector<unsigned char> truncated(4);
+    SeriesDecoder empty(truncated);
+    BOOST_CHECK_THROW(empty.next(time, value), out_of_range);
+}
+
+
+BOOST_AUTO_TEST_CASE(test_base64) {
+    vector<unsigned char> data;
+    BOOST_CHECK_EQUAL(base64(data), "");
+    const char *text = "foobar";
+    for(int i = 0; i < 6; i++) {
+        data.push_back(text[i]);
+    }
+    BOOST_CHECK_EQUAL(base64(data), "Zm9vYmFy");
+    data.pop_back();
+    BOOST_CHECK_EQUAL(base64(data), "Zm9vYmE=");
+    data.pop_back();
+    BOOST_CHECK_EQUAL(base64(data), "Zm9vYg==");
+}
+
+
+BOOST_AUTO_TEST_CASE(test_batches_until_acknowledged) {
+    Telemetry buffer(60, 4);
+    size_t boiler = buffer.track("boiler", NULL);
+    size_t outside = buffer.track("outside", NULL);
+    BOOST_CHECK_EQUAL(buffer.batch(10), "SEQ=0:PENDING=0:DROPPED=0\n");
+
+    for(int i = 0; i < 3; i++) {
+        buffer.record(boiler, 1000 + i*60, 60);
+        buffer.record(outside, 1000 + i*60, -5);
+    }
+    string first = buffer.batch(4);
+    BOOST_CHECK_EQUAL(first.substr(0, first.find('\n')),
+                      "SEQ=4:PENDING=2:DROPPED=0");
+    BOOST_CHECK(first.find("\nboiler:COUNT=2:DATA=") != string::npos);
+    BOOST_CHECK(first.find("\noutside:COUNT=2:DATA=") != string::npos);
+
+    // Lost acknowledgement, the same batch is sent again
+    BOOST_CHECK_EQUAL(buffer.batch(4), first);
+
+    buffer.acknowledge(4);
+    string second = buffer.batch(4);
+    BOOST_CHECK_EQUAL(second.substr(0, second.find('\n')),
+                      "SEQ=6:PENDING=0:DROPPED=0");
+    BOOST_CHECK(second.find("\nboiler:COUNT=1:DATA=") != string::npos);
+
+    // The oldest samples make room once the buffer is full
+    for(int i = 0; i < 5; i++) {
+        buffer.record(boiler, 2000 + i*60, 61);
+    }
+    buffer.acknowledge(6);
+    string third = buffer.batch(10);
+    BOOST_CHECK_EQUAL(third.substr(0, third.find('\n')),
+                      "SEQ=11:PENDING=0:DROPPED=2");
+    BOOST_CHECK(third.find("\nboiler:COUNT=4:DATA=") != string::npos);
+
+    // Far behind after an overflow, the next batch still carries data
+    buffer.acknowledge(11);
+    for(int i = 0; i < 10; i++) {
+        buffer.record(boiler, 3000 + i*60, 62);
+    }
+    string fourth = buffer.batch(2);
+    BOOST_CHECK_EQUAL(fourth.substr(0, fourth.find('\n')),
+                      "SEQ=19:PENDING=2:DROPPED=8");
+    BOOST_CHECK(fourth.find("\nboiler:COUNT=2:DATA=") != string::npos);
+}